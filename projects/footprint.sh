@@ -0,0 +1,120 @@
+#!/bin/sh
+# footprint.sh - code, IRAM and XRAM usage of an SDCC build per module
+#
+# usage: footprint.sh target module.rel ...
+#        run in the build directory (out/) after the link, see 'make footprint'
+#
+# The module sizes are the areas of the .rel files, the totals and the limits
+# come from target.mem, the linked library modules from target.map. The
+# overlay area (OSEG) is shared by the modules, so their IRAM can add up to
+# more than the total.
+
+if [ $# -lt 2 ]; then
+    echo "usage: footprint.sh target module.rel ..." >&2
+    exit 1
+fi
+TARGET=$1
+shift
+for f in "$TARGET.mem" "$TARGET.map" "$@"; do
+    if [ ! -f "$f" ]; then
+        echo "footprint.sh: missing $f, build first" >&2
+        exit 1
+    fi
+done
+
+awk -v mem="$TARGET.mem" -v map="$TARGET.map" '
+function num(s,    i, c, v) {
+    if (radix != 16) {
+        return s + 0
+    }
+    v = 0
+    s = toupper(s)
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789ABCDEF", substr(s, i, 1))
+        if (c == 0) {
+            break
+        }
+        v = v * 16 + c - 1
+    }
+    return v
+}
+
+# memory class of an mcs51 area
+function class(area) {
+    if (area ~ /^(CSEG|CONST|HOME|CABS|GSINIT|GSFINAL|XINIT|INITIALIZER)/) return "code"
+    if (area ~ /^(XSEG|PSEG|XISEG|XABS|XSTK)/) return "xram"
+    if (area ~ /^BSEG/) return "bits"
+    if (area ~ /^(DSEG|OSEG|ISEG|IABS|SSEG|REG_BANK|BIT_BANK)/) return "iram"
+    return ""
+}
+
+FNR == 1 {
+    mod = FILENAME
+    sub(/\.rel$/, "", mod)
+    mods[++nmods] = mod
+    radix = ($1 ~ /^X/) ? 16 : 10
+}
+
+# A <area> size <n> flags <f> addr <a>
+$1 == "A" && $3 == "size" {
+    c = class($2)
+    if (c != "") {
+        size[mod, c] += num($4)
+        sum[c] += num($4)
+    }
+}
+
+END {
+    printf("%-20s %8s %8s %8s %8s\n", "module", "code", "iram", "bits", "xram")
+    for (i = 1; i <= nmods; i++) {
+        m = mods[i]
+        printf("%-20s %8d %8d %8d %8d\n", m, size[m, "code"], size[m, "iram"],
+                size[m, "bits"], size[m, "xram"])
+    }
+
+    # Other memory table: name, start, end, size, max
+    while ((getline line < mem) > 0) {
+        n = split(line, f)
+        if (line ~ /^ *EXTERNAL RAM/) {
+            xram = f[n - 1]; xramMax = f[n]
+        } else if (line ~ /^ *ROM\/EPROM\/FLASH/) {
+            code = f[n - 1]; codeMax = f[n]
+        } else if (line ~ /^Stack starts at/) {
+            for (j = 1; j <= n; j++) {
+                if (f[j] == "with") stack = f[j + 1]
+            }
+        }
+    }
+    if (code != "") {
+        libs = code - sum["code"]
+        printf("%-20s %8d\n", "libraries", libs > 0 ? libs : 0)
+    }
+
+    # Libraries Linked  [ object file ] - one line per library module
+    while ((getline line < map) > 0) {
+        if (line ~ /^Libraries Linked/) {
+            inLibs = 1
+        } else if (inLibs && line ~ /\[ .* \]/) {
+            sub(/.*\[ */, "", line)
+            sub(/ *\].*/, "", line)
+            sub(/\.rel$/, "", line)
+            libList = libList " " line
+        } else if (inLibs && line !~ /^ *$/) {
+            inLibs = 0
+        }
+    }
+    if (libList != "") {
+        printf("  library modules:%s\n", libList)
+    }
+
+    printf("\n")
+    if (code != "") {
+        printf("code  %6d of %6d bytes\n", code, codeMax)
+    }
+    if (stack != "") {
+        printf("iram  %6d of %6d bytes, %d left for the stack\n", 256 - stack, 256, stack)
+    }
+    if (xram != "") {
+        printf("xram  %6d of %6d bytes\n", xram, xramMax)
+    }
+}' "$@"
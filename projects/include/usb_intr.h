@@ -86,20 +86,26 @@
 * (MCU -> Host) data in Ep0Buffer and must return the length of outgoing data.
 * The defined function should return 0 for no outgoing data and 0xFF for 
 * unrecognised / unhandled control tranfers.  
+* For a request code it does not know at all it calls USB_INTR_VENDOR_UNKNOWN()
+* before returning 0xFF, which counts it in the statistics (vendorUnsupported).
 * It can not handle incoming data (Host -> MCU) - for that purpose use
 * a function defined in USB_CUST_CONTROL_DATA_HANDLER.
 * Example:
 * #define USB_CUST_CONTROL_TRANSFER_HANDLER myUsbControlHandler()
 *******************************************************************************/
 #ifndef USB_CUST_CONTROL_TRANSFER_HANDLER
-#define USB_CUST_CONTROL_TRANSFER_HANDLER 0xFF
+#define USB_CUST_CONTROL_TRANSFER_HANDLER (USB_INTR_VENDOR_UNKNOWN(), 0xFF)
 #endif
 
 /*******************************************************************************
 * USB_CUST_CONTROL_DATA_HANDLER: user defined handler function of basic
 * Vendor type data transfer sent from the Host to MCU via control Endpoint 0.
-* The Ep0Buffer contains data of USB_RX_LEN size. The total data size can not
-* be bigger than EP0_BUFF_SIZE which is up to 64 bytes.
+* By default it is called for every data packet: the Ep0Buffer contains data
+* of USB_RX_LEN size (up to EP0_BUFF_SIZE).
+* For data stages longer than one packet, USB_CUST_CONTROL_TRANSFER_HANDLER
+* can point UsbIntrOutDst to an XRAM area of at least wLength bytes. The
+* packets are then collected there and the data handler is called once, after
+* the last packet, with UsbIntrOutLen bytes received.
 * Example:
 * #define USB_CUST_CONTROL_DATA_HANDLER myUsbDataInHandler()
 *******************************************************************************/
@@ -107,6 +113,109 @@
 #define USB_CUST_CONTROL_DATA_HANDLER
 #endif
 
+/*******************************************************************************
+* USB_CUST_DESC_TABLE: additional entries of the GET_DESCRIPTOR lookup table
+* (see UsbDescTable), e.g. more string descriptors.
+* Example:
+* #define USB_CUST_DESC_TABLE {USB_DESC_STR, 3, sizeof(sd003), (__code uint8_t*) &sd003},
+*******************************************************************************/
+#ifndef USB_CUST_DESC_TABLE
+#define USB_CUST_DESC_TABLE
+#endif
+
+/*******************************************************************************
+* USB_CUST_STATS_BUF: XRAM address of the interrupt statistics (see
+* USB_INTR_STATS, 32 bytes). Not defined: no statistics are kept.
+* USB_CUST_STATS_TIMER: optional uint16_t timer count for the worst case
+* interrupt duration, counting up and wrapping to 0 after
+* USB_CUST_STATS_TIMER_PERIOD counts (0: after 0xFFFF).
+* USB_CUST_STATS_ISR(ticks): optional hook, called at the end of every
+* interrupt with its duration in USB_CUST_STATS_TIMER counts, e.g. to add up
+* the CPU load.
+* Example:
+* #define USB_CUST_STATS_BUF          0x00E0
+* #define USB_CUST_STATS_TIMER        myTimerCount()
+* #define USB_CUST_STATS_TIMER_PERIOD 2000
+* #define USB_CUST_STATS_ISR(ticks)   myLoadCount(ticks)
+*******************************************************************************/
+#ifndef USB_CUST_STATS_TIMER_PERIOD
+#define USB_CUST_STATS_TIMER_PERIOD 0
+#endif
+
+#ifndef USB_CUST_STATS_ISR
+#define USB_CUST_STATS_ISR(ticks)
+#endif
+
+/*******************************************************************************
+* USB_CUST_TRACE(type, arg): optional trace hook, called from the interrupt for
+* every SETUP (arg: bRequest), bus reset and suspend (arg: 1 when the host
+* asked for it with SET_FEATURE). It replaces the printf() debugging, which
+* waited for the UART inside the interrupt, so it has to be short.
+* Example:
+* #define USB_CUST_TRACE(type, arg)   myTraceRecord(type, arg)
+*******************************************************************************/
+#define USB_TRACE_SETUP             0x01
+#define USB_TRACE_BUS_RESET         0x02
+#define USB_TRACE_SUSPEND           0x03
+
+#ifndef USB_CUST_TRACE
+#define USB_CUST_TRACE(type, arg)
+#endif
+
+/*******************************************************************************
+* Optional standard requests - define a switch to leave its code out, the
+* request is then answered with STALL:
+* USB_CUST_NO_REMOTE_WAKEUP: SET / CLEAR_FEATURE DEVICE_REMOTE_WAKEUP and the
+*   sleep on SET_FEATURE. They only work when the configuration descriptor
+*   announces remote wakeup, USB_CONF_DEFAULT does not.
+* USB_CUST_NO_ENDPOINT_HALT: SET / CLEAR_FEATURE ENDPOINT_HALT
+* USB_CUST_NO_GET_STATUS: GET_STATUS. The USB specification requires it, the
+*   common hosts do not rely on it.
+* USB_CUST_NO_SUSPEND: a bus suspend does not put the MCU to sleep, it is
+*   only counted and traced.
+* 'make footprint' shows what the switches save.
+* Example:
+* #define USB_CUST_NO_REMOTE_WAKEUP
+*******************************************************************************/
+
+/*******************************************************************************
+* USB_CUST_BULK_EPn_OUT / USB_CUST_BULK_EPn_IN (n = 1..4): optional double
+* buffered (ping-pong) bulk endpoint layer. Define the name of the packet
+* handler function to enable the direction on endpoint n. The layer sets up
+* the endpoint mode, DMA address and data toggles, so USB_CUST_EP_INIT and
+* USB_CUST_EPn_IN/OUT_HANDLER must not be used for that endpoint.
+*
+* OUT handler: uint8_t handler(__xdata uint8_t* buf, uint8_t len)
+*   called for every completed OUT packet. Return 1 when the packet has been
+*   consumed, or 0 to keep the buffer half and release it later by calling
+*   usbBulkOutRelease(n) from the main loop. The SIE keeps receiving into the
+*   other half; the endpoint NAKs only when both halves are held.
+* IN handler: uint8_t handler(__xdata uint8_t* buf)
+*   called to fill the idle buffer half while the SIE sends the other one.
+*   Returns the packet length (0 - 64) or USB_BULK_NO_DATA. When there is no
+*   data the endpoint NAKs until usbBulkInKick(n) is called.
+*
+* USB_CUST_BULK_EPn_BUF: XRAM address (even) of the endpoint buffers. Each
+* enabled direction takes 2 x 64 bytes, the OUT halves come first.
+* Endpoint 4 has no DMA address of its own - its buffers follow Ep0Buffer
+* (0x0040 - 0x00BF must be kept free) and it runs single buffered with the
+* same handler interface.
+*
+* Example:
+* #define USB_CUST_BULK_EP2_OUT       myBulkOutHandler
+* #define USB_CUST_BULK_EP2_BUF       0x0040
+*******************************************************************************/
+
+
+
+/*******************************************************************************
+* XRAM_PTR: pointer to an absolute XRAM address (the native simulator build
+* maps the addresses into its own XRAM array)
+*******************************************************************************/
+#ifndef XRAM_PTR
+#define XRAM_PTR(addr) ((__xdata uint8_t*)(addr))
+#endif
+
 
 /******************************************************************************/
 
@@ -193,14 +302,343 @@ __code struct {uint8_t bLength; uint8_t bDscType; uint16_t string[USB_CUST_PRODU
 };
 
 
+/*******************************************************************************
+* Descriptor table - GET_DESCRIPTOR looks wValue (type, index) up here, so a
+* new descriptor is one more entry instead of another case in the interrupt.
+*******************************************************************************/
+typedef struct {
+    uint8_t type;           // wValueH
+    uint8_t index;          // wValueL
+    uint16_t len;
+    __code uint8_t* dsc;
+} USB_DESC_ENTRY;
+
+__code USB_DESC_ENTRY UsbDescTable[] =
+{
+    {USB_DESC_DEV, 0, sizeof(device_dsc), (__code uint8_t*) &device_dsc},
+    {USB_DESC_CFG, 0, sizeof(cfg01),      (__code uint8_t*) &cfg01},
+    {USB_DESC_STR, 0, sizeof(sd000),      (__code uint8_t*) &sd000},
+    {USB_DESC_STR, 1, sizeof(sd001),      (__code uint8_t*) &sd001},
+    {USB_DESC_STR, 2, sizeof(sd002),      (__code uint8_t*) &sd002},
+    USB_CUST_DESC_TABLE
+};
+
+#define USB_DESC_TABLE_SIZE (sizeof(UsbDescTable) / sizeof(UsbDescTable[0]))
+
+
 uint16_t UsbIntrSetupLen;
 uint8_t UsbIntrSetupReq;
 uint8_t UsbIntrConfig;
-const uint8_t*  UsbIntrDescr;
+__code uint8_t* UsbIntrDescr;   // code space pointer: MOVC, no generic pointer access
+
+// control OUT data stage
+uint16_t UsbIntrOutRemain;      // bytes still expected from the Host
+uint16_t UsbIntrOutLen;         // bytes collected in UsbIntrOutDst
+__xdata uint8_t* UsbIntrOutDst; // set by the vendor handler, or NULL
+
+#ifdef USB_CUST_STATS_BUF
+#define USB_INTR_STATS_ENDPOINTS 5  // endpoints 0 - 4 of the CH554
+
+// little endian counters, they wrap around
+typedef struct {
+    uint16_t setup;             // SETUP tokens (endpoint 0)
+    uint16_t in[USB_INTR_STATS_ENDPOINTS];  // IN tokens per endpoint
+    uint16_t out[USB_INTR_STATS_ENDPOINTS]; // OUT tokens per endpoint
+    uint16_t stalls;            // control requests STALLed at the SETUP stage, the
+                                // only EP0 STALL; a halted endpoint's are not counted
+    uint16_t busResets;
+    uint16_t suspends;
+    uint16_t vendorUnsupported; // unknown vendor request codes, USB_INTR_VENDOR_UNKNOWN()
+    uint16_t isrMaxTicks;       // longest interrupt, USB_CUST_STATS_TIMER counts
+} USB_INTR_STATS;
+
+#define UsbIntrStats    ((__xdata USB_INTR_STATS*) XRAM_PTR(USB_CUST_STATS_BUF))
+#define usbIntrCount(counter)   (UsbIntrStats->counter++)
+#define USB_INTR_VENDOR_UNKNOWN()   (UsbIntrStats->vendorUnsupported++)
+#else
+#define usbIntrCount(counter)
+#define USB_INTR_VENDOR_UNKNOWN()   ((void)0)
+#endif
 
 #define UsbSetupBuf	 ((PUSB_SETUP_REQ)Ep0Buffer)
 
 
+/*******************************************************************************
+* Double buffered bulk endpoints
+*
+* EP1-EP3 run in the CH55x buffer mode bUEPn_BUF_MOD: each direction has two
+* 64 byte halves and the SIE picks the half by the data toggle. The toggle is
+* flipped by hardware (bUEP_AUTO_TOG) after every good packet, so in the
+* transfer interrupt the completed half is the one *not* selected by the
+* current toggle. EP4 toggles manually and uses a single half.
+*******************************************************************************/
+#define USB_BULK_PACKET_SIZE    64
+#define USB_BULK_NO_DATA        0xFF
+
+typedef struct {
+    uint8_t held;       // OUT: halves owned by the application
+    uint8_t oldest;     // OUT: half released by the next usbBulkOutRelease()
+    uint8_t len[2];     // IN: packet length waiting in each half
+} USB_BULK_STATE;
+
+#define usbBulkOutRelease(n)    usbBulkOutRelease##n()
+#define usbBulkInKick(n)        usbBulkInKick##n()
+
+// ACK the next OUT packet only if the half the SIE will fill is free
+#define USB_BULK_OUT_DEFINE(n, halves, buf)                                    \
+__idata USB_BULK_STATE UsbBulkOut##n;                                          \
+static void usbBulkOutArm##n(void)                                             \
+{                                                                              \
+    uint8_t half = ((halves) == 2 && (UEP##n##_CTRL & bUEP_R_TOG)) ? 1 : 0;    \
+    UEP##n##_CTRL = UEP##n##_CTRL & ~MASK_UEP_R_RES |                          \
+        ((UsbBulkOut##n.held & (1 << half)) ? UEP_R_RES_NAK : UEP_R_RES_ACK);  \
+}                                                                              \
+static void usbBulkOutIsr##n(void)                                             \
+{                                                                              \
+    uint8_t half = 0;                                                          \
+    if (U_TOG_OK) {                                                            \
+        if ((halves) == 2) {                                                   \
+            half = (UEP##n##_CTRL & bUEP_R_TOG) ? 0 : 1;                       \
+        } else {                                                               \
+            UEP##n##_CTRL ^= bUEP_R_TOG;                                       \
+        }                                                                      \
+        if (!USB_CUST_BULK_EP##n##_OUT((buf) + half * USB_BULK_PACKET_SIZE, USB_RX_LEN)) { \
+            if (!UsbBulkOut##n.held) {                                         \
+                UsbBulkOut##n.oldest = half;                                   \
+            }                                                                  \
+            UsbBulkOut##n.held |= 1 << half;                                   \
+        }                                                                      \
+    }                                                                          \
+    usbBulkOutArm##n();                                                        \
+}                                                                              \
+static void usbBulkOutReset##n(void)                                           \
+{                                                                              \
+    UsbBulkOut##n.held = 0;                                                    \
+    UEP##n##_CTRL = UEP##n##_CTRL & ~(bUEP_R_TOG | MASK_UEP_R_RES) | UEP_R_RES_ACK; \
+}                                                                              \
+void usbBulkOutRelease##n(void)                                                \
+{                                                                              \
+    IE_USB = 0;                                                                \
+    if (UsbBulkOut##n.held) {                                                  \
+        UsbBulkOut##n.held &= ~(1 << UsbBulkOut##n.oldest);                    \
+        UsbBulkOut##n.oldest ^= (halves) - 1;                                  \
+        usbBulkOutArm##n();                                                    \
+    }                                                                          \
+    IE_USB = 1;                                                                \
+}
+
+// load the half selected by the toggle (filling it first if it is empty) and
+// refill the idle half while the SIE sends
+#define USB_BULK_IN_DEFINE(n, halves, buf)                                     \
+__idata USB_BULK_STATE UsbBulkIn##n;                                           \
+static void usbBulkInFill##n(uint8_t half)                                     \
+{                                                                              \
+    UsbBulkIn##n.len[half] = USB_CUST_BULK_EP##n##_IN((buf) + half * USB_BULK_PACKET_SIZE); \
+}                                                                              \
+static void usbBulkInArm##n(void)                                              \
+{                                                                              \
+    uint8_t half = ((halves) == 2 && (UEP##n##_CTRL & bUEP_T_TOG)) ? 1 : 0;    \
+    if (UsbBulkIn##n.len[half] == USB_BULK_NO_DATA) {                          \
+        usbBulkInFill##n(half);                                                \
+    }                                                                          \
+    if (UsbBulkIn##n.len[half] == USB_BULK_NO_DATA) {                          \
+        UEP##n##_CTRL = UEP##n##_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;       \
+    } else {                                                                   \
+        UEP##n##_T_LEN = UsbBulkIn##n.len[half];                               \
+        UEP##n##_CTRL = UEP##n##_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;       \
+        if ((halves) == 2 && UsbBulkIn##n.len[half ^ 1] == USB_BULK_NO_DATA) { \
+            usbBulkInFill##n(half ^ 1);                                        \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+static void usbBulkInIsr##n(void)                                              \
+{                                                                              \
+    uint8_t half = 0;                                                          \
+    if ((halves) == 2) {                                                       \
+        half = (UEP##n##_CTRL & bUEP_T_TOG) ? 0 : 1;                           \
+    } else {                                                                   \
+        UEP##n##_CTRL ^= bUEP_T_TOG;                                           \
+    }                                                                          \
+    UsbBulkIn##n.len[half] = USB_BULK_NO_DATA;                                 \
+    usbBulkInArm##n();                                                         \
+}                                                                              \
+static void usbBulkInReset##n(void)                                            \
+{                                                                              \
+    UsbBulkIn##n.len[0] = USB_BULK_NO_DATA;                                    \
+    UsbBulkIn##n.len[1] = USB_BULK_NO_DATA;                                    \
+    UEP##n##_CTRL &= ~bUEP_T_TOG;                                              \
+    usbBulkInArm##n();                                                         \
+}                                                                              \
+void usbBulkInKick##n(void)                                                    \
+{                                                                              \
+    IE_USB = 0;                                                                \
+    usbBulkInArm##n();                                                         \
+    IE_USB = 1;                                                                \
+}
+
+#if defined(USB_CUST_BULK_EP1_OUT) || defined(USB_CUST_BULK_EP1_IN)
+#if defined(USB_CUST_EP1_OUT_HANDLER) || defined(USB_CUST_EP1_IN_HANDLER)
+#error "USB_CUST_BULK_EP1_* can not be combined with USB_CUST_EP1_*_HANDLER"
+#endif
+#define USB_BULK_EP1
+#endif
+#if defined(USB_CUST_BULK_EP2_OUT) || defined(USB_CUST_BULK_EP2_IN)
+#if defined(USB_CUST_EP2_OUT_HANDLER) || defined(USB_CUST_EP2_IN_HANDLER)
+#error "USB_CUST_BULK_EP2_* can not be combined with USB_CUST_EP2_*_HANDLER"
+#endif
+#define USB_BULK_EP2
+#endif
+#if defined(USB_CUST_BULK_EP3_OUT) || defined(USB_CUST_BULK_EP3_IN)
+#if defined(USB_CUST_EP3_OUT_HANDLER) || defined(USB_CUST_EP3_IN_HANDLER)
+#error "USB_CUST_BULK_EP3_* can not be combined with USB_CUST_EP3_*_HANDLER"
+#endif
+#define USB_BULK_EP3
+#endif
+#if defined(USB_CUST_BULK_EP4_OUT) || defined(USB_CUST_BULK_EP4_IN)
+#if defined(USB_CUST_EP4_OUT_HANDLER) || defined(USB_CUST_EP4_IN_HANDLER)
+#error "USB_CUST_BULK_EP4_* can not be combined with USB_CUST_EP4_*_HANDLER"
+#endif
+#define USB_BULK_EP4
+#endif
+
+// endpoint buffer placement: OUT halves first, then IN halves
+#ifdef USB_CUST_BULK_EP1_OUT
+USB_BULK_OUT_DEFINE(1, 2, XRAM_PTR(USB_CUST_BULK_EP1_BUF))
+#define USB_BULK_EP1_IN_OFFS    (2 * USB_BULK_PACKET_SIZE)
+#else
+#define USB_BULK_EP1_IN_OFFS    0
+#endif
+#ifdef USB_CUST_BULK_EP1_IN
+USB_BULK_IN_DEFINE(1, 2, XRAM_PTR(USB_CUST_BULK_EP1_BUF + USB_BULK_EP1_IN_OFFS))
+#endif
+
+#ifdef USB_CUST_BULK_EP2_OUT
+USB_BULK_OUT_DEFINE(2, 2, XRAM_PTR(USB_CUST_BULK_EP2_BUF))
+#define USB_BULK_EP2_IN_OFFS    (2 * USB_BULK_PACKET_SIZE)
+#else
+#define USB_BULK_EP2_IN_OFFS    0
+#endif
+#ifdef USB_CUST_BULK_EP2_IN
+USB_BULK_IN_DEFINE(2, 2, XRAM_PTR(USB_CUST_BULK_EP2_BUF + USB_BULK_EP2_IN_OFFS))
+#endif
+
+#ifdef USB_CUST_BULK_EP3_OUT
+USB_BULK_OUT_DEFINE(3, 2, XRAM_PTR(USB_CUST_BULK_EP3_BUF))
+#define USB_BULK_EP3_IN_OFFS    (2 * USB_BULK_PACKET_SIZE)
+#else
+#define USB_BULK_EP3_IN_OFFS    0
+#endif
+#ifdef USB_CUST_BULK_EP3_IN
+USB_BULK_IN_DEFINE(3, 2, XRAM_PTR(USB_CUST_BULK_EP3_BUF + USB_BULK_EP3_IN_OFFS))
+#endif
+
+// EP4 uses the area right after the EP0 buffer (UEP0_DMA + 64)
+#ifdef USB_CUST_BULK_EP4_OUT
+USB_BULK_OUT_DEFINE(4, 1, Ep0Buffer + USB_BULK_PACKET_SIZE)
+#define USB_BULK_EP4_IN_OFFS    (2 * USB_BULK_PACKET_SIZE)
+#else
+#define USB_BULK_EP4_IN_OFFS    USB_BULK_PACKET_SIZE
+#endif
+#ifdef USB_CUST_BULK_EP4_IN
+USB_BULK_IN_DEFINE(4, 1, Ep0Buffer + USB_BULK_EP4_IN_OFFS)
+#endif
+
+
+/*******************************************************************************
+* Double buffered bulk endpoints: mode and DMA setup
+*******************************************************************************/
+static void usbBulkCfg()
+{
+#ifdef USB_BULK_EP1
+	UEP1_DMA = USB_CUST_BULK_EP1_BUF;
+	UEP4_1_MOD = UEP4_1_MOD & 0x0F | bUEP1_BUF_MOD
+#ifdef USB_CUST_BULK_EP1_OUT
+		| bUEP1_RX_EN
+#endif
+#ifdef USB_CUST_BULK_EP1_IN
+		| bUEP1_TX_EN
+#endif
+		;
+#endif
+#ifdef USB_BULK_EP2
+	UEP2_DMA = USB_CUST_BULK_EP2_BUF;
+	UEP2_3_MOD = UEP2_3_MOD & 0xF0 | bUEP2_BUF_MOD
+#ifdef USB_CUST_BULK_EP2_OUT
+		| bUEP2_RX_EN
+#endif
+#ifdef USB_CUST_BULK_EP2_IN
+		| bUEP2_TX_EN
+#endif
+		;
+#endif
+#ifdef USB_BULK_EP3
+	UEP3_DMA = USB_CUST_BULK_EP3_BUF;
+	UEP2_3_MOD = UEP2_3_MOD & 0x0F | bUEP3_BUF_MOD
+#ifdef USB_CUST_BULK_EP3_OUT
+		| bUEP3_RX_EN
+#endif
+#ifdef USB_CUST_BULK_EP3_IN
+		| bUEP3_TX_EN
+#endif
+		;
+#endif
+#ifdef USB_BULK_EP4
+	UEP4_1_MOD = UEP4_1_MOD & 0xF0
+#ifdef USB_CUST_BULK_EP4_OUT
+		| bUEP4_RX_EN
+#endif
+#ifdef USB_CUST_BULK_EP4_IN
+		| bUEP4_TX_EN
+#endif
+		;
+#endif
+}
+
+/*******************************************************************************
+* Double buffered bulk endpoints: reset toggles and buffer ownership (called
+* after the bus reset, IN endpoints are primed from their handlers)
+*******************************************************************************/
+static void usbBulkReset()
+{
+#ifdef USB_BULK_EP1
+	UEP1_CTRL = bUEP_AUTO_TOG | UEP_R_RES_NAK | UEP_T_RES_NAK;
+#endif
+#ifdef USB_BULK_EP2
+	UEP2_CTRL = bUEP_AUTO_TOG | UEP_R_RES_NAK | UEP_T_RES_NAK;
+#endif
+#ifdef USB_BULK_EP3
+	UEP3_CTRL = bUEP_AUTO_TOG | UEP_R_RES_NAK | UEP_T_RES_NAK;
+#endif
+#ifdef USB_BULK_EP4
+	UEP4_CTRL = UEP_R_RES_NAK | UEP_T_RES_NAK;
+#endif
+#ifdef USB_CUST_BULK_EP1_OUT
+	usbBulkOutReset1();
+#endif
+#ifdef USB_CUST_BULK_EP1_IN
+	usbBulkInReset1();
+#endif
+#ifdef USB_CUST_BULK_EP2_OUT
+	usbBulkOutReset2();
+#endif
+#ifdef USB_CUST_BULK_EP2_IN
+	usbBulkInReset2();
+#endif
+#ifdef USB_CUST_BULK_EP3_OUT
+	usbBulkOutReset3();
+#endif
+#ifdef USB_CUST_BULK_EP3_IN
+	usbBulkInReset3();
+#endif
+#ifdef USB_CUST_BULK_EP4_OUT
+	usbBulkOutReset4();
+#endif
+#ifdef USB_CUST_BULK_EP4_IN
+	usbBulkInReset4();
+#endif
+}
+
+
 
 /*******************************************************************************
 * USB device configuration
@@ -231,6 +669,9 @@ void USBDeviceCfg()
     USB_CUST_EP_INIT ; 
 #endif    
 
+    // double buffered bulk endpoints
+    usbBulkCfg();
+
 
     // interrupt initialisation
 	USB_INT_EN |= bUIE_SUSPEND;											   //Enable device suspen interrupt
@@ -244,17 +685,42 @@ void USBDeviceCfg()
 	UEP1_T_LEN = 0;													       //Pre-use send length must be cleared
 	UEP2_T_LEN = 0;
     UEP3_T_LEN = 0;
+    usbBulkReset();
 }
 
 
 /*******************************************************************************
-* CH55xUSB interrupt handler
+* CH55xUSB interrupt handler - runs on register bank 0: it calls the handlers
+* of the firmware, which are compiled for bank 0, so with __using (n) SDCC
+* would still save all of bank 0 on entry.
 *******************************************************************************/
-void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt service routine, using register set 1
+void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt service routine
 {
 	uint16_t len;
+	uint8_t i;
+#ifdef USB_CUST_STATS_TIMER
+	uint16_t start = USB_CUST_STATS_TIMER;
+#endif
 	if(UIF_TRANSFER)															//USB transfer completion flag
 	{
+#ifdef USB_CUST_STATS_BUF
+		i = USB_INT_ST & MASK_UIS_ENDP;
+		if (i < USB_INTR_STATS_ENDPOINTS)										//0 - 15, the counters end at endpoint 4
+		{
+			switch (USB_INT_ST & MASK_UIS_TOKEN)
+			{
+			case UIS_TOKEN_SETUP:
+				usbIntrCount(setup);
+				break;
+			case UIS_TOKEN_IN:
+				usbIntrCount(in[i]);
+				break;
+			case UIS_TOKEN_OUT:
+				usbIntrCount(out[i]);
+				break;
+			}
+		}
+#endif
 		switch (USB_INT_ST & (MASK_UIS_TOKEN | MASK_UIS_ENDP))
 		{
 
@@ -307,6 +773,55 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 		break;
 #endif 
 
+#ifdef USB_CUST_BULK_EP1_IN
+        case UIS_TOKEN_IN | 1:
+            // double buffered bulk endpoint
+            usbBulkInIsr1();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP1_OUT
+        case UIS_TOKEN_OUT | 1:
+            // double buffered bulk endpoint
+            usbBulkOutIsr1();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP2_IN
+        case UIS_TOKEN_IN | 2:
+            // double buffered bulk endpoint
+            usbBulkInIsr2();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP2_OUT
+        case UIS_TOKEN_OUT | 2:
+            // double buffered bulk endpoint
+            usbBulkOutIsr2();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP3_IN
+        case UIS_TOKEN_IN | 3:
+            // double buffered bulk endpoint
+            usbBulkInIsr3();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP3_OUT
+        case UIS_TOKEN_OUT | 3:
+            // double buffered bulk endpoint
+            usbBulkOutIsr3();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP4_IN
+        case UIS_TOKEN_IN | 4:
+            // double buffered bulk endpoint
+            usbBulkInIsr4();
+		break;
+#endif 
+#ifdef USB_CUST_BULK_EP4_OUT
+        case UIS_TOKEN_OUT | 4:
+            // double buffered bulk endpoint
+            usbBulkOutIsr4();
+		break;
+#endif 
+
         // configuration transfers on EP0 
 		case UIS_TOKEN_SETUP | 0:												//SETUP transaction
 			len = USB_RX_LEN;
@@ -315,10 +830,18 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 				UsbIntrSetupLen = ((uint16_t)UsbSetupBuf->wLengthH<<8) | (UsbSetupBuf->wLengthL);
 				len = 0;													  // The default is success and upload 0 length
 				UsbIntrSetupReq = UsbSetupBuf->bRequest;
+				USB_CUST_TRACE(USB_TRACE_SETUP, UsbIntrSetupReq);
+				UsbIntrOutRemain = (UsbSetupBuf->bRequestType & USB_REQ_TYP_IN) ? 0 : UsbIntrSetupLen;
+				UsbIntrOutLen = 0;
+				UsbIntrOutDst = NULL;
 
                 //handle vendor defined requests				
                 if ((UsbSetupBuf->bRequestType & USB_REQ_TYP_MASK) == USB_REQ_TYP_VENDOR) {
                    len = USB_CUST_CONTROL_TRANSFER_HANDLER;
+					if (len != 0xFF && len > UsbIntrSetupLen)
+					{
+						len = UsbIntrSetupLen;										//never more than wLength
+					}
 				}
                 // handle standard requests
 				else															 //Standard request
@@ -326,47 +849,29 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 					switch(UsbIntrSetupReq)											 //Request code
 					{
 					case USB_GET_DESCRIPTOR:
-						switch(UsbSetupBuf->wValueH)
+						len = 0xFF;													//Unsupported descriptor
+						for (i = 0; i < USB_DESC_TABLE_SIZE; i++)
 						{
-						case 1:													   //Device descriptor
-							UsbIntrDescr = (uint8_t*) device_dsc;								   //set the device descriptor to the buffer to be sent
-							len = sizeof(device_dsc);
-							break;
-						case 2:														//Configuration descriptor
-							UsbIntrDescr = (uint8_t*) cfg01;										  //set the configuration descriptor to the buffer to be sent
-							len = sizeof(cfg01);
-							break;
-						case 3:
-							if(UsbSetupBuf->wValueL == 0)
-							{
-								UsbIntrDescr = (uint8_t*) sd000;
-								len = sizeof(sd000);
-							}
-							else if(UsbSetupBuf->wValueL == 1)
+							if (UsbDescTable[i].type == UsbSetupBuf->wValueH && UsbDescTable[i].index == UsbSetupBuf->wValueL)
 							{
-								UsbIntrDescr = (uint8_t*) sd001;
-								len = sizeof(sd001);
-							}
-							else if(UsbSetupBuf->wValueL == 2)
-							{
-								UsbIntrDescr = (uint8_t*) sd002;
-								len = sizeof(sd002);
-							}
-							else
-							{
-								len = 0xFF;
+								UsbIntrDescr = UsbDescTable[i].dsc;
+								len = UsbDescTable[i].len;
+								break;
 							}
-							break;
-						default:
-							len = 0xff;												//Unsupported command or error
-							break;
+						}
+						if ( len == 0xff )
+						{
+							break;													//STALL, don't send a stale descriptor
 						}
 						if ( UsbIntrSetupLen > len )
 						{
 							UsbIntrSetupLen = len;	//Limit total length
 						}
 						len = UsbIntrSetupLen >= EP0_BUFF_SIZE ? EP0_BUFF_SIZE : UsbIntrSetupLen;							//This transmission length
-						memcpy(Ep0Buffer,UsbIntrDescr,len);								  //copy upload data
+						for (i = 0; i < len; i++)
+						{
+							Ep0Buffer[i] = UsbIntrDescr[i];							  //copy upload data
+						}
 						UsbIntrSetupLen -= len;
 						UsbIntrDescr += len;
 						break;
@@ -385,7 +890,9 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 						break;
 					case USB_GET_INTERFACE:
 						break;
+#if !defined(USB_CUST_NO_REMOTE_WAKEUP) || !defined(USB_CUST_NO_ENDPOINT_HALT)
 					case USB_CLEAR_FEATURE:											//Clear Feature
+#ifndef USB_CUST_NO_REMOTE_WAKEUP
 						if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* Clear device */
 						{
 							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
@@ -404,7 +911,10 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 								len = 0xFF;											/* operation failed */
 							}
 						}
-						else if ( ( UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK ) == USB_REQ_RECIP_ENDP ) // Clear Endpoint
+						else
+#endif
+#ifndef USB_CUST_NO_ENDPOINT_HALT
+						if ( ( UsbSetupBuf->bRequestType & USB_REQ_RECIP_MASK ) == USB_REQ_RECIP_ENDP ) // Clear Endpoint
 						{
 							switch( UsbSetupBuf->wIndexL )
 							{
@@ -446,11 +956,13 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 							}
 						}
 						else
+#endif
 						{
 							len = 0xFF;												// anything else is unsupported
 						}
 						break;
 					case USB_SET_FEATURE:										  /* Set Feature */
+#ifndef USB_CUST_NO_REMOTE_WAKEUP
 						if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_DEVICE )				  /* Setting up the device */
 						{
 							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x01 )
@@ -458,9 +970,7 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 								if( cfg01.cd01.bmAttributes & 0x20 )
 								{
 									/* Sleep */
-#ifdef DE_PRINTF
-									printf( "suspend\r\n" );															 //Sleep state
-#endif
+									USB_CUST_TRACE(USB_TRACE_SUSPEND, 1);
 									while ( XBUS_AUX & bUART0_TX )
 									{
 										;	//Waiting for transmission to complete
@@ -483,7 +993,10 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 								len = 0xFF;											/* operation failed */
 							}
 						}
-						else if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_ENDP )			 /* Set endpoint */
+						else
+#endif
+#ifndef USB_CUST_NO_ENDPOINT_HALT
+						if( ( UsbSetupBuf->bRequestType & 0x1F ) == USB_REQ_RECIP_ENDP )			 /* Set endpoint */
 						{
 							if( ( ( ( uint16_t )UsbSetupBuf->wValueH << 8 ) | UsbSetupBuf->wValueL ) == 0x00 )
 							{
@@ -532,10 +1045,13 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 							}
 						}
 						else
+#endif
 						{
 							len = 0xFF;										  /* operation failed */
 						}
 						break;
+#endif
+#ifndef USB_CUST_NO_GET_STATUS
 					case USB_GET_STATUS:
 						Ep0Buffer[0] = 0x00;
 						Ep0Buffer[1] = 0x00;
@@ -548,6 +1064,7 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 							len = UsbIntrSetupLen;
 						}
 						break;
+#endif
 					default:
 						len = 0xff;													// operation failed
 						break;
@@ -560,6 +1077,7 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 			}
 			if(len == 0xff)
 			{
+				usbIntrCount(stalls);
 				UsbIntrSetupReq = 0xFF;
 				UEP0_CTRL = bUEP_R_TOG | bUEP_T_TOG | UEP_R_RES_STALL | UEP_T_RES_STALL;//STALL
 			}
@@ -583,7 +1101,10 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 			{
 			case USB_GET_DESCRIPTOR:
 				len = UsbIntrSetupLen >= EP0_BUFF_SIZE ? EP0_BUFF_SIZE : UsbIntrSetupLen;								 //This transmission length
-				memcpy( Ep0Buffer, UsbIntrDescr, len );								   //set output data
+				for (i = 0; i < len; i++)
+				{
+					Ep0Buffer[i] = UsbIntrDescr[i];									   //set output data
+				}
 				UsbIntrSetupLen -= len;
 				UsbIntrDescr += len;
 				UEP0_T_LEN = len;
@@ -601,11 +1122,38 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 			}
 			break;
 		case UIS_TOKEN_OUT | 0:  // endpoint0 OUT from the Host, IN to the MCU
-                // call custom data handle if it is defined
-                USB_CUST_CONTROL_DATA_HANDLER;
-
-				UEP0_T_LEN = 0;
-				UEP0_CTRL |= UEP_R_RES_ACK | UEP_T_RES_ACK;  //State stage, responding to NAK in IN
+			if (UsbIntrOutRemain)												//data stage
+			{
+				if (!U_TOG_OK)
+				{
+					break;													//repeated packet, already stored
+				}
+				len = USB_RX_LEN > UsbIntrOutRemain ? UsbIntrOutRemain : USB_RX_LEN;
+				UsbIntrOutRemain -= len;
+				UEP0_CTRL ^= bUEP_R_TOG;										//expect the other DATA PID
+				if (UsbIntrOutDst)
+				{
+					memcpy(UsbIntrOutDst + UsbIntrOutLen, Ep0Buffer, len);		//collect the packets
+					UsbIntrOutLen += len;
+				}
+				else
+				{
+					// call custom data handle for every packet if it is defined
+					USB_CUST_CONTROL_DATA_HANDLER;
+				}
+				if (UsbIntrOutRemain && len == EP0_BUFF_SIZE)
+				{
+					break;													//more packets follow
+				}
+				UsbIntrOutRemain = 0;
+				if (UsbIntrOutDst)
+				{
+					// all data collected, call custom data handle if it is defined
+					USB_CUST_CONTROL_DATA_HANDLER;
+				}
+			}
+			UEP0_T_LEN = 0;
+			UEP0_CTRL |= UEP_R_RES_ACK | UEP_T_RES_ACK;  //State stage, responding to NAK in IN
 			break;
 
 
@@ -617,9 +1165,7 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 	}
 	if(UIF_BUS_RST)																 //Device Mode USB Bus Reset Interrupt
 	{
-#ifdef DE_PRINTF
-		printf( "reset\r\n" );															 //reset state
-#endif
+		USB_CUST_TRACE(USB_TRACE_BUS_RESET, 0);
 		UEP0_CTRL = UEP_R_RES_ACK | UEP_T_RES_NAK;
 		UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
 		UEP2_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK | UEP_R_RES_ACK;
@@ -628,6 +1174,8 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 		UIF_TRANSFER = 0;
 		UIF_BUS_RST = 0;															 //Clear interrupt flag
 		UsbIntrConfig = 0;		  //Clear configuration value
+		usbIntrCount(busResets);
+		usbBulkReset();
 #ifdef USB_CUST_RESET_HANDLER
         // call custom reset handler function
         USB_CUST_RESET_HANDLER ;
@@ -638,9 +1186,9 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 		UIF_SUSPEND = 0;
 		if ( USB_MIS_ST & bUMS_SUSPEND )											 //suspend
 		{
-#ifdef DE_PRINTF
-			printf( "suspend\r\n" );															 //suspend state
-#endif
+			usbIntrCount(suspends);
+			USB_CUST_TRACE(USB_TRACE_SUSPEND, 0);
+#ifndef USB_CUST_NO_SUSPEND
 			while ( XBUS_AUX & bUART0_TX )
 			{
 				;	//Waiting for transmission to complete
@@ -652,12 +1200,27 @@ void DeviceInterrupt(void) __interrupt (INT_NO_USB)					   //USB interrupt servi
 			SAFE_MOD = 0x55;
 			SAFE_MOD = 0xAA;
 			WAKE_CTRL = 0x00;
+#ifdef USB_CUST_STATS_TIMER
+			start = USB_CUST_STATS_TIMER;											 //the sleep is no interrupt time
+#endif
+#endif
 		}
 	}
 	else {																			 //Unexpected interruption, impossible situation
 		USB_INT_FG = 0xFF;															 //Clear interrupt flag
 
 	}
+#ifdef USB_CUST_STATS_TIMER
+	len = USB_CUST_STATS_TIMER;
+	len = (len >= start) ? len - start : len - start + USB_CUST_STATS_TIMER_PERIOD;
+#ifdef USB_CUST_STATS_BUF
+	if (len > UsbIntrStats->isrMaxTicks)
+	{
+		UsbIntrStats->isrMaxTicks = len;
+	}
+#endif
+	USB_CUST_STATS_ISR(len);
+#endif
 }
 
 
@@ -0,0 +1,400 @@
+#!/bin/sh
+# protogen.sh - generates the vendor request code of a device from its schema
+#
+# usage: protogen.sh schema.def commands.h dispatch.h host_proto.h host_proto.c
+#
+# commands.h     COMMAND_* codes and payload sizes, for the firmware and tests
+# dispatch.h     firmware: handler prototypes, the __code dispatch table and
+#                dispatchVendorSetup() / dispatchVendorData() for
+#                USB_CUST_CONTROL_TRANSFER_HANDLER / _DATA_HANDLER. Include it
+#                after usb_intr.h, and build the firmware with --nooverlay.
+# host_proto.h/c host library: codes, reply structs and one typed call per
+#                command on top of blinkyControlIn() / blinkyControlOut()
+#
+# The schema format is described in usb_blink/blinky_protocol.def.
+
+if [ $# -ne 5 ]; then
+    echo "usage: protogen.sh schema.def commands.h dispatch.h host_proto.h host_proto.c" >&2
+    exit 1
+fi
+
+awk -v src="$(basename "$1")" -v commandsH="$2" -v dispatchH="$3" \
+        -v hostH="$4" -v hostC="$5" '
+function fail(msg) {
+    printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+    failed = 1
+    exit 1
+}
+
+function hex(s,    i, c, v) {
+    v = 0
+    s = toupper(s)
+    sub(/^0X/, "", s)
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789ABCDEF", substr(s, i, 1))
+        if (c == 0) {
+            fail("bad hex number " s)
+        }
+        v = v * 16 + c - 1
+    }
+    return v
+}
+
+# READ_BLINK_TIME -> ReadBlinkTime
+function camel(s,    n, p, i, r) {
+    n = split(tolower(s), p, "_")
+    r = ""
+    for (i = 1; i <= n; i++) {
+        r = r toupper(substr(p[i], 1, 1)) substr(p[i], 2)
+    }
+    return r
+}
+
+function typeSize(t) {
+    return t == "u8" ? 1 : t == "u16" ? 2 : 4
+}
+
+function cType(t) {
+    return t == "u8" ? "uint8_t" : t == "u16" ? "uint16_t" : "uint32_t"
+}
+
+function decode(t, p) {
+    if (t == "u8") return p "[0]"
+    if (t == "u16") return p "[0] | (" p "[1] << 8)"
+    return p "[0] | (" p "[1] << 8) | ((uint32_t) " p "[2] << 16) | ((uint32_t) " p "[3] << 24)"
+}
+
+# extra: more comment lines, separated by \n
+function header(f, what, extra,    base, lines, i, m) {
+    base = f
+    sub(/.*\//, "", base)
+    printf("/* %s - %s\n", base, what) > f
+    printf(" *\n") > f
+    printf(" * Generated by protogen.sh from %s, do not edit.\n", src) > f
+    m = split(extra, lines, "\n")
+    for (i = 1; i <= m; i++) {
+        printf(" *%s\n", lines[i] != "" ? " " lines[i] : "") > f
+    }
+    printf(" */\n") > f
+}
+
+{
+    doc = ""
+    if ((i = index($0, "#")) > 0) {
+        doc = substr($0, i + 1)
+        sub(/^ +/, "", doc)
+        $0 = substr($0, 1, i - 1)
+    }
+}
+
+NF == 0 {
+    next
+}
+
+$1 == "command" {
+    if (NF < 5 || NF > 6 || ($4 != "in" && $4 != "out")) {
+        fail("command <NAME> <code> <in | out> <setup handler> [data handler]")
+    }
+    n++
+    name[n] = $2
+    code[n] = hex($3)
+    dir[n] = $4
+    setup[n] = $5
+    data[n] = NF == 6 ? $6 : ""
+    cdoc[n] = doc
+    if (data[n] != "" && dir[n] != "out") {
+        fail("a data handler needs an out command")
+    }
+    for (i = 1; i < n; i++) {
+        if (code[i] == code[n] || name[i] == name[n]) {
+            fail("command " name[n] " defined twice")
+        }
+    }
+    next
+}
+
+n == 0 {
+    fail("command expected")
+}
+
+$1 == "value" || $1 == "index" {
+    if (NF != 2) {
+        fail($1 " <name>")
+    }
+    param[n, $1] = $2
+    pdoc[n, $1] = doc
+    next
+}
+
+$1 == "data" {
+    if (NF != 2 || fields[n]) {
+        fail("data <max> and fields exclude each other")
+    }
+    max[n] = $2 + 0
+    next
+}
+
+$1 == "reply" {
+    if (NF != 2 || dir[n] != "in") {
+        fail("reply <Struct> of an in command")
+    }
+    reply[n] = $2
+    next
+}
+
+$1 == "field" {
+    if (NF < 3 || NF > 4 || ($2 != "u8" && $2 != "u16" && $2 != "u32")) {
+        fail("field <u8 | u16 | u32> <name> [count]")
+    }
+    if (dir[n] != "in" || max[n] != "") {
+        fail("fields describe the reply of an in command without data")
+    }
+    k = ++fields[n]
+    ftype[n, k] = $2
+    fname[n, k] = $3
+    fcount[n, k] = NF == 4 ? $4 + 0 : 1
+    fdoc[n, k] = doc
+    size[n] += typeSize($2) * fcount[n, k]
+    next
+}
+
+{
+    fail("unknown keyword " $1)
+}
+
+END {
+    if (failed) {
+        exit 1
+    }
+    for (i = 1; i <= n; i++) {
+        if (fields[i] > 1 && reply[i] == "") {
+            fail("command " name[i] " needs a reply struct for its fields")
+        }
+    }
+    writeCommands()
+    writeDispatch()
+    writeHostH()
+    writeHostC()
+}
+
+function writeCodes(f,    i) {
+    for (i = 1; i <= n; i++) {
+        printf("#define COMMAND_%-24s 0x%02X\n", name[i], code[i]) > f
+    }
+    printf("\n") > f
+    printf("// fixed reply sizes and data stage limits in bytes\n") > f
+    for (i = 1; i <= n; i++) {
+        if (fields[i]) {
+            printf("#define COMMAND_%-24s %d\n", name[i] "_SIZE", size[i]) > f
+        } else if (max[i] != "") {
+            printf("#define COMMAND_%-24s %d\n", name[i] "_MAX", max[i]) > f
+        }
+    }
+}
+
+function writeCommands(    f) {
+    f = commandsH
+    header(f, "vendor request codes of the device", "")
+    printf("\n#ifndef BLINKY_COMMANDS_H\n#define BLINKY_COMMANDS_H\n\n") > f
+    writeCodes(f)
+    printf("\n#endif /* BLINKY_COMMANDS_H */\n") > f
+    close(f)
+}
+
+function writeDispatch(    f, i, first, last, idx) {
+    f = dispatchH
+    first = 255
+    last = 0
+    for (i = 1; i <= n; i++) {
+        if (code[i] < first) first = code[i]
+        if (code[i] > last) last = code[i]
+        idx[code[i]] = i - 1
+    }
+    header(f, "firmware dispatch of the vendor requests", "")
+    printf("\n#ifndef BLINKY_DISPATCH_H\n#define BLINKY_DISPATCH_H\n\n") > f
+    printf("#include \"blinky_commands.h\"\n\n") > f
+
+    printf("// setup handlers return the reply length (in) or 0, 0xFF stalls\n") > f
+    for (i = 1; i <= n; i++) {
+        printf("static uint16_t %s();\n", setup[i]) > f
+    }
+    printf("\n// data handlers, called with the data stage of an out request\n") > f
+    for (i = 1; i <= n; i++) {
+        if (data[i] != "") {
+            printf("static void %s();\n", data[i]) > f
+        }
+    }
+
+    printf("\n// the interrupt calls the handlers through these pointers, which the SDCC\n") > f
+    printf("// overlay analysis does not follow: the firmware is built with --nooverlay,\n") > f
+    printf("// or the locals of a handler could share memory with the main loop ones\n") > f
+    printf("typedef struct {\n") > f
+    printf("    uint16_t (*setup)();\n") > f
+    printf("    void (*data)();\n") > f
+    printf("    uint16_t maxOut;        // longest data stage of an out request\n") > f
+    printf("    uint8_t dir;            // USB_REQ_TYP_IN or USB_REQ_TYP_OUT\n") > f
+    printf("} VENDOR_COMMAND;\n\n") > f
+
+    printf("__code VENDOR_COMMAND VendorCommands[] = {\n") > f
+    for (i = 1; i <= n; i++) {
+        printf("    {%s, %s, %d, %s},%s\n", setup[i], data[i] != "" ? data[i] : "NULL",
+                dir[i] == "out" && max[i] != "" ? max[i] : 0,
+                dir[i] == "in" ? "USB_REQ_TYP_IN" : "USB_REQ_TYP_OUT",
+                "    // COMMAND_" name[i]) > f
+    }
+    printf("};\n\n") > f
+
+    printf("// VendorCommands index of the codes 0x%02X - 0x%02X, 0xFF: unknown\n", first, last) > f
+    printf("#define VENDOR_FIRST            0x%02X\n", first) > f
+    printf("#define VENDOR_CODES            %d\n\n", last - first + 1) > f
+    printf("__code uint8_t VendorIndex[VENDOR_CODES] = {") > f
+    for (i = first; i <= last; i++) {
+        printf("%s%s", (i - first) % 8 ? " " : "\n    ", (i in idx) ? idx[i] "," : "0xFF,") > f
+    }
+    printf("\n};\n\n") > f
+
+    printf("static __code VENDOR_COMMAND* vendorCommand()\n{\n") > f
+    printf("    uint8_t i = UsbIntrSetupReq - VENDOR_FIRST;\n\n") > f
+    printf("    if (i >= VENDOR_CODES || VendorIndex[i] == 0xFF) {\n") > f
+    printf("        return NULL;\n    }\n") > f
+    printf("    return &VendorCommands[VendorIndex[i]];\n}\n\n") > f
+
+    printf("// USB_CUST_CONTROL_TRANSFER_HANDLER: counts unknown codes, checks the\n") > f
+    printf("// direction and the data stage length, then calls the setup handler\n") > f
+    printf("static uint16_t dispatchVendorSetup()\n{\n") > f
+    printf("    __code VENDOR_COMMAND* c = vendorCommand();\n\n") > f
+    printf("    if (c == NULL) {\n") > f
+    printf("        USB_INTR_VENDOR_UNKNOWN();\n") > f
+    printf("        return 0xFF;\n    }\n") > f
+    printf("    if ((UsbSetupBuf->bRequestType & USB_REQ_TYP_IN) != c->dir) {\n") > f
+    printf("        return 0xFF;\n    }\n") > f
+    printf("    if (c->dir == USB_REQ_TYP_OUT && UsbIntrSetupLen > c->maxOut) {\n") > f
+    printf("        return 0xFF;\n    }\n") > f
+    printf("    return c->setup();\n}\n\n") > f
+
+    printf("// USB_CUST_CONTROL_DATA_HANDLER\n") > f
+    printf("static void dispatchVendorData()\n{\n") > f
+    printf("    __code VENDOR_COMMAND* c = vendorCommand();\n\n") > f
+    printf("    if (c != NULL && c->data != NULL) {\n") > f
+    printf("        c->data();\n    }\n}\n") > f
+    printf("\n#endif /* BLINKY_DISPATCH_H */\n") > f
+    close(f)
+}
+
+# parameters of the typed host call
+function hostParams(i,    p) {
+    p = "BlinkyDevice* dev"
+    if (param[i, "value"] != "") p = p ", uint16_t " param[i, "value"]
+    if (param[i, "index"] != "") p = p ", uint16_t " param[i, "index"]
+    if (reply[i] != "") {
+        p = p ", " reply[i] "* reply"
+    } else if (fields[i]) {
+        p = p ", " cType(ftype[i, 1]) "* " fname[i, 1]
+    } else if (max[i] != "") {
+        p = p (dir[i] == "in" ? ", uint8_t* data" : ", const uint8_t* data") ", uint16_t len"
+    }
+    return p
+}
+
+# comment lines of the typed host call
+function hostDoc(i,    d) {
+    d = cdoc[i] != "" ? "// " cdoc[i] "\n" : ""
+    if (param[i, "value"] != "") d = d "// " param[i, "value"] ": " pdoc[i, "value"] "\n"
+    if (param[i, "index"] != "") d = d "// " param[i, "index"] ": " pdoc[i, "index"] "\n"
+    if (fields[i] && reply[i] == "" && fdoc[i, 1] != "") d = d "// " fname[i, 1] ": " fdoc[i, 1] "\n"
+    if (max[i] != "") d = d "// data: up to COMMAND_" name[i] "_MAX bytes\n"
+    return d
+}
+
+function writeHostH(    f, i, k, decl) {
+    f = hostH
+    header(f, "typed calls of the vendor requests", "\n" \
+            "Included by usb_blink_lib.h. The calls return 0 on success or negative\n" \
+            "libusb error, in requests with data return the received length.")
+    printf("\n#ifndef USB_BLINK_PROTO_H\n#define USB_BLINK_PROTO_H\n\n") > f
+    writeCodes(f)
+    for (i = 1; i <= n; i++) {
+        if (reply[i] == "") {
+            continue
+        }
+        printf("\ntypedef struct %s {\n", reply[i]) > f
+        for (k = 1; k <= fields[i]; k++) {
+            decl = cType(ftype[i, k]) " " fname[i, k] (fcount[i, k] > 1 ? "[" fcount[i, k] "]" : "") ";"
+            if (fdoc[i, k] != "") {
+                printf("    %-28s// %s\n", decl, fdoc[i, k]) > f
+            } else {
+                printf("    %s\n", decl) > f
+            }
+        }
+        printf("} %s;\n", reply[i]) > f
+    }
+    printf("\n") > f
+    for (i = 1; i <= n; i++) {
+        printf("%s", hostDoc(i)) > f
+        printf("int blinkyCmd%s(%s);\n", camel(name[i]), hostParams(i)) > f
+    }
+    printf("\n#endif /* USB_BLINK_PROTO_H */\n") > f
+    close(f)
+}
+
+function writeHostC(    f, i, k, value, idx, loops, p, dst) {
+    f = hostC
+    header(f, "typed calls of the vendor requests", "")
+    printf("\n#include <stdlib.h>\n\n#include \"usb_blink_lib.h\"\n") > f
+    for (i = 1; i <= n; i++) {
+        value = param[i, "value"] != "" ? param[i, "value"] : "0"
+        idx = param[i, "index"] != "" ? param[i, "index"] : "0"
+        printf("\nint blinkyCmd%s(%s) {\n", camel(name[i]), hostParams(i)) > f
+        if (fields[i]) {
+            loops = 0
+            for (k = 1; k <= fields[i]; k++) {
+                if (fcount[i, k] > 1) loops = 1
+            }
+            printf("    uint8_t buf[COMMAND_%s_SIZE];\n", name[i]) > f
+            printf("    const uint8_t* p = buf;\n") > f
+            printf("    int ret;\n") > f
+            if (loops) {
+                printf("    int i;\n") > f
+            }
+            printf("\n    ret = blinkyControlIn(dev, COMMAND_%s, %s, %s, buf, sizeof(buf));\n",
+                    name[i], value, idx) > f
+            printf("    if (ret < 0) {\n        return ret;\n    }\n") > f
+            printf("    if (ret != sizeof(buf)) {\n        return LIBUSB_ERROR_IO;\n    }\n") > f
+            for (k = 1; k <= fields[i]; k++) {
+                dst = reply[i] != "" ? "reply->" fname[i, k] : "*" fname[i, k]
+                if (fcount[i, k] > 1) {
+                    printf("    for (i = 0; i < %d; i++, p += %d) {\n", fcount[i, k], typeSize(ftype[i, k])) > f
+                    printf("        %s[i] = %s;\n    }\n", dst, decode(ftype[i, k], "p")) > f
+                } else {
+                    printf("    %s = %s;\n", dst, decode(ftype[i, k], "p")) > f
+                    if (k < fields[i]) {
+                        printf("    p += %d;\n", typeSize(ftype[i, k])) > f
+                    }
+                }
+            }
+            printf("    return 0;\n}\n") > f
+        } else if (dir[i] == "in") {
+            if (max[i] != "") {
+                printf("    if (len > COMMAND_%s_MAX) {\n", name[i]) > f
+                printf("        len = COMMAND_%s_MAX;\n    }\n", name[i]) > f
+                printf("    return blinkyControlIn(dev, COMMAND_%s, %s, %s, data, len);\n}\n",
+                        name[i], value, idx) > f
+            } else {
+                printf("    return blinkyControlIn(dev, COMMAND_%s, %s, %s, NULL, 0);\n}\n",
+                        name[i], value, idx) > f
+            }
+        } else if (max[i] != "") {
+            printf("    int ret;\n\n") > f
+            printf("    if (len > COMMAND_%s_MAX) {\n", name[i]) > f
+            printf("        return LIBUSB_ERROR_INVALID_PARAM;\n    }\n") > f
+            printf("    ret = blinkyControlOut(dev, COMMAND_%s, %s, %s, data, len);\n", name[i], value, idx) > f
+            printf("    if (ret < 0) {\n        return ret;\n    }\n") > f
+            printf("    return ret == len ? 0 : LIBUSB_ERROR_IO;\n}\n") > f
+        } else {
+            printf("    int ret = blinkyControlOut(dev, COMMAND_%s, %s, %s, NULL, 0);\n", name[i], value, idx) > f
+            printf("    return ret < 0 ? ret : 0;\n}\n") > f
+        }
+    }
+    close(f)
+}
+' "$1"
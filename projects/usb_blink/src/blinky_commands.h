@@ -0,0 +1,35 @@
+/* blinky_commands.h - vendor request codes of the device
+ *
+ * Generated by protogen.sh from blinky_protocol.def, do not edit.
+ */
+
+#ifndef BLINKY_COMMANDS_H
+#define BLINKY_COMMANDS_H
+
+#define COMMAND_READ_BLINK_TIME          0xD0
+#define COMMAND_TOGGLE_BLINK             0xD1
+#define COMMAND_SET_BLINK_TIME           0xD3
+#define COMMAND_SET_BLINK_SEQUENCE       0xD4
+#define COMMAND_START_STREAM             0xD5
+#define COMMAND_READ_STREAM_STATUS       0xD6
+#define COMMAND_READ_STATS               0xD7
+#define COMMAND_READ_TRACE               0xD8
+#define COMMAND_BATCH                    0xD9
+#define COMMAND_READ_BATCH               0xDA
+#define COMMAND_READ_LOAD                0xDB
+#define COMMAND_SAVE_SEQUENCE            0xDC
+#define COMMAND_READ_SAVED               0xDD
+#define COMMAND_JUMP_TO_BOOTLOADER       0xB0
+
+// fixed reply sizes and data stage limits in bytes
+#define COMMAND_READ_BLINK_TIME_SIZE     2
+#define COMMAND_SET_BLINK_SEQUENCE_MAX   256
+#define COMMAND_READ_STREAM_STATUS_SIZE  8
+#define COMMAND_READ_STATS_SIZE          32
+#define COMMAND_READ_TRACE_MAX           32
+#define COMMAND_BATCH_MAX                512
+#define COMMAND_READ_BATCH_MAX           16
+#define COMMAND_READ_LOAD_SIZE           8
+#define COMMAND_READ_SAVED_SIZE          4
+
+#endif /* BLINKY_COMMANDS_H */
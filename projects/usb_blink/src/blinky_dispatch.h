@@ -0,0 +1,110 @@
+/* blinky_dispatch.h - firmware dispatch of the vendor requests
+ *
+ * Generated by protogen.sh from blinky_protocol.def, do not edit.
+ */
+
+#ifndef BLINKY_DISPATCH_H
+#define BLINKY_DISPATCH_H
+
+#include "blinky_commands.h"
+
+// setup handlers return the reply length (in) or 0, 0xFF stalls
+static uint16_t handleReadBlinkTime();
+static uint16_t handleToggleBlink();
+static uint16_t handleSetBlinkTime();
+static uint16_t handleSetSequence();
+static uint16_t handleStartStream();
+static uint16_t handleReadStreamStatus();
+static uint16_t handleReadStats();
+static uint16_t handleReadTrace();
+static uint16_t handleBatch();
+static uint16_t handleReadBatch();
+static uint16_t handleReadLoad();
+static uint16_t handleSaveSequence();
+static uint16_t handleReadSaved();
+static uint16_t handleJumpToBootloader();
+
+// data handlers, called with the data stage of an out request
+static void handleSequenceData();
+static void handleBatchData();
+
+// the interrupt calls the handlers through these pointers, which the SDCC
+// overlay analysis does not follow: the firmware is built with --nooverlay,
+// or the locals of a handler could share memory with the main loop ones
+typedef struct {
+    uint16_t (*setup)();
+    void (*data)();
+    uint16_t maxOut;        // longest data stage of an out request
+    uint8_t dir;            // USB_REQ_TYP_IN or USB_REQ_TYP_OUT
+} VENDOR_COMMAND;
+
+__code VENDOR_COMMAND VendorCommands[] = {
+    {handleReadBlinkTime, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_BLINK_TIME
+    {handleToggleBlink, NULL, 0, USB_REQ_TYP_OUT},    // COMMAND_TOGGLE_BLINK
+    {handleSetBlinkTime, NULL, 0, USB_REQ_TYP_OUT},    // COMMAND_SET_BLINK_TIME
+    {handleSetSequence, handleSequenceData, 256, USB_REQ_TYP_OUT},    // COMMAND_SET_BLINK_SEQUENCE
+    {handleStartStream, NULL, 0, USB_REQ_TYP_OUT},    // COMMAND_START_STREAM
+    {handleReadStreamStatus, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_STREAM_STATUS
+    {handleReadStats, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_STATS
+    {handleReadTrace, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_TRACE
+    {handleBatch, handleBatchData, 512, USB_REQ_TYP_OUT},    // COMMAND_BATCH
+    {handleReadBatch, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_BATCH
+    {handleReadLoad, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_LOAD
+    {handleSaveSequence, NULL, 0, USB_REQ_TYP_OUT},    // COMMAND_SAVE_SEQUENCE
+    {handleReadSaved, NULL, 0, USB_REQ_TYP_IN},    // COMMAND_READ_SAVED
+    {handleJumpToBootloader, NULL, 0, USB_REQ_TYP_OUT},    // COMMAND_JUMP_TO_BOOTLOADER
+};
+
+// VendorCommands index of the codes 0xB0 - 0xDD, 0xFF: unknown
+#define VENDOR_FIRST            0xB0
+#define VENDOR_CODES            46
+
+__code uint8_t VendorIndex[VENDOR_CODES] = {
+    13, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0, 1, 0xFF, 2, 3, 4, 5, 6,
+    7, 8, 9, 10, 11, 12,
+};
+
+static __code VENDOR_COMMAND* vendorCommand()
+{
+    uint8_t i = UsbIntrSetupReq - VENDOR_FIRST;
+
+    if (i >= VENDOR_CODES || VendorIndex[i] == 0xFF) {
+        return NULL;
+    }
+    return &VendorCommands[VendorIndex[i]];
+}
+
+// USB_CUST_CONTROL_TRANSFER_HANDLER: counts unknown codes, checks the
+// direction and the data stage length, then calls the setup handler
+static uint16_t dispatchVendorSetup()
+{
+    __code VENDOR_COMMAND* c = vendorCommand();
+
+    if (c == NULL) {
+        USB_INTR_VENDOR_UNKNOWN();
+        return 0xFF;
+    }
+    if ((UsbSetupBuf->bRequestType & USB_REQ_TYP_IN) != c->dir) {
+        return 0xFF;
+    }
+    if (c->dir == USB_REQ_TYP_OUT && UsbIntrSetupLen > c->maxOut) {
+        return 0xFF;
+    }
+    return c->setup();
+}
+
+// USB_CUST_CONTROL_DATA_HANDLER
+static void dispatchVendorData()
+{
+    __code VENDOR_COMMAND* c = vendorCommand();
+
+    if (c != NULL && c->data != NULL) {
+        c->data();
+    }
+}
+
+#endif /* BLINKY_DISPATCH_H */
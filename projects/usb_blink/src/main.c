@@ -23,12 +23,45 @@
 #define USB_CUST_CONF_POWER                 120
 #define USB_CUST_PRODUCT_NAME_LEN           7
 #define USB_CUST_PRODUCT_NAME               { 'B', 'l', 'i', 'n', 'k', 'y', 0 }
-#define USB_CUST_CONTROL_TRANSFER_HANDLER   handleVendorControlTransfer()
-#define USB_CUST_CONTROL_DATA_HANDLER       handleVendorDataTransfer()
+#define USB_CUST_CONTROL_TRANSFER_HANDLER   dispatchVendorSetup()
+#define USB_CUST_CONTROL_DATA_HANDLER       dispatchVendorData()
+
+// LED frame stream on the double buffered bulk endpoint 2 OUT, event records
+// on the interrupt endpoint 1 IN
+#define EVENT_PACKET_SIZE                   16
+#define USB_CUST_EP_COUNT                   2
+#define USB_CUST_EP_DEF                     USB_EP_DSC ep02o; USB_EP_DSC ep81i;
+#define USB_CUST_EP_DESC                                                                        \
+    {sizeof(USB_EP_DSC), USB_DESC_EP, USB_EP02_OUT, USB_TRNT_BULK, 64, 0x00},                   \
+    {sizeof(USB_EP_DSC), USB_DESC_EP, USB_EP01_IN,  USB_TRNT_INT, EVENT_PACKET_SIZE, 0x01}
+#define USB_CUST_BULK_EP2_OUT               handleStreamPacket
+#define USB_CUST_BULK_EP2_BUF               0x0040
+#define USB_CUST_EP_INIT                    setupEventEndpoint()
+#define USB_CUST_EP1_IN_HANDLER             handleEventSent()
+#define USB_CUST_RESET_HANDLER              handleBusReset()
+
+// interrupt statistics, the duration in Timer2 counts (0.5 us at 24 MHz)
+#define USB_CUST_STATS_BUF                  0x00E0
+#define USB_CUST_STATS_TIMER                timer2Count()
+#define USB_CUST_STATS_TIMER_PERIOD         (FREQ_SYS / 12 / 1000)
+#define USB_CUST_STATS_ISR(ticks)           countLoad(ticks)
+
+// binary trace of the USB requests, read with COMMAND_READ_TRACE
+#define USB_CUST_TRACE(type, arg)           traceRecord(type, arg)
+
+// the configuration does not announce remote wakeup
+#define USB_CUST_NO_REMOTE_WAKEUP
 
 // function declaration for custom USB transfer handlers
-static uint16_t handleVendorControlTransfer();
-static void handleVendorDataTransfer();
+static uint16_t dispatchVendorSetup();
+static void dispatchVendorData();
+static uint8_t handleStreamPacket(__xdata uint8_t* buf, uint8_t len);
+static void setupEventEndpoint();
+static void handleEventSent();
+static void handleBusReset();
+static uint16_t timer2Count();
+static void countLoad(uint16_t ticks);
+static void traceRecord(uint8_t type, uint8_t arg);
 
 // USB interrupt handlers - does the most of the USB grunt work
 #include "usb_intr.h"
@@ -40,17 +73,267 @@ static void handleVendorDataTransfer();
 #define LED_PIN 4
 SBIT(LED, PORT1, LED_PIN);
 
-#define COMMAND_TOGGLE_BLINK  0xD1
-#define COMMAND_READ_BLINK_TIME 0xD0
-#define COMMAND_SET_BLINK_TIME 0xD3
-#define COMMAND_SET_BLINK_SEQUENCE 0xD4
-#define COMMAND_JUMP_TO_BOOTLOADER 0xB0
+// LED brightness: levels 0 - 255 in perceptually even steps. P1.4 has no PWM
+// output, so the LED is on from LED_LEVEL_ON up. Define LED_PWM for a board
+// with the LED on P1.5: the PWM1 unit then drives it with the level mapped
+// through LedGamma to the duty cycle.
+// #define LED_PWM
+#define LED_PWM_PIN     5
+#define LED_PWM_CLOCK   4   // Fsys / 4 / 256: 23.4 kHz at 24 MHz, no flicker
+#define LED_LEVEL_MAX   255
+#define LED_LEVEL_ON    128
+
+// Output channels: channel n is the pin P1.n. SEQ_CHANNELS and the stream
+// frames with a mask set them with a single write of P1, so they all switch
+// in the same cycle. CHANNEL_PINS are the pins wired as outputs, the others
+// are left alone; P3 is not used, it carries USB and the UART. With LED_PWM
+// the LED is no channel: PWM1 drives its pin and keeps ledLevel.
+#ifndef CHANNEL_PINS
+#ifdef LED_PWM
+#define CHANNEL_PINS    0
+#else
+#define CHANNEL_PINS    (1 << LED_PIN)
+#endif
+#endif
+#if defined(LED_PWM) && (CHANNEL_PINS & (1 << LED_PWM_PIN))
+#error "CHANNEL_PINS: P1.5 is the PWM1 output of the LED"
+#endif
+
+// vendor requests: COMMAND_* codes and the dispatch table, generated from
+// ../blinky_protocol.def ('make protocol')
+#include "blinky_dispatch.h"
+
+// Timer2 in 16 bit auto reload mode, overflows every milli second (Fsys / 12)
+#define TIMER2_RELOAD (65536 - FREQ_SYS / 12 / 1000)
+
+// Sequence bytecode, version 3. It is a superset of the one byte version 1
+// opcodes (0x00 - 0x1F and the short jump), version 2 added the u16 operands
+// (little endian), version 3 the brightness levels, fades and channels.
+// Versions 0 and 1 have only the one byte opcodes, 0x20 - 0x7F among them
+// (LED = bit 4, wait bits 0-3 x 64 ms): a program keeps its version to the
+// player, so those bytes are no version 3 opcodes there.
+// COMMAND_SET_BLINK_SEQUENCE: wValue = bytecode version, wIndex = load address.
+// The data stage (up to the whole program) is collected in the program memory.
+// A program can also be loaded in chunks, the chunk at address 0 goes last and
+// completes the program.
+// There are two program slots: a new program is loaded into the idle slot and
+// takes over from the playing one at its next jump, loop round or end, so the
+// LED timing has no gap and never runs a half loaded program.
+#define SEQ_VERSION         3
+#define SEQ_VERSION_1       1   // the last one byte version, 0 was the first
+#define SEQ_PROGRAM_SIZE    256
+#define SEQ_STACK_DEPTH     8   // nested calls and loops
+#define SEQ_MAX_STEPS       32  // opcodes per tick, stops loops without a delay
+
+#define SEQ_END             0x00 // 0x01 - 0x1F: LED = bit 4, wait bits 0-3 x 64 ms
+#define SEQ_LED_OFF         0x20 // u16 ms: LED off, then wait
+#define SEQ_LED_ON          0x21 // u16 ms: LED on, then wait
+#define SEQ_LED_TOGGLE      0x22 // u16 ms: toggle the LED, then wait
+#define SEQ_WAIT            0x23 // u16 ms: wait, the LED is not changed
+#define SEQ_LED_LEVEL       0x24 // u8 level, u16 ms: set the brightness, then wait
+#define SEQ_FADE            0x25 // u8 level, u16 ms: fade to the level in ms
+#define SEQ_CHANNELS        0x26 // u8 mask, u8 value, u16 ms: set the channels, then wait
+#define SEQ_JUMP            0x30 // u16 address
+#define SEQ_CALL            0x31 // u16 address
+#define SEQ_RET             0x32
+#define SEQ_LOOP            0x33 // u8 count: repeat up to SEQ_ENDLOOP, 0 = forever
+#define SEQ_ENDLOOP         0x34
+#define SEQ_JUMP_SHORT      0x80 // 0x80 - 0xFF: jump to address 0 - 31 (bits 0-4)
+
+// Streaming: COMMAND_START_STREAM switches to frames sent on the bulk
+// endpoint. Each frame sets the LED (or the channels) and holds it for its
+// duration. The frames
+// wait in a ring buffer; the host sends no more frames than the free entries
+// (credits) reported by COMMAND_READ_STREAM_STATUS. Frames beyond that are
+// dropped and counted as overruns, an empty ring while playing is an underrun
+// (the LED keeps its state until the next frame arrives).
+#define STREAM_FRAMES       32  // ring buffer entries, a power of 2
+#define STREAM_FRAME_SIZE   4
+
+typedef struct {
+    uint16_t ms;        // how long the LED state is held, little endian
+    uint8_t led;        // bit 0: LED state, or the channel values
+    uint8_t mask;       // channels to set, 0: the LED
+} STREAM_FRAME;
+
+#define STREAM_LOW_WATERMARK 8  // EVENT_STREAM_LOW when the ring drains to this
+
+// Events: 4 byte records (type, arg, u16 value) queued for the interrupt
+// endpoint, up to EVENT_PACKET_SIZE / 4 of them per packet. A full queue
+// drops new records.
+#define EVENT_QUEUE_SIZE    8   // records, a power of 2
+#define EVENT_RECORD_SIZE   4
+#define EVENT_EP1_BUF       0x0020
+
+#define EVENT_SEQUENCE_DONE 0x01 // the sequence ended, value: 0
+#define EVENT_STREAM_LOW    0x02 // value: credits
+#define EVENT_BUS_RESET     0x03 // queued after every bus reset
+#define EVENT_ERROR         0x04 // arg: ERROR_*, value: see below
+
+#define ERROR_SEQ_OPCODE    0x01 // value: program counter after the opcode
+#define ERROR_SEQ_STACK     0x02 // value: program counter after the opcode
+#define ERROR_STREAM_UNDERRUN 0x03 // value: underruns
+#define ERROR_STREAM_OVERRUN  0x04 // value: overruns
+#define ERROR_SEQ_SHORT     0x05 // value: bytes of the short chunk
+
+typedef struct {
+    uint8_t type;
+    uint8_t arg;
+    uint16_t value;     // little endian
+} EVENT_RECORD;
+
+// Trace: 4 byte records (type, arg, u16 time) written by both interrupts at
+// a few cycles each, drained by the host with COMMAND_READ_TRACE. The time
+// counts 4 us steps and wraps every 262 ms. A full ring drops new records and
+// counts them as lost.
+#define TRACE_RECORDS       32  // a power of 2
+#define TRACE_RECORD_SIZE   4
+#define TRACE_HEADER_SIZE   4   // u16 time now, u8 lost records, u8 reserved
+#define TRACE_PER_READ      ((DEFAULT_ENDP0_SIZE - TRACE_HEADER_SIZE) / TRACE_RECORD_SIZE)
+#define TRACE_TICKS_PER_MS  (FREQ_SYS / 12 / 1000 / 8) // Timer2 counts / 8
+
+#define TRACE_SEQ_STEP      0x10 // arg: program counter (low byte) after the step
+#define TRACE_EVENT         0x11 // arg: EVENT_* posted
+
+typedef struct {
+    uint8_t type;       // USB_TRACE_* or TRACE_*
+    uint8_t arg;
+    uint16_t time;      // 4 us, little endian
+} TRACE_RECORD;
 
-__xdata __at (0x0020) uint8_t seqBuf[DEFAULT_ENDP0_SIZE]; 
+// Batch: COMMAND_BATCH carries sub-commands, each a vendor request code
+// followed by its arguments. They run in the order of the data stage, packet
+// by packet, so a record may straddle two packets. The reads append to the
+// result block that COMMAND_READ_BATCH returns: u8 executed sub-commands
+// (the host sends no more than 255), u8 BATCH_ERROR_*, then the read results.
+// The first error skips the rest.
+//   COMMAND_SET_BLINK_TIME      u16 ms
+//   COMMAND_TOGGLE_BLINK
+//   COMMAND_START_STREAM
+//   COMMAND_SET_BLINK_SEQUENCE  u16 address, u8 length, length bytes
+//   COMMAND_READ_BLINK_TIME     result: u16 ms
+//   COMMAND_READ_STREAM_STATUS  result: 4 x u16, as COMMAND_READ_STREAM_STATUS
+#define BATCH_RESULT_SIZE   COMMAND_READ_BATCH_MAX
+#define BATCH_HEADER_SIZE   2   // u8 executed, u8 error
+#define BATCH_RECORD_MAX    4   // code and the arguments before the data
+
+#define BATCH_ERROR_NONE    0x00
+#define BATCH_ERROR_CODE    0x01 // unknown or not batchable sub-command
+#define BATCH_ERROR_RANGE   0x02 // sequence fragment outside of the program
+#define BATCH_ERROR_FULL    0x03 // no room for a read result
+#define BATCH_ERROR_SHORT   0x04 // the data stage ended inside a record
+
+// CPU load: the interrupts do all the work, the main loop only polls for a
+// pending save. Their durations in Timer2 counts add up over a window of
+// LOAD_WINDOW_MS, COMMAND_READ_LOAD returns the sums of the last complete one.
+#define LOAD_WINDOW_MS      1000
+
+// Saved program: COMMAND_SAVE_SEQUENCE keeps the latest complete program in
+// the DataFlash (128 bytes, at the even code addresses from DATA_FLASH_ADDR)
+// and main() starts it on the next boot, before USB is set up. The record is
+// u8 magic, u8 length, u16 CRC-16/CCITT of the program, then the program. The
+// magic tells the bytecode version apart.
+// The main loop writes it, the CPU stops for every byte written; the magic
+// goes last, so a reset in between leaves no valid record. A program loaded
+// into the slot being saved while the write runs may be saved in part - the
+// CRC covers what was written. COMMAND_READ_SAVED returns SAVED_*, the
+// length and the CRC.
+#define SAVE_MAGIC          0xB3
+#define SAVE_MAGIC_V1       0xB1 // the program is version 0 / 1 bytecode
+#define SAVE_HEADER_SIZE    4
+#define SAVE_PROGRAM_MAX    (128 - SAVE_HEADER_SIZE)
+
+#define SAVED_NONE          0x00 // no valid record
+#define SAVED_VALID         0x01
+#define SAVED_BUSY          0x02 // the main loop is writing
+#define SAVED_FAILED        0x03 // a write failed, no valid record
+
+// XRAM: 0x0000 EP0 buffer, 0x0020 EP1 IN buffer, 0x0030 batch result,
+// 0x0040 EP2 OUT halves, 0x00C0 event queue, 0x00E0 USB statistics,
+// 0x0100 stream ring buffer, 0x0180 trace ring, 0x0200 sequence program slots;
+// the saved program is in the DataFlash
+__xdata __at (0x0030) uint8_t batchResult[BATCH_RESULT_SIZE];
+__xdata __at (0x00C0) EVENT_RECORD eventQueue[EVENT_QUEUE_SIZE];
+__xdata __at (0x0100) STREAM_FRAME streamRing[STREAM_FRAMES];
+__xdata __at (0x0180) TRACE_RECORD traceRing[TRACE_RECORDS];
+__xdata __at (0x0200) uint8_t seqSlots[2][SEQ_PROGRAM_SIZE];
 
 volatile __idata uint16_t blinkTime = 250;
 volatile __idata uint8_t command;
 
+// The USB interrupt runs on the higher priority (IP_EX bIP_USB) and preempts
+// Timer2, so the sequence VM does not delay a token. Timer2 changes the state
+// both of them touch with the USB interrupt held off; the enable bit is saved,
+// the helpers that take it are also called from the USB interrupt.
+#define USB_HOLD(saved)     { saved = IE_USB; IE_USB = 0; }
+#define USB_RESTORE(saved)  { IE_USB = saved; }
+
+// LED scheduler state - only touched by the Timer2 and USB interrupts
+volatile __idata uint16_t ledTicks = 1; // milli seconds to the next LED change
+__xdata uint8_t* seqProgram = seqSlots[0]; // the playing slot
+__idata uint8_t seqPending; // the idle slot holds a complete program
+__idata uint8_t seqLoaded;  // a complete program arrived since the power on
+__idata uint8_t seqV1;      // the playing program is version 0 / 1 bytecode
+__idata uint8_t seqLoadV1;  // so is the one in the idle slot
+__idata uint16_t seqPc;
+__idata uint8_t seqSp;
+__idata uint16_t seqStackPc[SEQ_STACK_DEPTH];
+__idata uint8_t seqStackCount[SEQ_STACK_DEPTH]; // loop count, 0 for a call
+__idata uint16_t seqLoadAddr;
+__idata uint8_t seqLoadShort;   // a chunk of the upload ended early
+
+// LED level and fade: the level moves by fadeStep (8.8 fixed point) on every
+// Timer2 tick, the last tick sets fadeTarget exactly
+__idata uint8_t ledLevel;
+__idata uint16_t fadeLevel;
+__idata uint16_t fadeStep;
+__idata uint16_t fadeTicks;     // ticks left, 0: no fade
+__idata uint8_t fadeTarget;
+
+// stream state, head and tail run freely - their difference is the fill level
+__idata uint8_t streamHead;     // next entry written by the USB interrupt
+__idata uint8_t streamTail;     // next entry played by Timer2
+__idata uint8_t streamStarved;  // the ring is empty, the underrun is counted
+__idata uint16_t streamPlayed;
+__idata uint16_t streamUnderruns;
+__idata uint16_t streamOverruns;
+
+// event queue - written by both interrupts, sent from the USB interrupt
+__idata uint8_t eventHead;
+__idata uint8_t eventTail;
+
+// trace - written by both interrupts, drained from the USB interrupt
+__idata uint8_t traceHead;
+__idata uint8_t traceTail;
+__idata uint8_t traceLost;
+__idata uint16_t traceMs;   // trace time of the last Timer2 reload
+
+// batch parser - only touched by the USB interrupt
+__idata uint8_t batchRecord[BATCH_RECORD_MAX]; // code and arguments so far
+__idata uint8_t batchRecordLen;
+__idata uint8_t batchResultLen;
+__idata uint8_t batchSeqLeft;   // fragment bytes still to copy
+__idata uint8_t batchV1;        // the fragments are version 0 / 1 bytecode
+__idata uint16_t batchRemain;   // data stage bytes not seen yet
+__xdata uint8_t* batchSeqDst;
+
+// CPU load - written by both interrupts
+__idata uint32_t loadBusy;
+__idata uint16_t loadWakeups;
+__idata uint16_t loadMs;
+__idata uint32_t loadLastBusy;
+__idata uint16_t loadLastWakeups;
+
+// saved program - shared with the main loop: SAVED_BUSY is set by the USB
+// interrupt, the main loop writes the record and sets the result
+volatile __idata uint8_t savedState;
+volatile __idata uint8_t savedLen;
+volatile __idata uint16_t savedCrc;
+__xdata uint8_t* volatile saveSrc;
+volatile __idata uint8_t saveV1;
+
+void Timer2Interrupt(void) __interrupt (INT_NO_TMR2);
+
 
 
 /*******************************************************************************
@@ -67,114 +350,1015 @@ static void jumpToBootloader()
 }
 
 /*******************************************************************************
-* Handler of the vendor Control transfer requests sent from the Host to 
-* Endpoint 0
+* Events on the interrupt endpoint 1 IN. The endpoint NAKs while the queue is
+* empty, so its response bits tell whether a packet is on the way.
+*******************************************************************************/
+static void sendEvents()
+{
+    __xdata uint8_t* buf = XRAM_PTR(EVENT_EP1_BUF);
+    uint8_t len = 0;
+
+    while (eventHead != eventTail && len < EVENT_PACKET_SIZE) {
+        memcpy(buf + len, &eventQueue[eventTail & (EVENT_QUEUE_SIZE - 1)], EVENT_RECORD_SIZE);
+        eventTail++;
+        len += EVENT_RECORD_SIZE;
+    }
+    if (len) {
+        UEP1_T_LEN = len;
+        UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+    }
+}
+
+static void postEvent(uint8_t type, uint8_t arg, uint16_t value)
+{
+    __xdata EVENT_RECORD* e;
+    __bit ie;
+
+    USB_HOLD(ie);
+    if ((uint8_t)(eventHead - eventTail) != EVENT_QUEUE_SIZE) {
+        e = &eventQueue[eventHead & (EVENT_QUEUE_SIZE - 1)];
+        e->type = type;
+        e->arg = arg;
+        e->value = value;
+        eventHead++;
+        traceRecord(TRACE_EVENT, type);
+        if ((UEP1_CTRL & MASK_UEP_T_RES) == UEP_T_RES_NAK) {
+            sendEvents();
+        }
+    }
+    USB_RESTORE(ie);
+}
+
+static void setupEventEndpoint()
+{
+    UEP1_DMA = EVENT_EP1_BUF;
+    UEP4_1_MOD = UEP4_1_MOD & 0x0F | bUEP1_TX_EN;
+    UEP1_CTRL = bUEP_AUTO_TOG | UEP_T_RES_NAK;
+}
+
+// the packet was sent, the toggle is flipped by hardware
+static void handleEventSent()
+{
+    UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+    sendEvents();
+}
+
+// the endpoint was reset to NAK and DATA0, older events are dropped
+static void handleBusReset()
+{
+    eventHead = eventTail = 0;
+    postEvent(EVENT_BUS_RESET, 0, 0);
+}
+
+/*******************************************************************************
+* Trace. A record is written with the USB interrupt held off, so a record of
+* the USB interrupt never lands in the middle of one from Timer2.
+*******************************************************************************/
+static uint16_t traceTime()
+{
+    uint16_t count = timer2Count();
+
+    // the reload happened, its interrupt did not run yet
+    if (TF2 && count < TRACE_TICKS_PER_MS * 4) {  // first half of the period
+        return traceMs + TRACE_TICKS_PER_MS + (count >> 3);
+    }
+    return traceMs + (count >> 3);
+}
+
+static void traceRecord(uint8_t type, uint8_t arg)
+{
+    __xdata TRACE_RECORD* r;
+    __bit ie;
+
+    USB_HOLD(ie);
+    if ((uint8_t)(traceHead - traceTail) == TRACE_RECORDS) {
+        if (traceLost != 0xFF) {
+            traceLost++;
+        }
+    } else {
+        r = &traceRing[traceHead & (TRACE_RECORDS - 1)];
+        r->type = type;
+        r->arg = arg;
+        r->time = traceTime();
+        traceHead++;
+    }
+    USB_RESTORE(ie);
+}
+
+// header and the oldest records into the EP0 buffer, returns the length.
+// Takes no more records than wLength leaves room for, the others stay.
+static uint8_t traceRead()
+{
+    __xdata uint8_t* dst = Ep0Buffer + TRACE_HEADER_SIZE;
+    uint8_t max = TRACE_PER_READ;
+    uint8_t n = 0;
+
+    if (UsbIntrSetupLen < TRACE_HEADER_SIZE + TRACE_PER_READ * TRACE_RECORD_SIZE) {
+        max = UsbIntrSetupLen < TRACE_HEADER_SIZE ? 0
+                : (uint8_t)(UsbIntrSetupLen - TRACE_HEADER_SIZE) / TRACE_RECORD_SIZE;
+    }
+    while (traceHead != traceTail && n < max) {
+        memcpy(dst, &traceRing[traceTail & (TRACE_RECORDS - 1)], TRACE_RECORD_SIZE);
+        traceTail++;
+        dst += TRACE_RECORD_SIZE;
+        n++;
+    }
+    *(uint16_t*) Ep0Buffer = traceTime();
+    Ep0Buffer[2] = traceLost;
+    Ep0Buffer[3] = 0;
+    traceLost = 0;
+    return TRACE_HEADER_SIZE + n * TRACE_RECORD_SIZE;
+}
+
+static __xdata uint8_t* seqIdleSlot()
+{
+    return (seqProgram == seqSlots[0]) ? seqSlots[1] : seqSlots[0];
+}
+
+// starts the program in the idle slot
+static void seqSwap()
+{
+    seqProgram = seqIdleSlot();
+    seqV1 = seqLoadV1;
+    seqPending = 0;
+    seqPc = 0;
+    seqSp = 0;
+}
+
+/*******************************************************************************
+* Handlers of the vendor Control transfer requests sent from the Host to
+* Endpoint 0, called by dispatchVendorSetup() after the direction and the data
+* stage length have been checked against blinky_protocol.def
 *
-* Returns : the length of the response that is stored in Ep0Buffer  
+* Returns : the length of the response that is stored in Ep0Buffer, 0xFF for
+*           a STALL
 *******************************************************************************/
 
-static uint16_t handleVendorControlTransfer()
-{
-    switch (UsbIntrSetupReq) {
-    // read blink time and send it back to the Host
-    case COMMAND_READ_BLINK_TIME : {
-        uint16_t* dst = (uint16_t*) Ep0Buffer;
-        *dst = blinkTime; // write the blikTime to the Ep0buffer
-        return 2; // request to transfer 2 bytes back to the host
-    }; break;
-
-    // toggle blink time
-    case COMMAND_TOGGLE_BLINK : {
-        blinkTime = (blinkTime == 250) ? 100 : 250;
-    } break;
-
-    //set blink time
-    case COMMAND_SET_BLINK_TIME : {
-        // read the value from the wValue of the control transfer
-        blinkTime = ((uint16_t)UsbSetupBuf->wValueH<<8) | (UsbSetupBuf->wValueL);;      
-    } break;
-    case COMMAND_SET_BLINK_SEQUENCE : {
-        //nothing to do, just wait for the data and confirm this transfer by returning 0
-    } break;
-    //jump to bootloader - remotely triggered from the Host!
-    case COMMAND_JUMP_TO_BOOTLOADER : {
-        jumpToBootloader();
-    } break;
-    default:
-        return 0xFF; // Command not supported
-    } // end of the switch
+// read blink time and send it back to the Host
+static uint16_t handleReadBlinkTime()
+{
+    uint16_t* dst = (uint16_t*) Ep0Buffer;
+    *dst = blinkTime; // write the blikTime to the Ep0buffer
+    return COMMAND_READ_BLINK_TIME_SIZE; // request to transfer 2 bytes back to the host
+}
+
+// a new blink time, applied on the next tick, ends a sequence or a stream
+static void setBlinkTime(uint16_t ms)
+{
+    blinkTime = ms;
+    ledTicks = 1;
+    command = 0;
+}
+
+// credits, played frames, underruns and overruns - 4 x 2 bytes
+static void readStreamStatus(__xdata uint8_t* buf)
+{
+    __xdata uint16_t* dst = (__xdata uint16_t*) buf;
+    dst[0] = STREAM_FRAMES - (uint8_t)(streamHead - streamTail);
+    dst[1] = streamPlayed;
+    dst[2] = streamUnderruns;
+    dst[3] = streamOverruns;
+}
+
+// toggle blink time
+static uint16_t handleToggleBlink()
+{
+    blinkTime = (blinkTime == 250) ? 100 : 250;
+    ledTicks = 1;
     command = 0;
-    return 0; // no data to transfer back to the host
+    return 0;
+}
+
+//set blink time
+static uint16_t handleSetBlinkTime()
+{
+    // read the value from the wValue of the control transfer
+    setBlinkTime(((uint16_t)UsbSetupBuf->wValueH<<8) | (UsbSetupBuf->wValueL));
+    return 0;
+}
+
+static uint16_t handleSetSequence()
+{
+    // check the version and the range, then wait for the data
+    seqLoadAddr = ((uint16_t)UsbSetupBuf->wIndexH<<8) | (UsbSetupBuf->wIndexL);
+    if (UsbSetupBuf->wValueH || UsbSetupBuf->wValueL > SEQ_VERSION ||
+            seqLoadAddr > SEQ_PROGRAM_SIZE ||
+            UsbIntrSetupLen > SEQ_PROGRAM_SIZE - seqLoadAddr) {
+        return 0xFF;
+    }
+    // collect all data packets in the idle slot, it is not complete now
+    UsbIntrOutDst = seqIdleSlot() + seqLoadAddr;
+    seqLoadV1 = UsbSetupBuf->wValueL <= SEQ_VERSION_1;
+    seqPending = 0;
+    return 0; // keep playing the current sequence
+}
+
+// a chunk of the program is in the idle slot, the one at address 0 completes
+// it: the program starts, or waits for the next boundary of the playing one
+static void seqLoadDone()
+{
+    if (seqLoadAddr) {
+        return; // more chunks follow, the one at address 0 is the last
+    }
+    if (seqLoadShort) {
+        seqLoadShort = 0;
+        return; // a chunk is missing, the playing program goes on
+    }
+    seqLoaded = 1;
+    blinkTime = 100; // blink fast after the sequence
+    if (command == COMMAND_SET_BLINK_SEQUENCE) {
+        seqPending = 1; // the player swaps at the next boundary
+        return;
+    }
+    command = COMMAND_SET_BLINK_SEQUENCE;
+    seqSwap();
+    ledTicks = 1; // start on the next tick
+}
+
+// Ah! The data for blink sequence arrived - already in the program memory.
+// A data stage that ended with a short packet before wLength left a gap in
+// the slot: the upload is dropped with an error event at its last chunk.
+static void handleSequenceData()
+{
+    if (UsbIntrOutLen != UsbIntrSetupLen) {
+        seqLoadShort = 1;
+        postEvent(EVENT_ERROR, ERROR_SEQ_SHORT, UsbIntrOutLen);
+    }
+    seqLoadDone();
+}
+
+// drop the frames and the counters, play the frames as they arrive
+static uint16_t handleStartStream()
+{
+    streamHead = streamTail = 0;
+    streamStarved = 1; // waiting for the first frame is no underrun
+    streamPlayed = streamUnderruns = streamOverruns = 0;
+    command = COMMAND_START_STREAM;
+    ledTicks = 1;
+    return 0;
+}
+
+static uint16_t handleReadStreamStatus()
+{
+    readStreamStatus(Ep0Buffer);
+    return COMMAND_READ_STREAM_STATUS_SIZE;
+}
+
+// the USB_INTR_STATS counters - 16 x 2 bytes
+static uint16_t handleReadStats()
+{
+    memcpy(Ep0Buffer, UsbIntrStats, sizeof(USB_INTR_STATS));
+    return sizeof(USB_INTR_STATS);
+}
+
+// the load sums of the last complete window, little endian
+static uint16_t handleReadLoad()
+{
+    Ep0Buffer[0] = (uint8_t) loadLastBusy;
+    Ep0Buffer[1] = (uint8_t) (loadLastBusy >> 8);
+    Ep0Buffer[2] = (uint8_t) (loadLastBusy >> 16);
+    Ep0Buffer[3] = (uint8_t) (loadLastBusy >> 24);
+    Ep0Buffer[4] = (uint8_t) loadLastWakeups;
+    Ep0Buffer[5] = loadLastWakeups >> 8;
+    Ep0Buffer[6] = (uint8_t) LOAD_WINDOW_MS;
+    Ep0Buffer[7] = LOAD_WINDOW_MS >> 8;
+    return COMMAND_READ_LOAD_SIZE;
+}
+
+// saves the first wValue bytes of the latest complete program, the one
+// waiting for the swap or else the playing one; 0 erases the record. Saving
+// stalls until a complete program arrived since the power on.
+static uint16_t handleSaveSequence()
+{
+    if (UsbSetupBuf->wValueH || UsbSetupBuf->wValueL > SAVE_PROGRAM_MAX ||
+            savedState == SAVED_BUSY || (UsbSetupBuf->wValueL && !seqLoaded)) {
+        return 0xFF;
+    }
+    saveSrc = seqPending ? seqIdleSlot() : seqProgram;
+    saveV1 = seqPending ? seqLoadV1 : seqV1;
+    savedLen = UsbSetupBuf->wValueL;
+    savedState = SAVED_BUSY; // the main loop takes over
+    return 0;
+}
+
+// state, length and CRC of the saved program - 4 bytes
+static uint16_t handleReadSaved()
+{
+    Ep0Buffer[0] = savedState;
+    Ep0Buffer[1] = savedLen;
+    Ep0Buffer[2] = (uint8_t) savedCrc;
+    Ep0Buffer[3] = savedCrc >> 8;
+    return COMMAND_READ_SAVED_SIZE;
+}
+
+// removes up to TRACE_PER_READ records from the trace
+static uint16_t handleReadTrace()
+{
+    return traceRead();
+}
+
+// the length of a batch record up to its data, 0 for a code that can't be
+// batched
+static uint8_t batchRecordSize(uint8_t code)
+{
+    switch (code) {
+    case COMMAND_TOGGLE_BLINK:
+    case COMMAND_START_STREAM:
+    case COMMAND_READ_BLINK_TIME:
+    case COMMAND_READ_STREAM_STATUS:
+        return 1;
+    case COMMAND_SET_BLINK_TIME:
+        return 3;
+    case COMMAND_SET_BLINK_SEQUENCE:
+        return 4;
+    }
+    return 0;
 }
 
-static void handleVendorDataTransfer()
+// len bytes at the end of the result block, NULL when they don't fit
+static __xdata uint8_t* batchReserve(uint8_t len)
 {
-    switch (UsbIntrSetupReq) {
-        // Ah! The data for blink sequence arrived.
-        case COMMAND_SET_BLINK_SEQUENCE : {
-            // copy the contents of the EP0 buffer into the sequence buffer
-            memcpy(seqBuf, Ep0Buffer, USB_RX_LEN);
-            command = COMMAND_SET_BLINK_SEQUENCE;
-            blinkTime = 0; //interrupt the default blinking
-        } break;
+    __xdata uint8_t* dst = batchResult + batchResultLen;
+
+    if (len > BATCH_RESULT_SIZE - batchResultLen) {
+        return NULL;
+    }
+    batchResultLen += len;
+    return dst;
+}
+
+// runs the record collected in batchRecord, returns BATCH_ERROR_*
+static uint8_t batchExecute()
+{
+    __xdata uint8_t* dst;
+    uint16_t addr = ((uint16_t)batchRecord[2]<<8) | batchRecord[1];
+
+    switch (batchRecord[0]) {
+    case COMMAND_SET_BLINK_TIME:
+        setBlinkTime(addr);
+        break;
+    case COMMAND_TOGGLE_BLINK:
+        handleToggleBlink();
+        break;
+    case COMMAND_START_STREAM:
+        handleStartStream();
+        break;
+    case COMMAND_SET_BLINK_SEQUENCE:
+        if (batchRecord[3] == 0 || addr > SEQ_PROGRAM_SIZE - batchRecord[3]) {
+            return BATCH_ERROR_RANGE;
+        }
+        // as handleSetSequence(), counted when the data is copied
+        seqLoadAddr = addr;
+        seqLoadV1 = batchV1;
+        seqPending = 0;
+        batchSeqDst = seqIdleSlot() + addr;
+        batchSeqLeft = batchRecord[3];
+        return BATCH_ERROR_NONE;
+    case COMMAND_READ_BLINK_TIME:
+        dst = batchReserve(COMMAND_READ_BLINK_TIME_SIZE);
+        if (dst == NULL) {
+            return BATCH_ERROR_FULL;
+        }
+        *(__xdata uint16_t*) dst = blinkTime;
+        break;
+    case COMMAND_READ_STREAM_STATUS:
+        dst = batchReserve(COMMAND_READ_STREAM_STATUS_SIZE);
+        if (dst == NULL) {
+            return BATCH_ERROR_FULL;
+        }
+        readStreamStatus(dst);
+        break;
     }
+    batchResult[0]++;
+    return BATCH_ERROR_NONE;
+}
+
+// clears the result block, the sub-commands follow in the data stage
+static uint16_t handleBatch()
+{
+    if (UsbSetupBuf->wValueH || UsbSetupBuf->wValueL > SEQ_VERSION) {
+        return 0xFF;
+    }
+    batchResult[0] = 0;
+    batchResult[1] = BATCH_ERROR_NONE;
+    batchResultLen = BATCH_HEADER_SIZE;
+    batchRecordLen = 0;
+    batchSeqLeft = 0;
+    batchRemain = UsbIntrSetupLen;
+    batchV1 = UsbSetupBuf->wValueL <= SEQ_VERSION_1;
+    return 0;
+}
+
+// one packet of the batch, the records run as soon as they are complete
+static void handleBatchData()
+{
+    __xdata uint8_t* src = Ep0Buffer;
+    uint8_t len = batchRemain - UsbIntrOutRemain;
+    uint8_t last = UsbIntrOutRemain == 0 || len < EP0_BUFF_SIZE;
+    uint8_t n;
+
+    batchRemain = UsbIntrOutRemain;
+    while (len && batchResult[1] == BATCH_ERROR_NONE) {
+        if (batchSeqLeft) {
+            n = (len < batchSeqLeft) ? len : batchSeqLeft;
+            memcpy(batchSeqDst, src, n);
+            batchSeqDst += n;
+            batchSeqLeft -= n;
+            src += n;
+            len -= n;
+            if (batchSeqLeft == 0) {
+                seqLoadDone(); // the fragment at address 0 starts the program
+                batchResult[0]++;
+            }
+            continue;
+        }
+        batchRecord[batchRecordLen++] = *src++;
+        len--;
+        n = batchRecordSize(batchRecord[0]);
+        if (n == 0) {
+            batchResult[1] = BATCH_ERROR_CODE;
+        } else if (batchRecordLen == n) {
+            batchRecordLen = 0;
+            batchResult[1] = batchExecute();
+        }
+    }
+    if (last && (batchRecordLen || batchSeqLeft) && batchResult[1] == BATCH_ERROR_NONE) {
+        batchResult[1] = BATCH_ERROR_SHORT;
+    }
+}
+
+// executed sub-commands, error and read results of the last batch
+static uint16_t handleReadBatch()
+{
+    memcpy(Ep0Buffer, batchResult, batchResultLen);
+    return batchResultLen;
+}
+
+//jump to bootloader - remotely triggered from the Host!
+static uint16_t handleJumpToBootloader()
+{
+    jumpToBootloader();
+    return 0;
+}
+
+/*******************************************************************************
+* Handler of the stream packets on the bulk endpoint 2 - stores the frames in
+* the ring buffer, the packet is always consumed
+*******************************************************************************/
+static uint8_t handleStreamPacket(__xdata uint8_t* buf, uint8_t len)
+{
+    uint8_t dropped = 0;
+
+    len /= STREAM_FRAME_SIZE;
+    if (command != COMMAND_START_STREAM) {
+        return 1; // not streaming
+    }
+    while (len--) {
+        if ((uint8_t)(streamHead - streamTail) == STREAM_FRAMES) {
+            streamOverruns++;
+            dropped = 1;
+        } else {
+            memcpy(&streamRing[streamHead & (STREAM_FRAMES - 1)], buf, STREAM_FRAME_SIZE);
+            streamHead++;
+        }
+        buf += STREAM_FRAME_SIZE;
+    }
+    if (dropped) {
+        postEvent(EVENT_ERROR, ERROR_STREAM_OVERRUN, streamOverruns);
+    }
+    return 1;
 }
 
 static void setupGPIO()
 {
+#ifdef LED_PWM
+    // Configure pin 1.5 as push-pull output of PWM1, starting dark
+    P1_DIR_PU = 0;
+    P1_MOD_OC &= ~(1 << LED_PWM_PIN);
+    P1_DIR_PU |= (1 << LED_PWM_PIN);
+    PWM_CK_SE = LED_PWM_CLOCK;
+    PWM_CTRL = bPWM_CLR_ALL;
+    PWM_CTRL = 0;
+    PWM_DATA1 = 0;
+    PWM_CTRL = bPWM1_OUT_EN;
+#else
     // Configure pin 1.4 as GPIO output
     P1_DIR_PU = 0;
     P1_MOD_OC &=  ~(1 << LED_PIN);
     P1_DIR_PU |= (1 << LED_PIN);
+#endif
+    // the channels are push-pull outputs too, they read back as written
+    P1_MOD_OC &= ~CHANNEL_PINS;
+    P1_DIR_PU |= CHANNEL_PINS;
+}
+
+// duty cycle of the levels 0, 8, 16 ... 256 (gamma 2.2), interpolated between
+__code uint8_t LedGamma[33] = {
+    0, 0, 1, 1, 3, 4, 6, 9, 12, 16, 20, 24, 29, 35, 41, 48,
+    55, 63, 72, 81, 91, 101, 112, 123, 135, 148, 161, 175, 190, 205, 221, 238,
+    255
+};
+
+// drives the LED with a brightness level, called from both interrupts
+static void setLedLevel(uint8_t level)
+{
+    __bit ie;
+#ifdef LED_PWM
+    uint8_t low = LedGamma[level >> 3];
+    uint8_t step = LedGamma[(level >> 3) + 1] - low; // at most 17, x 7 fits 8 bits
+
+    low += (uint8_t) (step * (level & 7)) >> 3;
+    USB_HOLD(ie);
+    PWM_DATA1 = low;
+#else
+    USB_HOLD(ie);
+    LED = level >= LED_LEVEL_ON;
+#endif
+    ledLevel = level;
+    USB_RESTORE(ie);
+}
 
+// sets the channels in mask to value with one write of P1, called from both
+// interrupts. The LED pin, when it is a channel, keeps its level in step.
+static void setChannels(uint8_t mask, uint8_t value)
+{
+    __bit ie;
+
+    mask &= CHANNEL_PINS;
+    USB_HOLD(ie);
+    P1 = (P1 & ~mask) | (value & mask);
+#ifndef LED_PWM
+    if (mask & (1 << LED_PIN)) {
+        ledLevel = (value & (1 << LED_PIN)) ? LED_LEVEL_MAX : 0;
+    }
+#endif
+    USB_RESTORE(ie);
 }
 
-// this delay can be interrupted, so we can exit earlier if needed
-static void delayNonBlocking(uint16_t d)
+// (diff << 8) / ms by shift and subtract. It runs on the Timer2 interrupt,
+// which must not call the non-reentrant library division (_divuint).
+static uint16_t fadeStepOf(uint16_t diff, uint16_t ms)
 {
-    uint16_t bt = blinkTime;
+    uint16_t rest = 0;
+    uint16_t step = 0;
+    uint8_t carry;
+    uint8_t i;
 
-    while (d > 100) {
-        mDelaymS(100);
-        // delay interrupted when a new value is set into the blinkTime 
-        if (bt != blinkTime) {
-            return;
+    diff <<= 8;
+    for (i = 16; i; i--) {
+        carry = rest >> 15; // the shifted rest has 17 bits, it is >= ms then
+        rest = (rest << 1) | (diff >> 15);
+        diff <<= 1;
+        step <<= 1;
+        if (carry || rest >= ms) {
+            rest -= ms;
+            step |= 1;
         }
-        d -= 100;
     }
-    if (d) {
-       mDelaymS(d);
+    return step;
+}
+
+// starts a fade from the current level, the Timer2 ticks carry it out
+static void startFade(uint8_t level, uint16_t ms)
+{
+    uint16_t diff = (level > ledLevel) ? level - ledLevel : ledLevel - level;
+
+    fadeLevel = (uint16_t) ledLevel << 8;
+    fadeStep = fadeStepOf(diff, ms);
+    fadeTarget = level;
+    fadeTicks = ms;
+}
+
+// one milli second of the fade, a few cycles on the Timer2 interrupt
+static void fadeTick()
+{
+    if (--fadeTicks == 0) {
+        setLedLevel(fadeTarget);
+        return;
+    }
+    if (fadeTarget > ledLevel) {
+        fadeLevel += fadeStep;
+    } else {
+        fadeLevel -= fadeStep;
+    }
+    setLedLevel(fadeLevel >> 8);
+}
+
+// counts since the last Timer2 reload, the high byte is read again when the
+// low byte wrapped in between
+static uint16_t timer2Count()
+{
+    uint8_t high;
+    uint8_t low;
+
+    do {
+        high = TH2;
+        low = TL2;
+    } while (high != TH2);
+    return (((uint16_t) high << 8) | low) - TIMER2_RELOAD;
+}
+
+// adds an interrupt to the CPU load, called from both interrupts
+static void countLoad(uint16_t ticks)
+{
+    __bit ie;
+
+    USB_HOLD(ie);
+    loadBusy += ticks;
+    loadWakeups++;
+    USB_RESTORE(ie);
+}
+
+static void setupTimer2()
+{
+    T2MOD &= ~(bTMR_CLK | bT2_CLK); // Fsys / 12
+    T2CON = 0x00;                   // 16 bit auto reload timer
+    RCAP2H = TH2 = TIMER2_RELOAD >> 8;
+    RCAP2L = TL2 = TIMER2_RELOAD & 0xFF;
+    ET2 = 1;
+    TR2 = 1;
+}
+
+static uint8_t seqFetch()
+{
+    // reading past the program ends it
+    return seqPc < SEQ_PROGRAM_SIZE ? seqProgram[seqPc++] : SEQ_END;
+}
+
+static uint16_t seqFetch16()
+{
+    uint16_t value = seqFetch();
+    return value | ((uint16_t) seqFetch() << 8);
+}
+
+static uint8_t seqPush(uint16_t pc, uint8_t count)
+{
+    if (seqSp == SEQ_STACK_DEPTH) {
+        return 0;
+    }
+    seqStackPc[seqSp] = pc;
+    seqStackCount[seqSp++] = count;
+    return 1;
+}
+
+// starts the pending program, returns 0 when there is none. The USB
+// interrupt clears seqPending for a new upload into the idle slot, so the
+// check and the swap are one step for it.
+static uint8_t seqTakePending()
+{
+    uint8_t pending;
+    __bit ie;
+
+    USB_HOLD(ie);
+    pending = seqPending;
+    if (pending) {
+        seqSwap();
+    }
+    USB_RESTORE(ie);
+    return pending;
+}
+
+// jump and loop boundary: a pending program takes over here
+static void seqBranch(uint16_t pc)
+{
+    if (!seqTakePending()) {
+        seqPc = pc;
+    }
+}
+
+// ends the sequence on an error, reported with the program counter
+static uint16_t seqError(uint8_t error)
+{
+    postEvent(EVENT_ERROR, error, seqPc);
+    return 0;
+}
+
+// runs the sequence up to the next delay, returns the delay or 0 at the end
+// (also on an unknown opcode and on a stack overflow or underflow)
+static uint16_t playSequenceStep()
+{
+    uint8_t steps = SEQ_MAX_STEPS;
+    uint16_t delay;
+    uint8_t opcode;
+
+    while (steps--) {
+        opcode = seqFetch();
+        delay = 0;
+        if (opcode < SEQ_LED_OFF || (seqV1 && opcode < SEQ_JUMP_SHORT)) {
+            //end of the sequence, or the start of the pending one
+            if (SEQ_END == opcode) {
+                if (!seqTakePending()) {
+                    break;
+                }
+                continue;
+            }
+            //turn the LED on or off and then wait in units of 64 milli seconds
+            setLedLevel((opcode & 0x10) ? LED_LEVEL_MAX : 0);
+            delay = (opcode & 0xF) << 6;
+        } else if (opcode & SEQ_JUMP_SHORT) {
+            seqBranch(opcode & 0x1F);
+        } else {
+            switch (opcode) {
+            case SEQ_LED_OFF:
+                setLedLevel(0);
+                delay = seqFetch16();
+                break;
+            case SEQ_LED_ON:
+                setLedLevel(LED_LEVEL_MAX);
+                delay = seqFetch16();
+                break;
+            case SEQ_LED_TOGGLE:
+                setLedLevel(ledLevel ? 0 : LED_LEVEL_MAX);
+                delay = seqFetch16();
+                break;
+            case SEQ_WAIT:
+                delay = seqFetch16();
+                break;
+            case SEQ_LED_LEVEL:
+                setLedLevel(seqFetch());
+                delay = seqFetch16();
+                break;
+            case SEQ_FADE:
+                opcode = seqFetch();
+                delay = seqFetch16();
+                if (delay) {
+                    startFade(opcode, delay);
+                } else {
+                    setLedLevel(opcode);
+                }
+                break;
+            case SEQ_CHANNELS:
+                opcode = seqFetch();
+                setChannels(opcode, seqFetch());
+                delay = seqFetch16();
+                break;
+            case SEQ_JUMP:
+                seqBranch(seqFetch16());
+                break;
+            case SEQ_CALL:
+                delay = seqFetch16();
+                if (!seqPush(seqPc, 0)) {
+                    return seqError(ERROR_SEQ_STACK);
+                }
+                seqPc = delay;
+                delay = 0;
+                break;
+            case SEQ_RET:
+                if (!seqSp) {
+                    return seqError(ERROR_SEQ_STACK);
+                }
+                seqPc = seqStackPc[--seqSp];
+                break;
+            case SEQ_LOOP:
+                opcode = seqFetch();
+                if (!seqPush(seqPc, opcode)) {
+                    return seqError(ERROR_SEQ_STACK);
+                }
+                break;
+            case SEQ_ENDLOOP:
+                if (!seqSp) {
+                    return seqError(ERROR_SEQ_STACK);
+                }
+                opcode = seqSp - 1;
+                if (!seqStackCount[opcode] || --seqStackCount[opcode]) {
+                    seqBranch(seqStackPc[opcode]); // next round
+                } else {
+                    seqSp = opcode; // done
+                }
+                break;
+            default:
+                return seqError(ERROR_SEQ_OPCODE);
+            }
+        }
+        if (delay) {
+            return delay;
+        }
     }
+    return 0;
 }
 
-static void playBlinkySequence()
+// plays the next stream frames up to one with a duration and returns it, an
+// empty ring is checked again on the next tick. A COMMAND_START_STREAM resets
+// the ring and the counters, so the frames are played with USB held off.
+static uint16_t playStreamFrame()
 {
-    uint8_t seqPos = 0;
+    __xdata STREAM_FRAME* frame;
+    uint16_t ms;
+    __bit ie;
+
+    USB_HOLD(ie);
+    while (streamHead != streamTail) {
+        frame = &streamRing[streamTail & (STREAM_FRAMES - 1)];
+        if (frame->mask) {
+            setChannels(frame->mask, frame->led);
+        } else {
+            setLedLevel((frame->led & 1) ? LED_LEVEL_MAX : 0);
+        }
+        ms = frame->ms;
+        streamTail++;
+        streamPlayed++;
+        streamStarved = 0;
+        if ((uint8_t)(streamHead - streamTail) == STREAM_LOW_WATERMARK) {
+            postEvent(EVENT_STREAM_LOW, 0, STREAM_FRAMES - STREAM_LOW_WATERMARK);
+        }
+        if (ms) {
+            USB_RESTORE(ie);
+            return ms;
+        }
+    }
+    if (!streamStarved) {
+        streamStarved = 1;
+        streamUnderruns++;
+        postEvent(EVENT_ERROR, ERROR_STREAM_UNDERRUN, streamUnderruns);
+    }
+    USB_RESTORE(ie);
+    return 1;
+}
 
-    // re-initialise blinkTime so we can detect an interrupt within the non-blocking delay    
-    blinkTime = 100;
+// changes the LED, returns the milli seconds to the next change
+static uint16_t playLed()
+{
+    uint16_t ticks;
+    __bit ie;
 
-    // play the whole sequence buffer
-    while (seqPos < DEFAULT_ENDP0_SIZE) {
-        uint16_t opcode = seqBuf[seqPos++];
-        //early exit on 0 sequence 'opcode' or when the playback was cancelled
-        if (0 == opcode || COMMAND_SET_BLINK_SEQUENCE != command) {
-            break;
+    if (command == COMMAND_START_STREAM) {
+        return playStreamFrame();
+    }
+    if (command == COMMAND_SET_BLINK_SEQUENCE) {
+        ticks = playSequenceStep();
+        if (ticks) {
+            traceRecord(TRACE_SEQ_STEP, (uint8_t) seqPc);
+            return ticks;
         }
-        // handle the 'jump' opcode
-        if (opcode & (1<<7)) {
-            seqPos = opcode & 0x1F; // jump only to a sequence offset between 0-32 
+        // a program that arrived meanwhile starts on the next tick
+        USB_HOLD(ie);
+        ticks = seqPending;
+        if (ticks) {
+            seqSwap();
         } else {
-            //turn the LED on or off and then wait
-            LED = (opcode & 0x10) ? 1 : 0;
-            delayNonBlocking((opcode & 0xF) << 6); // delay in units of 64 milliseconds
+            command = 0;
+        }
+        USB_RESTORE(ie);
+        if (ticks) {
+            return 1;
         }
+        //turn off the led
+        setLedLevel(0);
+        postEvent(EVENT_SEQUENCE_DONE, 0, 0);
+    } else {
+        setLedLevel(ledLevel ? 0 : LED_LEVEL_MAX);
     }
+    return blinkTime ? blinkTime : 1;
+}
 
-    //turn off the led
-    LED = 0;
+/*******************************************************************************
+* DataFlash: byte i of the record is at DATA_FLASH_ADDR + 2 * i. Only the main
+* loop and main() before the interrupts touch the ROM registers.
+*******************************************************************************/
+static uint8_t flashRead(uint8_t i)
+{
+    ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+    ROM_ADDR_L = i << 1;
+    ROM_CTRL = ROM_CMD_READ;
+    return ROM_DATA_L;
+}
 
-    command = 0;
+// returns 0 when the byte could not be written
+static uint8_t flashWrite(uint8_t i, uint8_t value)
+{
+    ROM_ADDR_H = DATA_FLASH_ADDR >> 8;
+    ROM_ADDR_L = i << 1;
+    ROM_DATA_L = value;
+    if (!(ROM_STATUS & bROM_ADDR_OK)) {
+        return 0;
+    }
+    ROM_CTRL = ROM_CMD_WRITE; // the CPU stops until the byte is written
+    return !(ROM_STATUS & bROM_CMD_ERR);
+}
+
+// GLOBAL_CFG can only be written in the safe mode, which ends after a few
+// cycles - no interrupt in between
+static void flashEnableWrite(uint8_t enable)
+{
+    EA = 0;
+    SAFE_MOD = 0x55;
+    SAFE_MOD = 0xAA;
+    if (enable) {
+        GLOBAL_CFG |= bDATA_WE;
+    } else {
+        GLOBAL_CFG &= ~bDATA_WE;
+    }
+    SAFE_MOD = 0;
+    EA = 1;
+}
+
+// CRC-16/CCITT, bit by bit: no table in the code memory, the programs are short
+static uint16_t crc16(uint16_t crc, uint8_t value)
+{
+    uint8_t i;
+
+    crc ^= (uint16_t) value << 8;
+    for (i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// writes the record of the program in saveSrc, called from the main loop.
+// The CRC is taken from the bytes read back, as the next boot reads them.
+static void saveProgram()
+{
+    uint8_t len = savedLen;
+    uint16_t crc = 0xFFFF;
+    uint8_t ok;
+    uint8_t i;
+
+    flashEnableWrite(1);
+    ok = flashWrite(0, 0); // invalid until the end
+    for (i = 0; ok && i < len; i++) {
+        ok = flashWrite(SAVE_HEADER_SIZE + i, saveSrc[i]);
+        crc = crc16(crc, flashRead(SAVE_HEADER_SIZE + i));
+    }
+    if (ok && len) {
+        ok = flashWrite(1, len) && flashWrite(2, (uint8_t) crc) && flashWrite(3, crc >> 8) &&
+                flashWrite(0, saveV1 ? SAVE_MAGIC_V1 : SAVE_MAGIC);
+    }
+    flashEnableWrite(0);
+
+    savedCrc = len ? crc : 0;
+    savedState = !ok ? SAVED_FAILED : (len ? SAVED_VALID : SAVED_NONE);
+}
+
+// starts the saved program as if the host had just loaded it, called before
+// the interrupts are enabled
+static void loadSavedProgram()
+{
+    __xdata uint8_t* dst = seqIdleSlot();
+    uint8_t magic = flashRead(0);
+    uint8_t len = flashRead(1);
+    uint16_t crc = 0xFFFF;
+    uint8_t i;
+
+    if ((magic != SAVE_MAGIC && magic != SAVE_MAGIC_V1) || len == 0 || len > SAVE_PROGRAM_MAX) {
+        return;
+    }
+    for (i = 0; i < len; i++) {
+        dst[i] = flashRead(SAVE_HEADER_SIZE + i);
+        crc = crc16(crc, dst[i]);
+    }
+    if (crc != (flashRead(2) | ((uint16_t) flashRead(3) << 8))) {
+        return;
+    }
+    savedLen = len;
+    savedCrc = crc;
+    savedState = SAVED_VALID;
+    seqLoadAddr = 0;
+    seqLoadV1 = magic == SAVE_MAGIC_V1;
+    seqLoadDone();
+}
+
+/*******************************************************************************
+* Timer2 interrupt - the LED scheduler, runs every milli second. A new blink
+* time or sequence sets ledTicks to 1, so it takes effect on the next tick.
+* It also closes the CPU load window. The USB interrupt preempts it.
+*******************************************************************************/
+void Timer2Interrupt(void) __interrupt (INT_NO_TMR2)
+{
+    uint16_t ticks;
+    __bit ie;
+
+    TF2 = 0;
+    USB_HOLD(ie);
+    traceMs += TRACE_TICKS_PER_MS;
+    ticks = --ledTicks;
+    USB_RESTORE(ie);
+    if (fadeTicks) {
+        fadeTick();
+    }
+    if (!ticks) {
+        fadeTicks = 0; // a new LED command cuts a fade short
+        ticks = playLed();
+        // a USB request meanwhile set ledTicks to 1, its tick comes first
+        USB_HOLD(ie);
+        if (!ledTicks) {
+            ledTicks = ticks;
+        }
+        USB_RESTORE(ie);
+    }
+
+    // the interrupt started at the reload, the count is its duration (and
+    // that of the USB interrupts that delayed or preempted it, the load errs
+    // on the high side)
+    countLoad(timer2Count());
+    USB_HOLD(ie);
+    if (++loadMs == LOAD_WINDOW_MS) {
+        loadLastBusy = loadBusy;
+        loadLastWakeups = loadWakeups;
+        loadBusy = 0;
+        loadWakeups = 0;
+        loadMs = 0;
+    }
+    USB_RESTORE(ie);
 }
 
 void main() {
@@ -185,15 +1369,22 @@ void main() {
     // configure GPIO ports
     setupGPIO();
 
-    // configure USB
+    // the saved program plays from the first tick, no host needed
+    loadSavedProgram();
+
+    // the LED scheduler, below the USB interrupt
+    setupTimer2();
+    IP_EX |= bIP_USB;
+
+    // configure USB, enables the interrupts
     USBDeviceCfg();
  
     while (1) {
-        if (command == COMMAND_SET_BLINK_SEQUENCE) {
-            //this will block until the sequence is finished
-            playBlinkySequence();
+        if (savedState == SAVED_BUSY) {
+            saveProgram();
         }
-        delayNonBlocking(blinkTime);
-        LED = !LED; 
+        // the LED is driven from the Timer2 interrupt. The CH554 has no idle
+        // mode, and the power down (PD) stops Timer2 with the oscillator, so
+        // it stays with the USB suspend; the loop is free for other work
     }
 }
@@ -1,2 +1,3 @@
-gcc -trigraphs -o usb_blink_pc usb_blink_pc.c -lusb-1.0  -lpthread -lrt 
-
+gcc -trigraphs -c -o usb_blink_lib.o usb_blink_lib.c && gcc -trigraphs -c -o usb_blink_proto.o usb_blink_proto.c && gcc -trigraphs -c -o usb_blink_fake.o usb_blink_fake.c && gcc -trigraphs -c -o usb_blink_seq.o usb_blink_seq.c && ar rcs usb_blink_lib.a usb_blink_lib.o usb_blink_proto.o usb_blink_fake.o usb_blink_seq.o
+gcc -trigraphs -o usb_blink_pc usb_blink_pc.c usb_blink_daemon.c usb_blink_lib.a -lusb-1.0  -lpthread -lrt
+gcc -trigraphs -o usb_blink_bench usb_blink_bench.c usb_blink_lib.a -lusb-1.0  -lpthread -lrt
@@ -0,0 +1,356 @@
+/* usb_blink_bench - control transfer benchmark of the CH55x blink demo
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * Runs the blinky vendor commands back to back from several threads and
+ * reports the round trip latency (p50 / p99 / max and a histogram) and the
+ * transfer rate. Every thread keeps one request in flight, so -c sets the
+ * concurrency. The target is a USB device, or with -sock a daemon socket:
+ * 'usb_blink_pc -daemon' or the simulated device 'usb_blink_sim -serve', or
+ * with -fake the in-process fake device of usb_blink_fake.c.
+ *
+ * Build with:
+ *
+ *      gcc -o usb_blink_bench usb_blink_bench.c usb_blink_lib.a -lusb-1.0  -lpthread -lrt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "usb_blink_lib.h"
+#include "usb_blink_fake.h"
+
+
+#define MAX_THREADS         64
+#define HISTOGRAM_BUCKETS   24      // power of 2 buckets, from 1 us
+#define HISTOGRAM_WIDTH     40
+#define DEFAULT_SEQ_SIZE    32      // one EP0 packet
+
+enum { TEST_READ, TEST_SET, TEST_SEQ, TEST_BATCH, TEST_COUNT };
+
+static const char* testNames[TEST_COUNT] = { "read", "set", "seq", "batch" };
+
+static int count = 1000;
+static int threads = 1;
+static int seqSize = DEFAULT_SEQ_SIZE;
+static int tests = (1 << TEST_COUNT) - 1;
+static const char* sockPath = NULL;
+static const char* fakeSpec = NULL;
+static const char* selector = NULL;
+static uint16_t blinkTime = 250;
+
+typedef struct BenchRun {
+    int test;
+    BlinkyDevice* devs[MAX_THREADS];
+    uint32_t* samples;              // latency in micro seconds
+    volatile int next;              // next sample index
+    volatile int errors;
+    int lastError;
+} BenchRun;
+
+typedef struct BenchThread {
+    BenchRun* run;
+    BlinkyDevice* dev;
+} BenchThread;
+
+
+static void usage(void) {
+    fprintf(stderr,
+    "usage: usb_blink_bench [options]\n"
+    "  -n count : transfers per test (default 1000)\n"
+    "  -c num   : concurrent requests, 1 - %i (default 1)\n"
+    "  -s size  : blink sequence payload in bytes, 1 - %i (default %i)\n"
+    "  -t list  : comma separated tests: read,set,seq,batch (default all)\n"
+    "             batch: set, seq and read in one batch, two transfers\n"
+    "  -sock path : use a daemon socket, like the one of 'usb_blink_pc -daemon'\n"
+    "               or of the simulated device 'usb_blink_sim -serve'\n"
+    "  -fake spec : use the in-process fake device, spec: latency=us,jitter=us,\n"
+    "               fail=n,error=pipe|timeout|io|nodev (\"\" for none); latency=0\n"
+    "               measures the host side alone\n"
+    "  -d dev   : device path (1-2.3) or serial number\n",
+    MAX_THREADS, BLINKY_MAX_DATA, DEFAULT_SEQ_SIZE);
+    exit(1);
+}
+
+static int parseTests(const char* list) {
+    int mask = 0;
+    int i;
+
+    while (*list) {
+        for (i = 0; i < TEST_COUNT; i++) {
+            size_t len = strlen(testNames[i]);
+            if (strncmp(list, testNames[i], len) == 0 && (list[len] == ',' || list[len] == 0)) {
+                mask |= 1 << i;
+                list += len;
+                break;
+            }
+        }
+        if (i == TEST_COUNT) {
+            return 0;
+        }
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return mask;
+}
+
+static void checkArguments(int argc, char** argv) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        if (strcmp("-n", argv[i]) == 0) {
+            count = (int) strtol(argv[++i], NULL, 0);
+        } else
+        if (strcmp("-c", argv[i]) == 0) {
+            threads = (int) strtol(argv[++i], NULL, 0);
+        } else
+        if (strcmp("-s", argv[i]) == 0) {
+            seqSize = (int) strtol(argv[++i], NULL, 0);
+        } else
+        if (strcmp("-t", argv[i]) == 0) {
+            tests = parseTests(argv[++i]);
+        } else
+        if (strcmp("-sock", argv[i]) == 0) {
+            sockPath = argv[++i];
+        } else
+        if (strcmp("-fake", argv[i]) == 0) {
+            fakeSpec = argv[++i];
+        } else
+        if (strcmp("-d", argv[i]) == 0) {
+            selector = argv[++i];
+        } else {
+            usage();
+        }
+    }
+    if (count < 1 || threads < 1 || threads > MAX_THREADS || seqSize < 1
+            || seqSize > BLINKY_MAX_DATA || tests == 0) {
+        usage();
+    }
+}
+
+static uint32_t elapsedUs(const struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static int runRequest(BlinkyDevice* dev, int test) {
+    uint8_t seq[BLINKY_MAX_DATA];
+    BlinkyBatch batch;
+    uint16_t t;
+    int ret;
+    int i;
+
+    // short on / off flashes, terminated when the payload is shorter than the buffer
+    for (i = 0; i < seqSize; i++) {
+        seq[i] = (i & 1) ? 0x01 : 0x11;
+    }
+    switch (test) {
+    case TEST_READ:
+        return blinkyReadBlinkTime(dev, &t);
+    case TEST_SET:
+        // keep the current blink time, so the device looks the same
+        return blinkySetBlinkTime(dev, blinkTime);
+    case TEST_SEQ:
+        return blinkySetSequence(dev, seq, seqSize);
+    default:
+        // the set, seq and read tests in two transfers instead of three
+        blinkyBatchInit(&batch);
+        if ((ret = blinkyBatchSetBlinkTime(&batch, blinkTime)) < 0
+                || (ret = blinkyBatchSetSequence(&batch, seq, seqSize)) < 0
+                || (ret = blinkyBatchReadBlinkTime(&batch, &t)) < 0) {
+            return ret;
+        }
+        return blinkyRunBatch(dev, &batch);
+    }
+}
+
+static void* benchThread(void* arg) {
+    BenchThread* t = (BenchThread*) arg;
+    BenchRun* run = t->run;
+    struct timespec start;
+    int slot;
+    int ret;
+
+    while ((slot = __sync_fetch_and_add(&run->next, 1)) < count) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ret = runRequest(t->dev, run->test);
+        run->samples[slot] = elapsedUs(&start);
+        if (ret) {
+            __sync_fetch_and_add(&run->errors, 1);
+            run->lastError = ret;
+        }
+    }
+    return NULL;
+}
+
+static int compareSamples(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void report(BenchRun* run, uint32_t wallUs) {
+    int histogram[HISTOGRAM_BUCKETS] = { 0 };
+    int maxBucket = 0;
+    int i, b;
+
+    qsort(run->samples, count, sizeof(uint32_t), compareSamples);
+    for (i = 0; i < count; i++) {
+        for (b = 0; b < HISTOGRAM_BUCKETS - 1 && run->samples[i] >= (2u << b); b++) {
+        }
+        histogram[b]++;
+        if (histogram[b] > maxBucket) {
+            maxBucket = histogram[b];
+        }
+    }
+
+    printf("%-4s  %i transfers, %i concurrent: %.1f transfers/s\n", testNames[run->test],
+            count, threads, wallUs ? count * 1000000.0 / wallUs : 0.0);
+    printf("      p50 %.3f ms  p99 %.3f ms  max %.3f ms  errors %i",
+            run->samples[count / 2] / 1000.0, run->samples[(count * 99) / 100] / 1000.0,
+            run->samples[count - 1] / 1000.0, run->errors);
+    if (run->errors) {
+        printf(" (last: %s)", blinkyErrorName(run->lastError));
+    }
+    printf("\n");
+    for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        int bar;
+        if (histogram[b] == 0) {
+            continue;
+        }
+        bar = (histogram[b] * HISTOGRAM_WIDTH + maxBucket - 1) / maxBucket;
+        printf("      %8u us %7i %.*s\n", 1u << b, histogram[b], bar,
+                "########################################");
+    }
+}
+
+static int runTest(BenchRun* run) {
+    pthread_t tid[MAX_THREADS];
+    BenchThread t[MAX_THREADS];
+    struct timespec start;
+    uint32_t wallUs;
+    int i;
+
+    run->next = 0;
+    run->errors = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < threads; i++) {
+        t[i].run = run;
+        // a socket connection is serial, so each thread has its own
+        t[i].dev = sockPath ? run->devs[i] : run->devs[0];
+        if (pthread_create(&tid[i], NULL, benchThread, &t[i])) {
+            fprintf(stderr, "usb_blink_bench: can't start a thread\n");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    wallUs = elapsedUs(&start);
+    report(run, wallUs);
+    return run->errors;
+}
+
+int main(int argc, char** argv) {
+    BlinkyContext* ctx = NULL;
+    BenchRun run;
+    int errors = 0;
+    int ret;
+    int i;
+
+    checkArguments(argc, argv);
+    memset(&run, 0, sizeof(run));
+    run.samples = malloc(count * sizeof(uint32_t));
+    if (run.samples == NULL) {
+        return 1;
+    }
+
+    if (fakeSpec) {
+        BlinkyFakeConfig config;
+        if (blinkyParseFakeConfig(fakeSpec, &config) || blinkyOpenFake(&config, &run.devs[0])) {
+            fprintf(stderr, "usb_blink_bench: invalid fake device: %s\n", fakeSpec);
+            return 1;
+        }
+    } else if (sockPath) {
+        for (i = 0; i < threads; i++) {
+            ret = blinkyOpenDaemon(sockPath, &run.devs[i]);
+            if (ret) {
+                fprintf(stderr, "usb_blink_bench: can't connect to %s\n", sockPath);
+                return 1;
+            }
+        }
+    } else {
+        ret = blinkyInit(&ctx, BLINKY_EVENT_THREAD);
+        if (ret == 0) {
+            if (selector) {
+                ret = blinkyOpenSelected(ctx, selector, run.devs, 1);
+                ret = (ret == 1) ? 0 : (ret < 0 ? ret : LIBUSB_ERROR_NOT_FOUND);
+            } else {
+                ret = blinkyOpen(ctx, &run.devs[0]);
+            }
+        }
+        if (ret) {
+            fprintf(stderr, "usb_blink_bench: can't open the device: %s\n", blinkyErrorName(ret));
+            return 1;
+        }
+        blinkySetMaxInFlight(run.devs[0], threads);
+    }
+
+    ret = blinkyReadBlinkTime(run.devs[0], &blinkTime);
+    if (ret) {
+        fprintf(stderr, "usb_blink_bench: device does not respond: %s\n", blinkyErrorName(ret));
+        return 1;
+    }
+
+    for (i = 0; i < TEST_COUNT; i++) {
+        if (tests & (1 << i)) {
+            run.test = i;
+            errors += runTest(&run);
+        }
+    }
+
+    // the sequence and batch tests replaced the blinking, restore it
+    if (tests & ((1 << TEST_SEQ) | (1 << TEST_BATCH))) {
+        blinkySetBlinkTime(run.devs[0], blinkTime);
+    }
+    for (i = 0; i < MAX_THREADS; i++) {
+        if (run.devs[i]) {
+            blinkyClose(run.devs[i]);
+        }
+    }
+    if (ctx) {
+        blinkyExit(ctx);
+    }
+    free(run.samples);
+    return errors ? 2 : 0;
+}
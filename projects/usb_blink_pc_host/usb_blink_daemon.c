@@ -0,0 +1,271 @@
+/* usb_blink_daemon - serves blinky commands from local clients
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "usb_blink_daemon.h"
+
+
+#define MAX_CLIENTS     64
+#define MAX_USB_FDS     16
+
+typedef struct DaemonClient {
+    int fd;             // -1 after the client disconnected
+    int pending;        // submitted requests without a response
+    int rxLen;
+    uint8_t rx[BLINKY_DAEMON_REQ_SIZE + BLINKY_MAX_DATA];
+} DaemonClient;
+
+static DaemonClient* clients[MAX_CLIENTS];
+static volatile sig_atomic_t stopDaemon;
+static int daemonVerbose;
+
+
+static void onSignal(int sig) {
+    (void) sig;
+    stopDaemon = 1;
+}
+
+static void freeClient(DaemonClient* c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    // outstanding requests still point to the client
+    if (c->pending == 0) {
+        free(c);
+    }
+}
+
+static void sendResponse(DaemonClient* c, int result, const uint8_t* data, uint16_t len) {
+    uint8_t buf[BLINKY_DAEMON_RES_SIZE + BLINKY_MAX_DATA];
+
+    if (c->fd < 0) {
+        return;
+    }
+    buf[0] = result & 0xFF;
+    buf[1] = (result >> 8) & 0xFF;
+    buf[2] = len & 0xFF;
+    buf[3] = len >> 8;
+    if (len) {
+        memcpy(buf + BLINKY_DAEMON_RES_SIZE, data, len);
+    }
+    // responses are tiny, a blocking send won't stall the loop for long.
+    // On error the poll loop sees the hang up and drops the client.
+    if (send(c->fd, buf, BLINKY_DAEMON_RES_SIZE + len, MSG_NOSIGNAL) < 0) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+static void requestDone(BlinkyRequest* r, void* userData) {
+    DaemonClient* c = (DaemonClient*) userData;
+    uint16_t len = 0;
+
+    if (r->result > 0 && (r->requestType & LIBUSB_ENDPOINT_IN)) {
+        len = r->result;
+    }
+    sendResponse(c, r->result, r->data, len);
+    c->pending--;
+    if (c->fd < 0 && c->pending == 0) {
+        free(c);
+    }
+}
+
+// submit all complete requests from the client receive buffer
+static int processClient(BlinkyDevice* dev, DaemonClient* c) {
+    uint8_t* hdr = c->rx;
+    uint16_t value, index, length;
+    int size;
+    int ret;
+
+    while (c->rxLen >= BLINKY_DAEMON_REQ_SIZE) {
+        value = hdr[2] | (hdr[3] << 8);
+        index = hdr[4] | (hdr[5] << 8);
+        length = hdr[6] | (hdr[7] << 8);
+        if (length > BLINKY_MAX_DATA) {
+            // can't resynchronise the stream
+            sendResponse(c, LIBUSB_ERROR_INVALID_PARAM, NULL, 0);
+            return -1;
+        }
+        size = BLINKY_DAEMON_REQ_SIZE;
+        if (!(hdr[0] & LIBUSB_ENDPOINT_IN)) {
+            size += length;
+        }
+        if (c->rxLen < size) {
+            break;
+        }
+
+        c->pending++;
+        ret = blinkySubmit(dev, hdr[0], hdr[1], value, index,
+                hdr + BLINKY_DAEMON_REQ_SIZE, length, requestDone, c);
+        if (ret) {
+            c->pending--;
+            sendResponse(c, ret, NULL, 0);
+        }
+        c->rxLen -= size;
+        memmove(c->rx, c->rx + size, c->rxLen);
+    }
+    return 0;
+}
+
+static int openSocket(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void acceptClient(int listenFd) {
+    DaemonClient* c;
+    int fd;
+    int i;
+
+    fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] == NULL) {
+            break;
+        }
+    }
+    c = (i < MAX_CLIENTS) ? calloc(1, sizeof(DaemonClient)) : NULL;
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    clients[i] = c;
+    if (daemonVerbose) {
+        fprintf(stderr, "usb_blink_pc: info: client %i connected\n", i);
+    }
+}
+
+int runDaemon(BlinkyContext* ctx, BlinkyDevice* dev, const char* path, int verbose) {
+    struct pollfd fds[1 + MAX_CLIENTS + MAX_USB_FDS];
+    int clientSlot[1 + MAX_CLIENTS];
+    int listenFd;
+    int nfds, usbFds;
+    int timeout;
+    int i, ret;
+
+    daemonVerbose = verbose;
+    listenFd = openSocket(path);
+    if (listenFd < 0) {
+        return -1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stopDaemon) {
+        nfds = 0;
+        fds[nfds].fd = listenFd;
+        fds[nfds++].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i] && clients[i]->fd >= 0) {
+                clientSlot[nfds] = i;
+                fds[nfds].fd = clients[i]->fd;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+        usbFds = blinkyGetPollFds(ctx, fds + nfds, MAX_USB_FDS);
+        if (usbFds < 0) {
+            usbFds = 0;
+        }
+        if (blinkyGetNextTimeout(ctx, &timeout) || timeout < 0 || timeout > 1000) {
+            timeout = 1000;
+        }
+
+        ret = poll(fds, nfds + usbFds, timeout);
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+        // completes the transfers and calls requestDone()
+        blinkyHandleEvents(ctx, 0);
+        if (ret <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            acceptClient(listenFd);
+        }
+        for (i = 1; i < nfds; i++) {
+            DaemonClient* c = clients[clientSlot[i]];
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) || c->fd < 0) {
+                continue;
+            }
+            ret = recv(c->fd, c->rx + c->rxLen, sizeof(c->rx) - c->rxLen, 0);
+            if (ret > 0) {
+                c->rxLen += ret;
+                ret = processClient(dev, c);
+            } else if (ret < 0 && errno == EINTR) {
+                continue;
+            } else {
+                ret = -1;
+            }
+            if (ret < 0) {
+                if (daemonVerbose) {
+                    fprintf(stderr, "usb_blink_pc: info: client %i disconnected\n", clientSlot[i]);
+                }
+                clients[clientSlot[i]] = NULL;
+                freeClient(c);
+            }
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i]) {
+            freeClient(clients[i]);
+            clients[i] = NULL;
+        }
+    }
+    close(listenFd);
+    unlink(path);
+    return 0;
+}
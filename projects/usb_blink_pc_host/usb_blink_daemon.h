@@ -0,0 +1,39 @@
+/* usb_blink_daemon - serves blinky commands from local clients
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The daemon keeps the device open and forwards the requests of the clients
+ * connected to a Unix domain socket (protocol: see usb_blink_lib.h). It runs
+ * a single poll loop over the socket, the clients and the libusb descriptors,
+ * so requests of several clients are kept in flight together.
+ */
+
+#ifndef USB_BLINK_DAEMON_H
+#define USB_BLINK_DAEMON_H
+
+#include "usb_blink_lib.h"
+
+// runs until SIGINT / SIGTERM, returns 0 or -1 when the socket can't be set up
+int runDaemon(BlinkyContext* ctx, BlinkyDevice* dev, const char* path, int verbose);
+
+#endif /* USB_BLINK_DAEMON_H */
@@ -0,0 +1,510 @@
+/* usb_blink_fake - in-process model of the blinky device
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The model follows the firmware (usb_blink/src/main.c) at the level of the
+ * vendor requests: the checks of the dispatch table, the blink time, the
+ * sequence load (not played, a complete program just sets the 100 ms blink
+ * time), the frame stream played along the wall clock, the batch, the USB
+ * statistics of SETUP / STALLs / unknown requests and a trace of the SETUPs.
+ * After COMMAND_JUMP_TO_BOOTLOADER the device is gone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "usb_blink_fake.h"
+
+
+#define FAKE_STREAM_FRAMES      BLINKY_STREAM_FRAMES
+#define FAKE_TRACE_RECORDS      32
+#define FAKE_STATS_COUNTERS     (COMMAND_READ_STATS_SIZE / 2)
+#define FAKE_STATS_SETUP        0
+#define FAKE_STATS_STALLS       11
+#define FAKE_STATS_VENDOR_UNSUPPORTED 14
+#define FAKE_LOAD_WINDOW_MS     1000
+
+typedef struct BlinkyFake {
+    BlinkyFakeConfig config;
+    unsigned int requests;
+    int gone;                   // jumped to the bootloader
+    struct timespec boot;
+
+    uint16_t blinkTime;
+    uint8_t command;            // COMMAND_SET_BLINK_SEQUENCE / START_STREAM or 0
+    uint8_t program[BLINKY_SEQ_PROGRAM_SIZE];
+    uint8_t programLoaded;      // a complete program arrived, it can be saved
+
+    uint8_t streamRing[FAKE_STREAM_FRAMES][BLINKY_STREAM_FRAME_SIZE];
+    uint8_t streamHead;
+    uint8_t streamTail;
+    int streamStarved;
+    uint64_t streamNextUs;      // the next frame is taken
+    BlinkyStreamStatus stream;
+
+    uint16_t stats[FAKE_STATS_COUNTERS];
+    BlinkyTraceRecord trace[FAKE_TRACE_RECORDS];
+    uint8_t traceHead;
+    uint8_t traceTail;
+    uint8_t traceLost;
+
+    uint8_t batchResult[BLINKY_BATCH_RESULT_SIZE];
+    int batchResultLen;
+
+    BlinkySaved saved;          // written at once, never busy
+} BlinkyFake;
+
+
+void blinkyFakeDefaults(BlinkyFakeConfig* config) {
+    memset(config, 0, sizeof(*config));
+    config->failError = LIBUSB_ERROR_PIPE;
+    config->seed = 1;
+}
+
+int blinkyParseFakeConfig(const char* spec, BlinkyFakeConfig* config) {
+    static const struct { const char* name; int error; } errors[] = {
+        { "pipe", LIBUSB_ERROR_PIPE },
+        { "timeout", LIBUSB_ERROR_TIMEOUT },
+        { "io", LIBUSB_ERROR_IO },
+        { "nodev", LIBUSB_ERROR_NO_DEVICE },
+    };
+    char key[16];
+    char value[16];
+    unsigned int i;
+    int n;
+
+    blinkyFakeDefaults(config);
+    while (*spec) {
+        if (sscanf(spec, "%15[a-z]=%15[a-z0-9]%n", key, value, &n) != 2) {
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+        spec += n;
+        if (*spec == ',') {
+            spec++;
+        }
+        if (strcmp(key, "error") == 0) {
+            for (i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+                if (strcmp(value, errors[i].name) == 0) {
+                    config->failError = errors[i].error;
+                    break;
+                }
+            }
+            if (i == sizeof(errors) / sizeof(errors[0])) {
+                return LIBUSB_ERROR_INVALID_PARAM;
+            }
+        } else if (strcmp(key, "latency") == 0) {
+            config->latencyUs = strtoul(value, NULL, 0);
+        } else if (strcmp(key, "jitter") == 0) {
+            config->jitterUs = strtoul(value, NULL, 0);
+        } else if (strcmp(key, "fail") == 0) {
+            config->failEvery = strtoul(value, NULL, 0);
+        } else if (strcmp(key, "seed") == 0) {
+            config->seed = strtoul(value, NULL, 0);
+        } else {
+            return LIBUSB_ERROR_INVALID_PARAM;
+        }
+    }
+    return 0;
+}
+
+static uint64_t fakeNowUs(BlinkyFake* f) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - f->boot.tv_sec) * 1000000ULL + (now.tv_nsec - f->boot.tv_nsec) / 1000;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+// the bus time of a request and the injected faults, returns 0 or the error
+static int fakeBus(BlinkyFake* f, unsigned int timeoutMs) {
+    unsigned int us = f->config.latencyUs;
+
+    if (f->config.jitterUs) {
+        us += rand_r(&f->config.seed) % (f->config.jitterUs + 1);
+    }
+    if (us) {
+        usleep(us);
+    }
+    if (f->gone) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    f->requests++;
+    if (f->config.failEvery && f->requests % f->config.failEvery == 0) {
+        if (f->config.failError == LIBUSB_ERROR_TIMEOUT) {
+            usleep(timeoutMs * 1000);
+        }
+        return f->config.failError;
+    }
+    return 0;
+}
+
+static void fakeTrace(BlinkyFake* f, uint8_t type, uint8_t arg) {
+    BlinkyTraceRecord* r;
+
+    if ((uint8_t)(f->traceHead - f->traceTail) == FAKE_TRACE_RECORDS) {
+        if (f->traceLost < 0xFF) {
+            f->traceLost++;
+        }
+        return;
+    }
+    r = &f->trace[f->traceHead++ % FAKE_TRACE_RECORDS];
+    r->type = type;
+    r->arg = arg;
+    r->time = fakeNowUs(f) / BLINKY_TRACE_TICK_US;
+}
+
+// takes the frames that started playing until now off the ring
+static void fakePlayStream(BlinkyFake* f) {
+    uint64_t now = fakeNowUs(f);
+    uint8_t* frame;
+
+    while (f->command == COMMAND_START_STREAM && f->streamNextUs <= now) {
+        if (f->streamHead == f->streamTail) {
+            if (!f->streamStarved) {
+                f->streamStarved = 1;
+                f->stream.underruns++;
+            }
+            f->streamNextUs = now;
+            return;
+        }
+        frame = f->streamRing[f->streamTail++ % FAKE_STREAM_FRAMES];
+        f->stream.played++;
+        f->streamStarved = 0;
+        f->streamNextUs += (frame[0] | (frame[1] << 8)) * 1000;
+    }
+}
+
+static void fakeSetBlinkTime(BlinkyFake* f, uint16_t ms) {
+    f->blinkTime = ms;
+    f->command = 0;
+}
+
+static void fakeStartStream(BlinkyFake* f) {
+    f->streamHead = f->streamTail = 0;
+    f->streamStarved = 1;
+    f->streamNextUs = fakeNowUs(f);
+    memset(&f->stream, 0, sizeof(f->stream));
+    f->command = COMMAND_START_STREAM;
+}
+
+static void fakeReadStreamStatus(BlinkyFake* f, uint8_t* dst) {
+    fakePlayStream(f);
+    put16(dst, FAKE_STREAM_FRAMES - (uint8_t)(f->streamHead - f->streamTail));
+    put16(dst + 2, f->stream.played);
+    put16(dst + 4, f->stream.underruns);
+    put16(dst + 6, f->stream.overruns);
+}
+
+// the chunk at address 0 completes the program
+static void fakeLoadSequence(BlinkyFake* f, uint16_t addr, const uint8_t* data, uint16_t len) {
+    memcpy(f->program + addr, data, len);
+    if (addr == 0) {
+        f->programLoaded = 1;
+        f->blinkTime = 100;
+        f->command = COMMAND_SET_BLINK_SEQUENCE;
+    }
+}
+
+static void fakeBatch(BlinkyFake* f, const uint8_t* p, uint16_t len) {
+    const uint8_t* end = p + len;
+    uint8_t* result = f->batchResult;
+    uint16_t arg;
+    uint8_t error = BLINKY_BATCH_ERROR_NONE;
+    int size;
+
+    result[0] = 0;
+    f->batchResultLen = BLINKY_BATCH_HEADER_SIZE;
+    while (p < end && error == BLINKY_BATCH_ERROR_NONE) {
+        switch (*p) {
+        case COMMAND_SET_BLINK_TIME: size = 3; break;
+        case COMMAND_SET_BLINK_SEQUENCE: size = 4; break;
+        case COMMAND_TOGGLE_BLINK:
+        case COMMAND_START_STREAM:
+        case COMMAND_READ_BLINK_TIME:
+        case COMMAND_READ_STREAM_STATUS: size = 1; break;
+        default: size = 0; break;
+        }
+        if (size == 0) {
+            error = BLINKY_BATCH_ERROR_CODE;
+            break;
+        }
+        if (end - p < size || (*p == COMMAND_SET_BLINK_SEQUENCE && end - p < size + p[3])) {
+            error = BLINKY_BATCH_ERROR_SHORT;
+            break;
+        }
+        arg = p[1] | (p[2] << 8);
+        switch (*p) {
+        case COMMAND_SET_BLINK_TIME:
+            fakeSetBlinkTime(f, arg);
+            break;
+        case COMMAND_TOGGLE_BLINK:
+            fakeSetBlinkTime(f, f->blinkTime == 250 ? 100 : 250);
+            break;
+        case COMMAND_START_STREAM:
+            fakeStartStream(f);
+            break;
+        case COMMAND_SET_BLINK_SEQUENCE:
+            if (p[3] == 0 || arg > BLINKY_SEQ_PROGRAM_SIZE - p[3]) {
+                error = BLINKY_BATCH_ERROR_RANGE;
+                break;
+            }
+            fakeLoadSequence(f, arg, p + 4, p[3]);
+            size += p[3];
+            break;
+        case COMMAND_READ_BLINK_TIME:
+            if (f->batchResultLen + COMMAND_READ_BLINK_TIME_SIZE > BLINKY_BATCH_RESULT_SIZE) {
+                error = BLINKY_BATCH_ERROR_FULL;
+                break;
+            }
+            put16(result + f->batchResultLen, f->blinkTime);
+            f->batchResultLen += COMMAND_READ_BLINK_TIME_SIZE;
+            break;
+        case COMMAND_READ_STREAM_STATUS:
+            if (f->batchResultLen + COMMAND_READ_STREAM_STATUS_SIZE > BLINKY_BATCH_RESULT_SIZE) {
+                error = BLINKY_BATCH_ERROR_FULL;
+                break;
+            }
+            fakeReadStreamStatus(f, result + f->batchResultLen);
+            f->batchResultLen += COMMAND_READ_STREAM_STATUS_SIZE;
+            break;
+        }
+        if (error == BLINKY_BATCH_ERROR_NONE) {
+            result[0]++;
+            p += size;
+        }
+    }
+    result[1] = error;
+}
+
+// a vendor request, returns the reply length or negative libusb error
+static int fakeRequest(BlinkyFake* f, uint8_t requestType, uint8_t command, uint16_t value,
+        uint16_t index, uint8_t* buf, uint16_t len) {
+    int in = (requestType & LIBUSB_ENDPOINT_IN) != 0;
+    uint8_t reply[COMMAND_READ_STATS_SIZE];
+    BlinkyTraceRecord* r;
+    int n = 0;
+    int i;
+
+    switch (command) {
+    case COMMAND_READ_BLINK_TIME:
+        put16(reply, f->blinkTime);
+        n = COMMAND_READ_BLINK_TIME_SIZE;
+        break;
+    case COMMAND_TOGGLE_BLINK:
+        fakeSetBlinkTime(f, f->blinkTime == 250 ? 100 : 250);
+        break;
+    case COMMAND_SET_BLINK_TIME:
+        fakeSetBlinkTime(f, value);
+        break;
+    case COMMAND_SET_BLINK_SEQUENCE:
+        if (value > BLINKY_SEQ_VERSION || index > BLINKY_SEQ_PROGRAM_SIZE
+                || len > BLINKY_SEQ_PROGRAM_SIZE - index) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        fakeLoadSequence(f, index, buf, len);
+        break;
+    case COMMAND_START_STREAM:
+        fakeStartStream(f);
+        break;
+    case COMMAND_READ_STREAM_STATUS:
+        fakeReadStreamStatus(f, reply);
+        n = COMMAND_READ_STREAM_STATUS_SIZE;
+        break;
+    case COMMAND_READ_STATS:
+        for (i = 0; i < FAKE_STATS_COUNTERS; i++) {
+            put16(reply + i * 2, f->stats[i]);
+        }
+        n = COMMAND_READ_STATS_SIZE;
+        break;
+    case COMMAND_READ_TRACE:
+        // the header and the records that fit wLength, oldest first
+        put16(reply, fakeNowUs(f) / BLINKY_TRACE_TICK_US);
+        reply[2] = f->traceLost;
+        reply[3] = 0;
+        f->traceLost = 0;
+        n = BLINKY_TRACE_HEADER_SIZE;
+        for (i = 0; i < BLINKY_TRACE_PER_READ && f->traceTail != f->traceHead
+                && n + BLINKY_TRACE_RECORD_SIZE <= len; i++) {
+            r = &f->trace[f->traceTail++ % FAKE_TRACE_RECORDS];
+            reply[n] = r->type;
+            reply[n + 1] = r->arg;
+            put16(reply + n + 2, r->time);
+            n += BLINKY_TRACE_RECORD_SIZE;
+        }
+        break;
+    case COMMAND_BATCH:
+        if (value > BLINKY_SEQ_VERSION) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        fakeBatch(f, buf, len);
+        break;
+    case COMMAND_READ_BATCH:
+        memcpy(reply, f->batchResult, f->batchResultLen);
+        n = f->batchResultLen;
+        break;
+    case COMMAND_READ_LOAD:
+        // an idle device: only the Timer2 interrupts, too short to count
+        put16(reply, 0);
+        put16(reply + 2, 0);
+        put16(reply + 4, FAKE_LOAD_WINDOW_MS);
+        put16(reply + 6, FAKE_LOAD_WINDOW_MS);
+        n = COMMAND_READ_LOAD_SIZE;
+        break;
+    case COMMAND_SAVE_SEQUENCE:
+        if (value > BLINKY_SAVE_PROGRAM_MAX || (value && !f->programLoaded)) {
+            return LIBUSB_ERROR_PIPE;
+        }
+        f->saved.state = value ? BLINKY_SAVED_VALID : BLINKY_SAVED_NONE;
+        f->saved.length = value;
+        f->saved.crc = value ? blinkyCrc16(f->program, value) : 0;
+        break;
+    case COMMAND_READ_SAVED:
+        reply[0] = f->saved.state;
+        reply[1] = f->saved.length;
+        put16(reply + 2, f->saved.crc);
+        n = COMMAND_READ_SAVED_SIZE;
+        break;
+    case COMMAND_JUMP_TO_BOOTLOADER:
+        f->gone = 1;
+        break;
+    }
+    if (in) {
+        n = n < len ? n : len;
+        memcpy(buf, reply, n);
+        return n;
+    }
+    return len;
+}
+
+// the dispatch table checks of the firmware, then the request
+static int fakeControl(void* data, uint8_t requestType, uint8_t command, uint16_t value,
+        uint16_t index, uint8_t* buf, uint16_t len, unsigned int timeoutMs) {
+    static const struct { uint8_t command; uint8_t in; uint16_t maxOut; } table[] = {
+        { COMMAND_READ_BLINK_TIME, 1, 0 },
+        { COMMAND_TOGGLE_BLINK, 0, 0 },
+        { COMMAND_SET_BLINK_TIME, 0, 0 },
+        { COMMAND_SET_BLINK_SEQUENCE, 0, COMMAND_SET_BLINK_SEQUENCE_MAX },
+        { COMMAND_START_STREAM, 0, 0 },
+        { COMMAND_READ_STREAM_STATUS, 1, 0 },
+        { COMMAND_READ_STATS, 1, 0 },
+        { COMMAND_READ_TRACE, 1, 0 },
+        { COMMAND_BATCH, 0, COMMAND_BATCH_MAX },
+        { COMMAND_READ_BATCH, 1, 0 },
+        { COMMAND_READ_LOAD, 1, 0 },
+        { COMMAND_SAVE_SEQUENCE, 0, 0 },
+        { COMMAND_READ_SAVED, 1, 0 },
+        { COMMAND_JUMP_TO_BOOTLOADER, 0, 0 },
+    };
+    BlinkyFake* f = data;
+    int in = (requestType & LIBUSB_ENDPOINT_IN) != 0;
+    unsigned int i;
+    int ret;
+
+    ret = fakeBus(f, timeoutMs);
+    if (ret) {
+        return ret;
+    }
+    f->stats[FAKE_STATS_SETUP]++;
+    fakeTrace(f, BLINKY_TRACE_SETUP, command);
+    for (i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        if (table[i].command == command) {
+            break;
+        }
+    }
+    if (i == sizeof(table) / sizeof(table[0])) {
+        f->stats[FAKE_STATS_VENDOR_UNSUPPORTED]++;
+        ret = LIBUSB_ERROR_PIPE;
+    } else if (table[i].in != in || (!in && len > table[i].maxOut)) {
+        ret = LIBUSB_ERROR_PIPE;
+    } else {
+        ret = fakeRequest(f, requestType, command, value, index, buf, len);
+    }
+    if (ret == LIBUSB_ERROR_PIPE) {
+        f->stats[FAKE_STATS_STALLS]++;
+    }
+    return ret;
+}
+
+// stream frames on the bulk endpoint, dropped and counted without a credit
+static int fakeWriteStream(void* data, const uint8_t* frames, int len, unsigned int timeoutMs) {
+    BlinkyFake* f = data;
+    int ret;
+
+    ret = fakeBus(f, timeoutMs);
+    if (ret) {
+        return ret;
+    }
+    fakePlayStream(f);
+    if (f->command != COMMAND_START_STREAM) {
+        return 0;
+    }
+    for (; len >= BLINKY_STREAM_FRAME_SIZE; len -= BLINKY_STREAM_FRAME_SIZE) {
+        if ((uint8_t)(f->streamHead - f->streamTail) == FAKE_STREAM_FRAMES) {
+            f->stream.overruns++;
+        } else {
+            memcpy(f->streamRing[f->streamHead++ % FAKE_STREAM_FRAMES], frames,
+                    BLINKY_STREAM_FRAME_SIZE);
+        }
+        frames += BLINKY_STREAM_FRAME_SIZE;
+    }
+    return 0;
+}
+
+static void fakeClose(void* data) {
+    free(data);
+}
+
+static const BlinkyTransport fakeTransport = {
+    "fake",
+    fakeControl,
+    fakeWriteStream,
+    fakeClose
+};
+
+int blinkyOpenFake(const BlinkyFakeConfig* config, BlinkyDevice** dev) {
+    BlinkyFake* f = calloc(1, sizeof(BlinkyFake));
+    int ret;
+
+    if (f == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    if (config) {
+        f->config = *config;
+    } else {
+        blinkyFakeDefaults(&f->config);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &f->boot);
+    f->blinkTime = 250;
+    ret = blinkyOpenTransport(&fakeTransport, f, dev);
+    if (ret) {
+        free(f);
+    }
+    return ret;
+}
@@ -0,0 +1,53 @@
+/* usb_blink_fake - in-process model of the blinky device
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * A BlinkyTransport that answers the vendor requests like the firmware does,
+ * without a CH55x: host code, benchmarks and regression tests run on any
+ * machine, and the host overhead can be measured apart from the bus time.
+ * The latency and the faults are configurable.
+ */
+
+#ifndef USB_BLINK_FAKE_H
+#define USB_BLINK_FAKE_H
+
+#include "usb_blink_lib.h"
+
+typedef struct BlinkyFakeConfig {
+    unsigned int latencyUs;     // added to every request, models the bus time
+    unsigned int jitterUs;      // random extra latency of 0 - jitterUs
+    unsigned int failEvery;     // every n-th request fails, 0: none
+    int failError;              // libusb error of the failed requests, a
+                                // timeout also waits for the device timeout
+    unsigned int seed;          // of the jitter
+} BlinkyFakeConfig;
+
+// latency 0, no jitter and no faults
+void blinkyFakeDefaults(BlinkyFakeConfig* config);
+// parses a comma separated list into config: latency=us, jitter=us, fail=n,
+// error=pipe|timeout|io|nodev, seed=n. Returns 0 or LIBUSB_ERROR_INVALID_PARAM.
+int blinkyParseFakeConfig(const char* spec, BlinkyFakeConfig* config);
+// a freshly booted fake device, closed with blinkyClose()
+int blinkyOpenFake(const BlinkyFakeConfig* config, BlinkyDevice** dev);
+
+#endif /* USB_BLINK_FAKE_H */
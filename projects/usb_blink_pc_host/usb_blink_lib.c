@@ -0,0 +1,1180 @@
+/* usb_blink_lib - host library for the CH55x blink demo
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * USB lib API reference:
+ *     http://libusb.sourceforge.net/api-1.0
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "usb_blink_lib.h"
+
+
+struct BlinkyContext {
+    libusb_context* usb;
+    int flags;
+    pthread_t eventThread;
+    volatile int stopEvents;
+};
+
+struct BlinkyDevice {
+    BlinkyContext* ctx;
+    libusb_device_handle* handle;
+    const BlinkyTransport* transport;   // NULL for the USB device
+    void* transportData;
+    BlinkyDeviceInfo info;
+    BlinkyOpenTiming timing;
+    unsigned int timeout;
+    int maxInFlight;
+
+    pthread_mutex_t lock;       // guards the fields below
+    int inFlight;               // requests submitted to libusb
+    BlinkyRequest* pendingHead; // requests waiting for a free slot
+    BlinkyRequest* pendingTail;
+    BlinkyEventCallback eventCallback;  // NULL stops the event transfer
+    void* eventUserData;
+
+    struct libusb_transfer* eventTransfer;
+    volatile int eventActive;   // the event transfer is submitted
+    uint8_t eventBuffer[BLINKY_EVENT_PACKET_SIZE];
+};
+
+
+static void blinkyInfo(BlinkyContext* ctx, const char* f, ...) {
+    va_list ap;
+    if (!(ctx->flags & BLINKY_VERBOSE)) {
+        return;
+    }
+    va_start(ap, f);
+    fprintf(stderr, "usb_blink: info: ");
+    vfprintf(stderr, f, ap);
+    va_end(ap);
+}
+
+static void* eventThread(void* arg) {
+    BlinkyContext* ctx = (BlinkyContext*) arg;
+    struct timeval tv;
+
+    while (!ctx->stopEvents) {
+        // wake up regularly to notice the stop request
+        tv.tv_sec = 0;
+        tv.tv_usec = 100 * 1000;
+        libusb_handle_events_timeout_completed(ctx->usb, &tv, (int*) &ctx->stopEvents);
+    }
+    return NULL;
+}
+
+int blinkyInit(BlinkyContext** ctx, int flags) {
+    BlinkyContext* c;
+    int ret;
+
+    c = calloc(1, sizeof(BlinkyContext));
+    if (c == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    c->flags = flags;
+
+    ret = libusb_init(&c->usb);
+    if (ret) {
+        free(c);
+        return ret;
+    }
+
+    if (flags & BLINKY_EVENT_THREAD) {
+        if (pthread_create(&c->eventThread, NULL, eventThread, c)) {
+            libusb_exit(c->usb);
+            free(c);
+            return LIBUSB_ERROR_OTHER;
+        }
+    }
+    *ctx = c;
+    return 0;
+}
+
+void blinkyExit(BlinkyContext* ctx) {
+    if (ctx->flags & BLINKY_EVENT_THREAD) {
+        ctx->stopEvents = 1;
+        pthread_join(ctx->eventThread, NULL);
+    }
+    libusb_exit(ctx->usb);
+    free(ctx);
+}
+
+void blinkySetDebug(BlinkyContext* ctx, int level) {
+    libusb_set_debug(ctx->usb, level);
+}
+
+libusb_context* blinkyGetUsbContext(BlinkyContext* ctx) {
+    return ctx->usb;
+}
+
+int blinkyHandleEvents(BlinkyContext* ctx, int timeoutMs) {
+    struct timeval tv;
+
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    return libusb_handle_events_timeout(ctx->usb, &tv);
+}
+
+int blinkyGetPollFds(BlinkyContext* ctx, struct pollfd* fds, int maxFds) {
+    const struct libusb_pollfd** list;
+    int i;
+
+    list = libusb_get_pollfds(ctx->usb);
+    if (list == NULL) {
+        return LIBUSB_ERROR_NOT_SUPPORTED;
+    }
+    for (i = 0; list[i] != NULL && i < maxFds; i++) {
+        fds[i].fd = list[i]->fd;
+        fds[i].events = list[i]->events;
+        fds[i].revents = 0;
+    }
+    libusb_free_pollfds(list);
+    return i;
+}
+
+int blinkyGetNextTimeout(BlinkyContext* ctx, int* timeoutMs) {
+    struct timeval tv;
+    int ret;
+
+    ret = libusb_get_next_timeout(ctx->usb, &tv);
+    if (ret == 1) {
+        *timeoutMs = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    } else if (ret == 0) {
+        *timeoutMs = -1; // no pending timeout
+    }
+    return ret < 0 ? ret : 0;
+}
+
+
+// "bus-port.port..." - the same notation as the sysfs device names
+static void getDevicePath(libusb_device* dev, char* path, int size) {
+    uint8_t ports[7];
+    int len;
+    int n;
+    int i;
+
+    len = snprintf(path, size, "%i", libusb_get_bus_number(dev));
+    n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    for (i = 0; i < n && len < size; i++) {
+        len += snprintf(path + len, size - len, "%c%i", i ? '.' : '-', ports[i]);
+    }
+}
+
+// check whether the device is listed in the comma separated selector
+static int isSelected(const char* selector, const BlinkyDeviceInfo* info) {
+    const char* s = selector;
+    const char* e;
+    size_t len;
+
+    if (selector == NULL || strcmp(selector, "all") == 0) {
+        return 1;
+    }
+    while (*s) {
+        e = strchr(s, ',');
+        len = e ? (size_t)(e - s) : strlen(s);
+        if ((len == strlen(info->path) && !strncmp(s, info->path, len)) ||
+            (info->serial[0] && len == strlen(info->serial) && !strncmp(s, info->serial, len))) {
+            return 1;
+        }
+        s += len;
+        if (*s == ',') {
+            s++;
+        }
+    }
+    return 0;
+}
+
+static double elapsedMs(struct timespec* since) {
+    struct timespec now;
+    double ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+    *since = now;
+    return ms;
+}
+
+// prepare the opened device for the vendor transfers. Only the steps that
+// change the device state are done - an already configured device costs no
+// control transfer at all.
+static int setupDevice(BlinkyContext* ctx, libusb_device_handle* h, BlinkyOpenTiming* timing) {
+    struct timespec t;
+    int config = 0;
+    int ret;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    //try to detach existing kernel driver if kernel is already handling
+    //the device
+    if (libusb_kernel_driver_active(h, 0) == 1) {
+        blinkyInfo(ctx, "kernel driver active\n");
+        if (!libusb_detach_kernel_driver(h, 0)) {
+            blinkyInfo(ctx, "driver detached\n");
+        }
+    }
+    timing->driverMs = elapsedMs(&t);
+
+    //set the first configuration -> initialize USB device, unless the
+    //device is already configured
+    if (libusb_get_configuration(h, &config) || config != 1) {
+        ret = libusb_set_configuration(h, 1);
+        if (ret) {
+            return ret;
+        }
+        // wait until the device reports the configuration (instead of a
+        // fixed delay), give up after ~20 ms
+        for (i = 0; i < 20; i++) {
+            if (!libusb_get_configuration(h, &config) && config == 1) {
+                break;
+            }
+            usleep(1000);
+        }
+        blinkyInfo(ctx, "device configuration set\n");
+    } else {
+        blinkyInfo(ctx, "device already configured\n");
+    }
+    timing->configMs = elapsedMs(&t);
+
+    //get the first interface of the USB configuration. The interface has
+    //a single alternate setting, which is active after the claim.
+    ret = libusb_claim_interface(h, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    blinkyInfo(ctx, "interface claimed\n");
+    timing->claimMs = elapsedMs(&t);
+    return 0;
+}
+
+int blinkyOpenSelected(BlinkyContext* ctx, const char* selector, BlinkyDevice** devs, int maxDevs) {
+    libusb_device** dev_list = NULL;
+    struct libusb_device_descriptor des;
+    libusb_device_handle* h;
+    BlinkyDeviceInfo info;
+    BlinkyOpenTiming timing;
+    struct timespec t;
+    BlinkyDevice* d;
+    int count = 0;
+    int max;
+    int ret;
+    int i;
+
+    memset(&timing, 0, sizeof(timing));
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    ret = libusb_get_device_list(ctx->usb, &dev_list);
+    if (ret < 0) {
+        return ret;
+    }
+    timing.enumerateMs = elapsedMs(&t);
+    blinkyInfo(ctx, "total USB devices found: %i \n", ret);
+    max = ret;
+    for (i = 0; i < max && count < maxDevs; i++) {
+        ret = libusb_get_device_descriptor(dev_list[i],  & des);
+        if (ret || des.idVendor != BLINKY_VENDOR_ID || des.idProduct != BLINKY_PRODUCT_ID) {
+            continue;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.bus = libusb_get_bus_number(dev_list[i]);
+        info.address = libusb_get_device_address(dev_list[i]);
+        getDevicePath(dev_list[i], info.path, sizeof(info.path));
+        blinkyInfo(ctx, "device %i  vendor=%04x, product=%04x bus:device=%i:%i path=%s\n",
+                i, des.idVendor, des.idProduct, info.bus, info.address, info.path);
+
+        elapsedMs(&t);
+        if (libusb_open(dev_list[i], &h)) {
+            continue;
+        }
+        if (des.iSerialNumber) {
+            libusb_get_string_descriptor_ascii(h, des.iSerialNumber,
+                    (unsigned char*) info.serial, sizeof(info.serial));
+        }
+        timing.openMs = elapsedMs(&t);
+        if (!isSelected(selector, &info) || setupDevice(ctx, h, &timing)) {
+            libusb_close(h);
+            continue;
+        }
+
+        d = calloc(1, sizeof(BlinkyDevice));
+        if (d == NULL) {
+            libusb_release_interface(h, 0);
+            libusb_close(h);
+            break;
+        }
+        blinkyInfo(ctx, "using device: %i \n", i);
+        d->ctx = ctx;
+        d->handle = h;
+        d->info = info;
+        d->timing = timing;
+        d->timeout = BLINKY_DEFAULT_TIMEOUT;
+        d->maxInFlight = BLINKY_DEFAULT_IN_FLIGHT;
+        pthread_mutex_init(&d->lock, NULL);
+        devs[count++] = d;
+    }
+    libusb_free_device_list(dev_list, 1);
+    return count;
+}
+
+int blinkyOpen(BlinkyContext* ctx, BlinkyDevice** dev) {
+    int ret = blinkyOpenSelected(ctx, NULL, dev, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+const BlinkyDeviceInfo* blinkyGetDeviceInfo(BlinkyDevice* dev) {
+    return &dev->info;
+}
+
+const BlinkyOpenTiming* blinkyGetOpenTiming(BlinkyDevice* dev) {
+    return &dev->timing;
+}
+
+int blinkyOpenTransport(const BlinkyTransport* transport, void* data, BlinkyDevice** dev) {
+    BlinkyDevice* d = calloc(1, sizeof(BlinkyDevice));
+
+    if (d == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    d->transport = transport;
+    d->transportData = data;
+    d->timeout = BLINKY_DEFAULT_TIMEOUT;
+    d->maxInFlight = 1;
+    pthread_mutex_init(&d->lock, NULL);
+    *dev = d;
+    return 0;
+}
+
+static int writeAll(int fd, const uint8_t* buf, int len) {
+    int ret;
+    while (len > 0) {
+        ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// waits at most timeoutMs for all of it (0: no limit), returns 0, -1 or
+// LIBUSB_ERROR_TIMEOUT
+static int readAll(int fd, uint8_t* buf, int len, unsigned int timeoutMs) {
+    struct pollfd p;
+    struct timespec t;
+    double waitedMs = 0;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    p.fd = fd;
+    p.events = POLLIN;
+    while (len > 0) {
+        if (timeoutMs) {
+            waitedMs += elapsedMs(&t);
+            if (waitedMs >= timeoutMs) {
+                return LIBUSB_ERROR_TIMEOUT;
+            }
+            ret = poll(&p, 1, (int)(timeoutMs - waitedMs) + 1);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret == 0) {
+                continue;       // the time check above ends it
+            }
+        }
+        ret = recv(fd, buf, len, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// one request / response round trip through the daemon socket. A reply
+// later than timeoutMs would be read as the one of the next request, so a
+// timeout shuts the connection down and the following requests fail.
+static int daemonControl(void* data, uint8_t requestType, uint8_t command, uint16_t value,
+        uint16_t index, uint8_t* buf, uint16_t len, unsigned int timeoutMs) {
+    int fd = (int)(intptr_t) data;
+    uint8_t req[BLINKY_DAEMON_REQ_SIZE + BLINKY_MAX_DATA];
+    uint8_t res[BLINKY_DAEMON_RES_SIZE];
+    int reqLen = BLINKY_DAEMON_REQ_SIZE;
+    uint16_t resLen;
+    int ret;
+
+    req[0] = requestType;
+    req[1] = command;
+    req[2] = value & 0xFF;
+    req[3] = value >> 8;
+    req[4] = index & 0xFF;
+    req[5] = index >> 8;
+    req[6] = len & 0xFF;
+    req[7] = len >> 8;
+    if (!(requestType & LIBUSB_ENDPOINT_IN)) {
+        memcpy(req + BLINKY_DAEMON_REQ_SIZE, buf, len);
+        reqLen += len;
+    }
+    if (writeAll(fd, req, reqLen)) {
+        return LIBUSB_ERROR_IO;
+    }
+    ret = readAll(fd, res, sizeof(res), timeoutMs);
+    if (!ret) {
+        resLen = res[2] | (res[3] << 8);
+        ret = resLen > len ? -1 : readAll(fd, buf, resLen, timeoutMs);
+    }
+    if (ret == LIBUSB_ERROR_TIMEOUT) {
+        shutdown(fd, SHUT_RDWR);
+        return ret;
+    }
+    if (ret) {
+        return LIBUSB_ERROR_IO;
+    }
+    return (int16_t)(res[0] | (res[1] << 8));
+}
+
+static void daemonClose(void* data) {
+    close((int)(intptr_t) data);
+}
+
+static const BlinkyTransport daemonTransport = {
+    "daemon",
+    daemonControl,
+    NULL,
+    daemonClose
+};
+
+int blinkyOpenDaemon(const char* path, BlinkyDevice** dev) {
+    struct sockaddr_un addr;
+    int ret;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return LIBUSB_ERROR_OTHER;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        close(fd);
+        return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+    ret = blinkyOpenTransport(&daemonTransport, (void*)(intptr_t) fd, dev);
+    if (ret) {
+        close(fd);
+    }
+    return ret;
+}
+
+void blinkyClose(BlinkyDevice* dev) {
+    int busy;
+
+    blinkySetEventCallback(dev, NULL, NULL);
+    if (dev->transport) {
+        if (dev->transport->close) {
+            dev->transport->close(dev->transportData);
+        }
+        pthread_mutex_destroy(&dev->lock);
+        free(dev);
+        return;
+    }
+
+    // let the queued requests finish
+    for (;;) {
+        pthread_mutex_lock(&dev->lock);
+        busy = dev->inFlight || dev->pendingHead;
+        pthread_mutex_unlock(&dev->lock);
+        if (!busy) {
+            break;
+        }
+        if (dev->ctx->flags & BLINKY_EVENT_THREAD) {
+            usleep(1000);
+        } else {
+            blinkyHandleEvents(dev->ctx, 10);
+        }
+    }
+    libusb_free_transfer(dev->eventTransfer);
+    libusb_release_interface(dev->handle, 0);
+    libusb_close(dev->handle);
+    pthread_mutex_destroy(&dev->lock);
+    free(dev);
+}
+
+void blinkySetTimeout(BlinkyDevice* dev, unsigned int timeoutMs) {
+    dev->timeout = timeoutMs;
+}
+
+void blinkySetMaxInFlight(BlinkyDevice* dev, int maxInFlight) {
+    pthread_mutex_lock(&dev->lock);
+    dev->maxInFlight = maxInFlight < 1 ? 1 : maxInFlight;
+    pthread_mutex_unlock(&dev->lock);
+}
+
+
+static int transferStatusToError(enum libusb_transfer_status status) {
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED: return 0;
+    case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+    default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
+static void freeRequest(BlinkyRequest* r) {
+    libusb_free_transfer(r->transfer);
+    free(r);
+}
+
+// finish the request and hand its slot over to the next pending one
+static void completeRequest(BlinkyRequest* r);
+
+static void startRequest(BlinkyRequest* r) {
+    int ret = libusb_submit_transfer(r->transfer);
+    if (ret) {
+        r->result = ret;
+        completeRequest(r);
+    }
+}
+
+static void completeRequest(BlinkyRequest* r) {
+    BlinkyDevice* dev = r->device;
+    BlinkyRequest* next;
+
+    if (r->callback) {
+        r->callback(r, r->userData);
+    }
+    if (r->sync) {
+        // the waiting thread owns the request
+        r->completed = 1;
+    } else {
+        freeRequest(r);
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    next = dev->pendingHead;
+    if (next) {
+        dev->pendingHead = next->next;
+        if (dev->pendingHead == NULL) {
+            dev->pendingTail = NULL;
+        }
+    } else {
+        dev->inFlight--;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if (next) {
+        startRequest(next);
+    }
+}
+
+static void LIBUSB_CALL transferCallback(struct libusb_transfer* t) {
+    BlinkyRequest* r = (BlinkyRequest*) t->user_data;
+
+    r->result = transferStatusToError(t->status);
+    if (r->result == 0) {
+        r->result = t->actual_length;
+    }
+    completeRequest(r);
+}
+
+static BlinkyRequest* allocRequest(BlinkyDevice* dev, uint8_t requestType, uint8_t command,
+        uint16_t value, uint16_t index, const uint8_t* data, uint16_t len) {
+    BlinkyRequest* r;
+
+    if (len > BLINKY_MAX_DATA) {
+        return NULL;
+    }
+    r = calloc(1, sizeof(BlinkyRequest));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->device = dev;
+    if (dev->transport == NULL) {
+        r->transfer = libusb_alloc_transfer(0);
+        if (r->transfer == NULL) {
+            free(r);
+            return NULL;
+        }
+    }
+    r->requestType = requestType;
+    r->command = command;
+    r->value = value;
+    r->index = index;
+    r->length = len;
+    r->data = r->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    if (data && !(requestType & LIBUSB_ENDPOINT_IN)) {
+        memcpy(r->data, data, len);
+    }
+    if (r->transfer == NULL) {
+        return r;
+    }
+    libusb_fill_control_setup(r->buffer, requestType, command, value, index, len);
+    libusb_fill_control_transfer(r->transfer, dev->handle, r->buffer, transferCallback, r, dev->timeout);
+    return r;
+}
+
+static int queueRequest(BlinkyRequest* r) {
+    BlinkyDevice* dev = r->device;
+    int start = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    if (dev->inFlight < dev->maxInFlight) {
+        dev->inFlight++;
+        start = 1;
+    } else {
+        r->next = NULL;
+        if (dev->pendingTail) {
+            dev->pendingTail->next = r;
+        } else {
+            dev->pendingHead = r;
+        }
+        dev->pendingTail = r;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if (start) {
+        startRequest(r);
+    }
+    return 0;
+}
+
+// a request of a transport, the calls of a device don't overlap
+static int transportTransfer(BlinkyRequest* r) {
+    BlinkyDevice* dev = r->device;
+    int ret;
+
+    pthread_mutex_lock(&dev->lock);
+    ret = dev->transport->control(dev->transportData, r->requestType, r->command, r->value,
+            r->index, r->data, r->length, dev->timeout);
+    pthread_mutex_unlock(&dev->lock);
+    return ret;
+}
+
+int blinkySubmit(BlinkyDevice* dev, uint8_t requestType, uint8_t command,
+        uint16_t value, uint16_t index, const uint8_t* data, uint16_t len,
+        BlinkyCallback callback, void* userData) {
+    BlinkyRequest* r;
+
+    r = allocRequest(dev, requestType, command, value, index, data, len);
+    if (r == NULL) {
+        return len > BLINKY_MAX_DATA ? LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_NO_MEM;
+    }
+    r->callback = callback;
+    r->userData = userData;
+    if (dev->transport) {
+        r->result = transportTransfer(r);
+        if (callback) {
+            callback(r, userData);
+        }
+        freeRequest(r);
+        return 0;
+    }
+    return queueRequest(r);
+}
+
+// submit the request and process events until it is done
+static int transferSync(BlinkyDevice* dev, uint8_t requestType, uint8_t command,
+        uint16_t value, uint16_t index, uint8_t* data, uint16_t len) {
+    BlinkyRequest* r;
+    int ret;
+
+    r = allocRequest(dev, requestType, command, value, index, data, len);
+    if (r == NULL) {
+        return len > BLINKY_MAX_DATA ? LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_NO_MEM;
+    }
+    r->sync = 1;
+    if (dev->transport) {
+        r->result = transportTransfer(r);
+    } else {
+        queueRequest(r);
+
+        // safe along with the event thread - libusb lets only one thread
+        // handle the events and wakes up the others on every completion
+        while (!r->completed) {
+            libusb_handle_events_completed(dev->ctx->usb, (int*) &r->completed);
+        }
+    }
+
+    ret = r->result;
+    if (ret > 0 && (requestType & LIBUSB_ENDPOINT_IN) && data) {
+        memcpy(data, r->data, ret);
+    }
+    freeRequest(r);
+    return ret;
+}
+
+int blinkyControlOut(BlinkyDevice* dev, uint8_t command, uint16_t value,
+        uint16_t index, const uint8_t* data, uint16_t len) {
+    return transferSync(dev, BLINKY_TYPE_OUT_ITF, command, value, index, (uint8_t*) data, len);
+}
+
+int blinkyControlIn(BlinkyDevice* dev, uint8_t command, uint16_t value,
+        uint16_t index, uint8_t* data, uint16_t len) {
+    return transferSync(dev, BLINKY_TYPE_IN_ITF, command, value, index, data, len);
+}
+
+
+int blinkyReadBlinkTime(BlinkyDevice* dev, uint16_t* blinkTime) {
+    return blinkyCmdReadBlinkTime(dev, blinkTime);
+}
+
+int blinkySetBlinkTime(BlinkyDevice* dev, uint16_t blinkTime) {
+    return blinkyCmdSetBlinkTime(dev, blinkTime);
+}
+
+int blinkyToggleBlink(BlinkyDevice* dev) {
+    return blinkyCmdToggleBlink(dev);
+}
+
+int blinkySetSequence(BlinkyDevice* dev, const uint8_t* sequence, uint16_t len) {
+    uint16_t addr;
+    uint16_t chunk;
+    int ret;
+
+    if (len == 0 || len > BLINKY_SEQ_PROGRAM_SIZE) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    // the chunk at address 0 goes last, it starts the program
+    addr = (len - 1) / COMMAND_SET_BLINK_SEQUENCE_MAX * COMMAND_SET_BLINK_SEQUENCE_MAX;
+    while (1) {
+        chunk = len - addr > COMMAND_SET_BLINK_SEQUENCE_MAX ? COMMAND_SET_BLINK_SEQUENCE_MAX : len - addr;
+        ret = blinkyCmdSetBlinkSequence(dev, BLINKY_SEQ_VERSION, addr, sequence + addr, chunk);
+        if (ret < 0 || addr == 0) {
+            return ret;
+        }
+        addr -= COMMAND_SET_BLINK_SEQUENCE_MAX;
+    }
+}
+
+int blinkyJumpToBootloader(BlinkyDevice* dev) {
+    return blinkyCmdJumpToBootloader(dev);
+}
+
+int blinkySaveSequence(BlinkyDevice* dev, uint16_t len, BlinkySaved* saved) {
+    BlinkySaved s;
+    int ret;
+    int i;
+
+    if (len > BLINKY_SAVE_PROGRAM_MAX) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    ret = blinkyCmdSaveSequence(dev, len);
+    for (i = 0; ret == 0 && i < BLINKY_SAVE_TIMEOUT_MS / BLINKY_SAVE_POLL_MS; i++) {
+        ret = blinkyCmdReadSaved(dev, &s);
+        if (ret || s.state != BLINKY_SAVED_BUSY) {
+            break;
+        }
+        usleep(BLINKY_SAVE_POLL_MS * 1000);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (saved) {
+        *saved = s;
+    }
+    if (s.state == BLINKY_SAVED_BUSY) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+    return s.state == BLINKY_SAVED_FAILED ? LIBUSB_ERROR_IO : 0;
+}
+
+int blinkyReadSaved(BlinkyDevice* dev, BlinkySaved* saved) {
+    return blinkyCmdReadSaved(dev, saved);
+}
+
+// CRC-16/CCITT (polynomial 0x1021, start 0xFFFF) as the firmware computes it
+uint16_t blinkyCrc16(const uint8_t* data, int len) {
+    uint16_t crc = 0xFFFF;
+    int i;
+
+    while (len-- > 0) {
+        crc ^= *data++ << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+int blinkyReadStats(BlinkyDevice* dev, BlinkyStats* stats) {
+    return blinkyCmdReadStats(dev, stats);
+}
+
+int blinkyReadLoad(BlinkyDevice* dev, BlinkyLoad* load) {
+    return blinkyCmdReadLoad(dev, load);
+}
+
+int blinkyReadTrace(BlinkyDevice* dev, BlinkyTraceRecord* records, int max,
+        uint16_t* now, uint8_t* lost) {
+    uint8_t buf[BLINKY_TRACE_HEADER_SIZE + BLINKY_TRACE_PER_READ * BLINKY_TRACE_RECORD_SIZE];
+    const uint8_t* r;
+    int ret;
+    int n;
+    int i;
+
+    if (max > BLINKY_TRACE_PER_READ) {
+        max = BLINKY_TRACE_PER_READ;
+    }
+    if (max < 0) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    ret = blinkyCmdReadTrace(dev, buf, BLINKY_TRACE_HEADER_SIZE + max * BLINKY_TRACE_RECORD_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret < BLINKY_TRACE_HEADER_SIZE
+            || (ret - BLINKY_TRACE_HEADER_SIZE) % BLINKY_TRACE_RECORD_SIZE) {
+        return LIBUSB_ERROR_IO;
+    }
+    if (now) {
+        *now = buf[0] | (buf[1] << 8);
+    }
+    if (lost) {
+        *lost = buf[2];
+    }
+    n = (ret - BLINKY_TRACE_HEADER_SIZE) / BLINKY_TRACE_RECORD_SIZE;
+    r = buf + BLINKY_TRACE_HEADER_SIZE;
+    for (i = 0; i < n; i++, r += BLINKY_TRACE_RECORD_SIZE) {
+        records[i].type = r[0];
+        records[i].arg = r[1];
+        records[i].time = r[2] | (r[3] << 8);
+    }
+    return n;
+}
+
+void blinkyBatchInit(BlinkyBatch* batch) {
+    batch->len = 0;
+    batch->count = 0;
+    batch->reads = 0;
+    batch->resultLen = BLINKY_BATCH_HEADER_SIZE;
+    batch->executed = 0;
+    batch->error = BLINKY_BATCH_ERROR_NONE;
+}
+
+// appends a sub-command of len bytes, returns where its arguments go or NULL
+static uint8_t* batchAppend(BlinkyBatch* batch, uint8_t code, uint16_t len) {
+    uint8_t* p = batch->data + batch->len;
+
+    if (batch->count >= BLINKY_BATCH_MAX_COMMANDS || len > COMMAND_BATCH_MAX - batch->len) {
+        return NULL;
+    }
+    *p = code;
+    batch->len += len;
+    batch->count++;
+    return p + 1;
+}
+
+static int batchRead(BlinkyBatch* batch, uint8_t code, uint16_t size, void* dst) {
+    if (batch->reads >= BLINKY_BATCH_MAX_READS
+            || batch->resultLen + size > BLINKY_BATCH_RESULT_SIZE
+            || batchAppend(batch, code, 1) == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    batch->readCode[batch->reads] = code;
+    batch->readDst[batch->reads] = dst;
+    batch->reads++;
+    batch->resultLen += size;
+    return 0;
+}
+
+// a sequence fragment, the one at address 0 starts the program
+static int batchFragment(BlinkyBatch* batch, uint16_t addr, const uint8_t* data, uint16_t len) {
+    uint8_t* p = batchAppend(batch, COMMAND_SET_BLINK_SEQUENCE, 4 + len);
+
+    if (p == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    p[0] = addr & 0xFF;
+    p[1] = addr >> 8;
+    p[2] = len;
+    memcpy(p + 3, data, len);
+    return 0;
+}
+
+int blinkyBatchSetBlinkTime(BlinkyBatch* batch, uint16_t blinkTime) {
+    uint8_t* p = batchAppend(batch, COMMAND_SET_BLINK_TIME, 3);
+
+    if (p == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    p[0] = blinkTime & 0xFF;
+    p[1] = blinkTime >> 8;
+    return 0;
+}
+
+int blinkyBatchToggleBlink(BlinkyBatch* batch) {
+    return batchAppend(batch, COMMAND_TOGGLE_BLINK, 1) ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+int blinkyBatchStartStream(BlinkyBatch* batch) {
+    return batchAppend(batch, COMMAND_START_STREAM, 1) ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+int blinkyBatchSetSequence(BlinkyBatch* batch, const uint8_t* sequence, uint16_t len) {
+    uint16_t savedLen = batch->len;
+    int savedCount = batch->count;
+    int ret;
+
+    if (len == 0 || len > BLINKY_SEQ_PROGRAM_SIZE) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (len <= 255) {
+        return batchFragment(batch, 0, sequence, len);
+    }
+    // the tail first, both fragments or none
+    ret = batchFragment(batch, 255, sequence + 255, len - 255);
+    if (ret == 0) {
+        ret = batchFragment(batch, 0, sequence, 255);
+    }
+    if (ret) {
+        batch->len = savedLen;
+        batch->count = savedCount;
+    }
+    return ret;
+}
+
+int blinkyBatchReadBlinkTime(BlinkyBatch* batch, uint16_t* blinkTime) {
+    return batchRead(batch, COMMAND_READ_BLINK_TIME, COMMAND_READ_BLINK_TIME_SIZE, blinkTime);
+}
+
+int blinkyBatchReadStreamStatus(BlinkyBatch* batch, BlinkyStreamStatus* status) {
+    return batchRead(batch, COMMAND_READ_STREAM_STATUS, COMMAND_READ_STREAM_STATUS_SIZE, status);
+}
+
+int blinkyRunBatch(BlinkyDevice* dev, BlinkyBatch* batch) {
+    uint8_t buf[BLINKY_BATCH_RESULT_SIZE];
+    const uint8_t* r = buf + BLINKY_BATCH_HEADER_SIZE;
+    BlinkyStreamStatus* status;
+    uint16_t* blinkTime;
+    int ret;
+    int i;
+
+    ret = blinkyCmdBatch(dev, BLINKY_SEQ_VERSION, batch->data, batch->len);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blinkyCmdReadBatch(dev, buf, BLINKY_BATCH_RESULT_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret < BLINKY_BATCH_HEADER_SIZE) {
+        return LIBUSB_ERROR_IO;
+    }
+    batch->executed = buf[0];
+    batch->error = buf[1];
+
+    // the results of the reads that ran
+    for (i = 0; i < batch->reads; i++) {
+        if (batch->readCode[i] == COMMAND_READ_BLINK_TIME) {
+            if (r + 2 > buf + ret) {
+                break;
+            }
+            blinkTime = batch->readDst[i];
+            *blinkTime = r[0] | (r[1] << 8);
+            r += 2;
+        } else {
+            if (r + 8 > buf + ret) {
+                break;
+            }
+            status = batch->readDst[i];
+            status->credits = r[0] | (r[1] << 8);
+            status->played = r[2] | (r[3] << 8);
+            status->underruns = r[4] | (r[5] << 8);
+            status->overruns = r[6] | (r[7] << 8);
+            r += 8;
+        }
+    }
+    if (batch->error != BLINKY_BATCH_ERROR_NONE || batch->executed != batch->count) {
+        return LIBUSB_ERROR_IO;
+    }
+    return ret == batch->resultLen ? 0 : LIBUSB_ERROR_IO;
+}
+
+int blinkyStartStream(BlinkyDevice* dev) {
+    return blinkyCmdStartStream(dev);
+}
+
+int blinkyReadStreamStatus(BlinkyDevice* dev, BlinkyStreamStatus* status) {
+    return blinkyCmdReadStreamStatus(dev, status);
+}
+
+int blinkyWriteStream(BlinkyDevice* dev, const uint8_t* frames, int count) {
+    int len = count * BLINKY_STREAM_FRAME_SIZE;
+    int transferred = 0;
+    int ret;
+
+    if (dev->transport) {
+        if (dev->transport->writeStream == NULL) {
+            return LIBUSB_ERROR_NOT_SUPPORTED;
+        }
+        pthread_mutex_lock(&dev->lock);
+        ret = dev->transport->writeStream(dev->transportData, frames, len, dev->timeout);
+        pthread_mutex_unlock(&dev->lock);
+        return ret;
+    }
+    ret = libusb_bulk_transfer(dev->handle, BLINKY_STREAM_EP, (unsigned char*) frames, len,
+            &transferred, dev->timeout);
+    if (ret < 0) {
+        return ret;
+    }
+    return transferred == len ? 0 : LIBUSB_ERROR_IO;
+}
+
+int blinkyStream(BlinkyDevice* dev, const uint8_t* frames, int count, BlinkyStreamStatus* status) {
+    BlinkyStreamStatus st;
+    int n;
+    int ret;
+
+    while (count > 0) {
+        ret = blinkyReadStreamStatus(dev, &st);
+        if (ret) {
+            return ret;
+        }
+        if (st.credits == 0) {
+            usleep(BLINKY_STREAM_POLL_MS * 1000);
+            continue;
+        }
+        n = count < st.credits ? count : st.credits;
+        ret = blinkyWriteStream(dev, frames, n);
+        if (ret) {
+            return ret;
+        }
+        frames += n * BLINKY_STREAM_FRAME_SIZE;
+        count -= n;
+    }
+    return status ? blinkyReadStreamStatus(dev, status) : 0;
+}
+
+static void LIBUSB_CALL eventTransferCallback(struct libusb_transfer* t) {
+    BlinkyDevice* dev = (BlinkyDevice*) t->user_data;
+    BlinkyEventCallback callback;
+    void* userData;
+    BlinkyEvent e;
+    int i;
+
+    pthread_mutex_lock(&dev->lock);
+    callback = dev->eventCallback;
+    userData = dev->eventUserData;
+    pthread_mutex_unlock(&dev->lock);
+
+    if (callback && t->status == LIBUSB_TRANSFER_COMPLETED) {
+        for (i = 0; i + BLINKY_EVENT_RECORD_SIZE <= t->actual_length; i += BLINKY_EVENT_RECORD_SIZE) {
+            e.type = t->buffer[i];
+            e.arg = t->buffer[i + 1];
+            e.value = t->buffer[i + 2] | (t->buffer[i + 3] << 8);
+            callback(dev, &e, userData);
+        }
+    }
+    // keep listening until stopped, a stall or a lost device ends it as well
+    if ((t->status == LIBUSB_TRANSFER_COMPLETED || t->status == LIBUSB_TRANSFER_TIMED_OUT)
+            && dev->eventCallback && libusb_submit_transfer(t) == 0) {
+        return;
+    }
+    dev->eventActive = 0;
+}
+
+int blinkySetEventCallback(BlinkyDevice* dev, BlinkyEventCallback callback, void* userData) {
+    int ret;
+
+    if (dev->transport) {
+        return callback ? LIBUSB_ERROR_NOT_SUPPORTED : 0;
+    }
+
+    pthread_mutex_lock(&dev->lock);
+    dev->eventCallback = callback;
+    dev->eventUserData = userData;
+    pthread_mutex_unlock(&dev->lock);
+    if (callback == NULL) {
+        if (dev->eventActive) {
+            libusb_cancel_transfer(dev->eventTransfer);
+        }
+        while (dev->eventActive) {
+            if (dev->ctx->flags & BLINKY_EVENT_THREAD) {
+                usleep(1000);
+            } else {
+                blinkyHandleEvents(dev->ctx, 10);
+            }
+        }
+        return 0;
+    }
+    if (dev->eventActive) {
+        // the running transfer picks up the new callback
+        return 0;
+    }
+
+    if (dev->eventTransfer == NULL) {
+        dev->eventTransfer = libusb_alloc_transfer(0);
+        if (dev->eventTransfer == NULL) {
+            dev->eventCallback = NULL;
+            return LIBUSB_ERROR_NO_MEM;
+        }
+    }
+    // no timeout, the device sends when something happens
+    libusb_fill_interrupt_transfer(dev->eventTransfer, dev->handle, BLINKY_EVENT_EP,
+            dev->eventBuffer, sizeof(dev->eventBuffer), eventTransferCallback, dev, 0);
+    dev->eventActive = 1;
+    ret = libusb_submit_transfer(dev->eventTransfer);
+    if (ret) {
+        dev->eventActive = 0;
+        dev->eventCallback = NULL;
+    }
+    return ret;
+}
+
+const char* blinkyErrorName(int error) {
+    return libusb_error_name(error);
+}
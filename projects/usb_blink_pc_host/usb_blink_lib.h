@@ -0,0 +1,381 @@
+/* usb_blink_lib - host library for the CH55x blink demo
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The library wraps the vendor control transfers of the blinky device.
+ * Every request owns its setup + data buffer, so the API can be used from
+ * several threads at once. Requests are submitted asynchronously and up to
+ * maxInFlight of them are kept queued in libusb per device; the synchronous
+ * calls are built on top of the asynchronous ones.
+ *
+ * Events are processed either by an internal event thread (BLINKY_EVENT_THREAD)
+ * or by the application: call blinkyHandleEvents() from your own loop, or add
+ * the descriptors from blinkyGetPollFds() to your poll / epoll set.
+ */
+
+#ifndef USB_BLINK_LIB_H
+#define USB_BLINK_LIB_H
+
+#include <stdint.h>
+#include <poll.h>
+#ifdef MINGW
+#include <libusbx-1.0/libusb.h>
+#else
+#include <libusb-1.0/libusb.h>
+#endif
+
+
+#define BLINKY_VENDOR_ID    0xFFFF
+#define BLINKY_PRODUCT_ID   0x001e
+
+//see usb1.1 page 183: value bitmap: Host->Device, Vendor request, Recipient is interface
+#define BLINKY_TYPE_OUT_ITF     0x41
+
+//see usb1.1 page 183: value bitmap: Device->Host, Vendor request, Sender is interface
+#define BLINKY_TYPE_IN_ITF      (0x41 | (1 << 7))
+
+// maximal size of the data stage of a control transfer. Longer data stages
+// than the 32 byte device EP0 buffer are sent in several packets.
+#define BLINKY_MAX_DATA         512
+
+// the sequence bytecode and the timeline compiler
+#include "usb_blink_seq.h"
+
+/* saved sequence - COMMAND_SAVE_SEQUENCE (wValue = length) copies the first
+ * bytes of the latest loaded program into the device DataFlash, the device
+ * plays it from the next power on until a host loads another one; length 0
+ * erases it. The device writes it after the request, COMMAND_READ_SAVED is
+ * BLINKY_SAVED_BUSY until it is done. The CRC is CRC-16/CCITT (blinkyCrc16).
+ */
+#define BLINKY_SAVE_PROGRAM_MAX 124     // DataFlash, less the record header
+#define BLINKY_SAVE_POLL_MS     5       // state poll interval of blinkySaveSequence()
+#define BLINKY_SAVE_TIMEOUT_MS  1000
+
+#define BLINKY_SAVED_NONE       0x00    // no program is saved
+#define BLINKY_SAVED_VALID      0x01
+#define BLINKY_SAVED_BUSY       0x02    // the device is writing
+#define BLINKY_SAVED_FAILED     0x03    // the write failed, no program is saved
+
+/* LED frame stream - after COMMAND_START_STREAM the frames sent to the bulk
+ * endpoint are played one after another. A frame is u16 ms (little endian),
+ * u8 LED state (bit 0), u8 0; or u8 channel values, u8 channel mask. The
+ * device buffers BLINKY_STREAM_FRAMES of them; send no more than the credits
+ * of the stream status, the rest is dropped.
+ *
+ * Output channels: channel n is the pin P1.n of the board, the LED is channel
+ * 4. The firmware sets the channels of a mask with one port write, so they
+ * switch together; pins not built in as channels (CHANNEL_PINS) are ignored.
+ */
+#define BLINKY_STREAM_EP        0x02
+#define BLINKY_STREAM_FRAMES    32
+#define BLINKY_STREAM_FRAME_SIZE 4
+#define BLINKY_STREAM_POLL_MS   10      // credit poll interval of blinkyStream()
+
+#define BLINKY_STREAM_FRAME(ms, led)    BLINKY_SEQ_U16(ms), (led), 0
+#define BLINKY_STREAM_CHANNELS(ms, mask, value) BLINKY_SEQ_U16(ms), (value), (mask)
+
+/* device events - 4 byte records on the interrupt endpoint: u8 type, u8 arg,
+ * u16 value (little endian), up to 4 of them per packet. The device queues a
+ * few records and drops new ones while the queue is full.
+ */
+#define BLINKY_EVENT_EP         0x81
+#define BLINKY_EVENT_PACKET_SIZE 16
+#define BLINKY_EVENT_RECORD_SIZE 4
+
+#define BLINKY_EVENT_SEQUENCE_DONE  0x01    // the sequence ended
+#define BLINKY_EVENT_STREAM_LOW     0x02    // value: credits, the stream runs low
+#define BLINKY_EVENT_BUS_RESET      0x03    // the device was reset, queued events are lost
+#define BLINKY_EVENT_ERROR          0x04    // arg: BLINKY_ERROR_*
+
+#define BLINKY_ERROR_SEQ_OPCODE     0x01    // value: program counter after the opcode
+#define BLINKY_ERROR_SEQ_STACK      0x02    // value: program counter after the opcode
+#define BLINKY_ERROR_STREAM_UNDERRUN 0x03   // value: underruns
+#define BLINKY_ERROR_STREAM_OVERRUN 0x04    // value: overruns
+#define BLINKY_ERROR_SEQ_SHORT      0x05    // value: bytes, a sequence upload was dropped
+
+/* USB interrupt statistics - COMMAND_READ_STATS returns 16 u16 counters
+ * (little endian) in the order of BlinkyStats. They count since the power on
+ * and wrap around.
+ */
+#define BLINKY_STATS_TICK_US    0.5     // isrMaxTicks unit
+
+/* CPU load - the firmware does its work in the interrupts, the main loop only
+ * polls. COMMAND_READ_LOAD returns the time spent in them (BLINKY_STATS_TICK_US
+ * units) and their count over the last complete window of windowMs, see
+ * BlinkyLoad. The idle share is 1 - busyTicks * BLINKY_STATS_TICK_US /
+ * (windowMs * 1000).
+ */
+
+/* device trace - COMMAND_READ_TRACE returns a 4 byte header: u16 time now,
+ * u8 records lost since the last read, u8 reserved; followed by up to
+ * BLINKY_TRACE_PER_READ records of u8 type, u8 arg, u16 time (little endian),
+ * oldest first. The read removes them from the device ring buffer. The times
+ * count BLINKY_TRACE_TICK_US steps and wrap every 262 ms, so drain the trace
+ * more often than that.
+ */
+#define BLINKY_TRACE_HEADER_SIZE 4
+#define BLINKY_TRACE_RECORD_SIZE 4
+#define BLINKY_TRACE_PER_READ   7
+#define BLINKY_TRACE_TICK_US    4
+
+#define BLINKY_TRACE_SETUP      0x01    // arg: bRequest
+#define BLINKY_TRACE_BUS_RESET  0x02
+#define BLINKY_TRACE_SUSPEND    0x03    // arg: 1 entering the sleep, 0 suspend seen
+#define BLINKY_TRACE_SEQ_STEP   0x10    // arg: program counter (low byte) after the step
+#define BLINKY_TRACE_EVENT      0x11    // arg: BLINKY_EVENT_* posted
+
+/* batch - COMMAND_BATCH carries a list of sub-commands, each a request code
+ * and its arguments (little endian), and the device runs them in order:
+ *   COMMAND_SET_BLINK_TIME      u16 ms
+ *   COMMAND_TOGGLE_BLINK
+ *   COMMAND_START_STREAM
+ *   COMMAND_SET_BLINK_SEQUENCE  u16 address, u8 length (1 - 255), the bytecode
+ *   COMMAND_READ_BLINK_TIME     result: u16 ms
+ *   COMMAND_READ_STREAM_STATUS  result: BlinkyStreamStatus, 8 bytes
+ * wValue is the bytecode version of the sequence fragments. COMMAND_READ_BATCH
+ * then returns the result block: u8 executed sub-commands, u8 error, the read
+ * results in the order of the reads. The first error skips the rest.
+ */
+#define BLINKY_BATCH_RESULT_SIZE 16
+#define BLINKY_BATCH_HEADER_SIZE 2
+#define BLINKY_BATCH_MAX_COMMANDS 255
+#define BLINKY_BATCH_MAX_READS  ((BLINKY_BATCH_RESULT_SIZE - BLINKY_BATCH_HEADER_SIZE) / 2)
+
+#define BLINKY_BATCH_ERROR_NONE     0x00
+#define BLINKY_BATCH_ERROR_CODE     0x01    // unknown or not batchable sub-command
+#define BLINKY_BATCH_ERROR_RANGE    0x02    // sequence fragment outside of the program
+#define BLINKY_BATCH_ERROR_FULL     0x03    // no room for a read result
+#define BLINKY_BATCH_ERROR_SHORT    0x04    // the data ended inside a sub-command
+
+#define BLINKY_DEFAULT_TIMEOUT  50  // milli seconds
+#define BLINKY_DEFAULT_IN_FLIGHT 8
+
+/* daemon protocol - Unix stream socket, little endian, no padding
+ * request:  8 byte header, the USB setup packet: requestType, command, value,
+ *           index, length; followed by length data bytes for OUT requests
+ * response: 4 byte header: int16 result (transferred bytes or negative libusb
+ *           error), uint16 length; followed by length data bytes (IN requests)
+ * Responses are sent in request order.
+ */
+#define BLINKY_DAEMON_SOCKET    "/tmp/usb_blink.sock"
+#define BLINKY_DAEMON_REQ_SIZE  8
+#define BLINKY_DAEMON_RES_SIZE  4
+
+// blinkyInit() flags
+#define BLINKY_EVENT_THREAD     (1 << 0)    // run own event handling thread
+#define BLINKY_VERBOSE          (1 << 1)    // print progress info to stderr
+
+typedef struct BlinkyContext BlinkyContext;
+typedef struct BlinkyDevice BlinkyDevice;
+typedef struct BlinkyRequest BlinkyRequest;
+
+typedef struct BlinkyDeviceInfo {
+    uint8_t bus;
+    uint8_t address;
+    char path[32];              // "bus-port.port...", as the sysfs device name
+    char serial[64];            // empty when the device has no serial number
+} BlinkyDeviceInfo;
+
+// vendor request codes, BlinkyStreamStatus, BlinkyStats and the typed
+// blinkyCmd*() calls, generated from usb_blink/blinky_protocol.def
+#include "usb_blink_proto.h"
+
+typedef struct BlinkyTraceRecord {
+    uint8_t type;               // BLINKY_TRACE_*
+    uint8_t arg;
+    uint16_t time;              // BLINKY_TRACE_TICK_US units, wraps around
+} BlinkyTraceRecord;
+
+/* transport - a device that is not driven through libusb: the daemon socket
+ * or the in-process fake device of usb_blink_fake.h. Its requests complete
+ * synchronously, also when submitted by blinkySubmit(), and the calls of one
+ * device never overlap. data is the pointer given to blinkyOpenTransport().
+ */
+typedef struct BlinkyTransport {
+    const char* name;
+    // one control request, IN data goes to buf. Returns the transferred
+    // length or negative libusb error.
+    int (*control)(void* data, uint8_t requestType, uint8_t command, uint16_t value,
+            uint16_t index, uint8_t* buf, uint16_t len, unsigned int timeoutMs);
+    // len bytes of stream frames for the bulk endpoint, returns 0 or negative
+    // libusb error. NULL when the transport has no stream.
+    int (*writeStream)(void* data, const uint8_t* frames, int len, unsigned int timeoutMs);
+    // called by blinkyClose(), may be NULL
+    void (*close)(void* data);
+} BlinkyTransport;
+
+// sub-commands collected by the blinkyBatch*() calls, sent by blinkyRunBatch()
+typedef struct BlinkyBatch {
+    uint8_t data[COMMAND_BATCH_MAX];
+    uint16_t len;
+    int count;                  // sub-commands
+    int reads;
+    uint8_t readCode[BLINKY_BATCH_MAX_READS];
+    void* readDst[BLINKY_BATCH_MAX_READS];
+    int resultLen;              // expected result block length
+    int executed;               // set by blinkyRunBatch()
+    int error;                  // BLINKY_BATCH_ERROR_*, set by blinkyRunBatch()
+} BlinkyBatch;
+
+// time spent in the phases of opening the device, in milli seconds
+typedef struct BlinkyOpenTiming {
+    double enumerateMs;         // USB device list scan
+    double openMs;              // open + serial number read
+    double driverMs;            // kernel driver check / detach
+    double configMs;            // configuration check / set
+    double claimMs;             // interface claim
+} BlinkyOpenTiming;
+
+typedef struct BlinkyEvent {
+    uint8_t type;               // BLINKY_EVENT_*
+    uint8_t arg;
+    uint16_t value;
+} BlinkyEvent;
+
+// called from the event handling thread for every device event
+typedef void (*BlinkyEventCallback)(BlinkyDevice* dev, const BlinkyEvent* event, void* userData);
+
+// called from the event handling thread when a request finishes. The request
+// (and its data) is released after the callback returns.
+typedef void (*BlinkyCallback)(BlinkyRequest* r, void* userData);
+
+struct BlinkyRequest {
+    BlinkyDevice* device;
+    uint8_t requestType;        // BLINKY_TYPE_OUT_ITF or BLINKY_TYPE_IN_ITF
+    uint8_t command;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;            // requested data stage length
+    int result;                 // transferred bytes or negative libusb error
+    uint8_t* data;              // data stage, points into buffer[]
+    BlinkyCallback callback;
+    void* userData;
+
+    // private
+    struct libusb_transfer* transfer;
+    BlinkyRequest* next;
+    volatile int completed;
+    int sync;
+    uint8_t buffer[LIBUSB_CONTROL_SETUP_SIZE + BLINKY_MAX_DATA];
+};
+
+
+/* context */
+int blinkyInit(BlinkyContext** ctx, int flags);
+void blinkyExit(BlinkyContext* ctx);
+void blinkySetDebug(BlinkyContext* ctx, int level);
+libusb_context* blinkyGetUsbContext(BlinkyContext* ctx);
+
+/* event handling when BLINKY_EVENT_THREAD is not used */
+int blinkyHandleEvents(BlinkyContext* ctx, int timeoutMs);
+int blinkyGetPollFds(BlinkyContext* ctx, struct pollfd* fds, int maxFds);
+int blinkyGetNextTimeout(BlinkyContext* ctx, int* timeoutMs);
+
+/* device */
+// opens the first blinky device found
+int blinkyOpen(BlinkyContext* ctx, BlinkyDevice** dev);
+// opens up to maxDevs devices listed in the selector - comma separated bus /
+// port paths ("1-2.3") or serial numbers; "all" or NULL selects every device.
+// Returns the number of opened devices or negative libusb error.
+int blinkyOpenSelected(BlinkyContext* ctx, const char* selector, BlinkyDevice** devs, int maxDevs);
+const BlinkyDeviceInfo* blinkyGetDeviceInfo(BlinkyDevice* dev);
+const BlinkyOpenTiming* blinkyGetOpenTiming(BlinkyDevice* dev);
+void blinkyClose(BlinkyDevice* dev);
+// connect to a usb_blink_pc daemon instead of the USB device. Requests on such
+// device complete synchronously, also when submitted by blinkySubmit(). A
+// reply that takes longer than the timeout closes the connection.
+int blinkyOpenDaemon(const char* path, BlinkyDevice** dev);
+// a device on another transport, without the device info and the events
+int blinkyOpenTransport(const BlinkyTransport* transport, void* data, BlinkyDevice** dev);
+void blinkySetTimeout(BlinkyDevice* dev, unsigned int timeoutMs);
+void blinkySetMaxInFlight(BlinkyDevice* dev, int maxInFlight);
+
+/* asynchronous API - returns 0 when the request was queued */
+int blinkySubmit(BlinkyDevice* dev, uint8_t requestType, uint8_t command,
+        uint16_t value, uint16_t index, const uint8_t* data, uint16_t len,
+        BlinkyCallback callback, void* userData);
+
+/* synchronous API - returns the transferred length or negative libusb error */
+int blinkyControlOut(BlinkyDevice* dev, uint8_t command, uint16_t value,
+        uint16_t index, const uint8_t* data, uint16_t len);
+int blinkyControlIn(BlinkyDevice* dev, uint8_t command, uint16_t value,
+        uint16_t index, uint8_t* data, uint16_t len);
+
+/* blinky protocol - return 0 on success or negative libusb error */
+int blinkyReadBlinkTime(BlinkyDevice* dev, uint16_t* blinkTime);
+int blinkySetBlinkTime(BlinkyDevice* dev, uint16_t blinkTime);
+int blinkyToggleBlink(BlinkyDevice* dev);
+// loads up to BLINKY_SEQ_PROGRAM_SIZE bytes of bytecode, in chunks of
+// COMMAND_SET_BLINK_SEQUENCE_MAX when needed, the last chunk first - the one
+// at address 0 starts it
+int blinkySetSequence(BlinkyDevice* dev, const uint8_t* sequence, uint16_t len);
+int blinkyJumpToBootloader(BlinkyDevice* dev);
+// saves the first len bytes of the latest program (0 erases) and waits until
+// the device has written them. Returns 0, LIBUSB_ERROR_IO when the write
+// failed or another negative libusb error; saved (may be NULL) gets the state.
+int blinkySaveSequence(BlinkyDevice* dev, uint16_t len, BlinkySaved* saved);
+int blinkyReadSaved(BlinkyDevice* dev, BlinkySaved* saved);
+uint16_t blinkyCrc16(const uint8_t* data, int len);
+int blinkyReadStats(BlinkyDevice* dev, BlinkyStats* stats);
+int blinkyReadLoad(BlinkyDevice* dev, BlinkyLoad* load);
+// removes up to max (at most BLINKY_TRACE_PER_READ) records from the device
+// trace, returns their count or negative libusb error. now and lost (either
+// may be NULL) get the device time of the read and the records dropped since
+// the previous read.
+int blinkyReadTrace(BlinkyDevice* dev, BlinkyTraceRecord* records, int max,
+        uint16_t* now, uint8_t* lost);
+
+/* batch - the blinkyBatch*() calls append a sub-command, they return 0 or
+ * LIBUSB_ERROR_NO_MEM when the batch is full. The reads fill their result
+ * when the batch has run. */
+void blinkyBatchInit(BlinkyBatch* batch);
+int blinkyBatchSetBlinkTime(BlinkyBatch* batch, uint16_t blinkTime);
+int blinkyBatchToggleBlink(BlinkyBatch* batch);
+int blinkyBatchStartStream(BlinkyBatch* batch);
+// loads a whole program like blinkySetSequence(), in up to two fragments
+int blinkyBatchSetSequence(BlinkyBatch* batch, const uint8_t* sequence, uint16_t len);
+int blinkyBatchReadBlinkTime(BlinkyBatch* batch, uint16_t* blinkTime);
+int blinkyBatchReadStreamStatus(BlinkyBatch* batch, BlinkyStreamStatus* status);
+// sends the batch and reads its results - two control transfers. Returns 0
+// when every sub-command ran, LIBUSB_ERROR_IO when the device stopped early
+// (see batch->executed and batch->error) or another negative libusb error.
+int blinkyRunBatch(BlinkyDevice* dev, BlinkyBatch* batch);
+
+/* LED frame stream - not available through the daemon, the transport needs
+ * writeStream */
+int blinkyStartStream(BlinkyDevice* dev);
+int blinkyReadStreamStatus(BlinkyDevice* dev, BlinkyStreamStatus* status);
+// sends count frames to the bulk endpoint, without checking the credits
+int blinkyWriteStream(BlinkyDevice* dev, const uint8_t* frames, int count);
+// sends count frames as the credits allow, waits while the device is full.
+// Fills the final status when it is not NULL.
+int blinkyStream(BlinkyDevice* dev, const uint8_t* frames, int count, BlinkyStreamStatus* status);
+
+/* device events - not available through the daemon. Keeps a transfer on the
+ * interrupt endpoint and calls the callback for every record; NULL stops it
+ * and waits until the transfer is cancelled. */
+int blinkySetEventCallback(BlinkyDevice* dev, BlinkyEventCallback callback, void* userData);
+
+const char* blinkyErrorName(int error);
+
+#endif /* USB_BLINK_LIB_H */
@@ -22,9 +22,11 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
- * Build with:
+ * Build with compile.sh, or:
  *
- *      gcc -o usb_blink_pc usb_blink_pc.c -lusb-1.0  -lpthread -lrt
+ *      gcc -c usb_blink_lib.c usb_blink_proto.c usb_blink_fake.c usb_blink_seq.c
+ *      ar rcs usb_blink_lib.a usb_blink_lib.o usb_blink_proto.o usb_blink_fake.o usb_blink_seq.o
+ *      gcc -o usb_blink_pc usb_blink_pc.c usb_blink_daemon.c usb_blink_lib.a -lusb-1.0  -lpthread -lrt
  *
  * USB lib API reference:
  *     http://libusb.sourceforge.net/api-1.0
@@ -37,79 +39,74 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
-#ifdef MINGW
-#include <libusbx-1.0/libusb.h>
-#else
-#include <libusb-1.0/libusb.h>
-#endif
+#include <time.h>
 
+#include "usb_blink_lib.h"
+#include "usb_blink_daemon.h"
+#include "usb_blink_fake.h"
+#include "usb_blink_seq.h"
 
-#define VENDOR_ID 0xFFFF
-#define PRODUCT_ID 0x001e
-
-//see usb1.1 page 183: value bitmap: Host->Device, Vendor request, Recipient is interface
-#define TYPE_OUT_ITF		0x41
-
-//see usb1.1 page 183: value bitmap: Device->Host, Vendor request, Sender is interface
-#define TYPE_IN_ITF		(0x41 | (1 << 7))
-
-#define COMMAND_TOGGLE_BLINK  0xD1
-#define COMMAND_READ_BLINK_TIME 0xD0
-#define COMMAND_SET_BLINK_TIME 0xD3
-#define COMMAND_SET_BLINK_SEQUENCE 0xD4
-#define COMMAND_JUMP_TO_BOOTLOADER 0xB0
 
 #define ACTION_PRINT_HELP			1
 #define ACTION_SET_VERBOSE			2
+#define ACTION_DAEMON				3
+#define ACTION_STREAM				4
+#define ACTION_EVENTS				5
+#define ACTION_COMPILE				6
 
-static uint8_t descriptor[256];
-
-static uint8_t outBuf[32]; //output (command) buffer
-static uint8_t resBuf[32]; //input (response) buffer
+#define MAX_DEVICES				128
+#define TRACE_POLL_MS				10
+#define MAX_TIMELINE				65536
 
 static const char *const strings[2] = { "info", "fatal" };
 
-// some fancy blinking sequence
-static const char sequence[] = {
-    0x04, // off for 4 units
-
-    0x16, // on for 6 units
-    0x06, // off for 6 units
-    0x15, // on for 5 units
-    0x05, // off for 5 units
-    0x14, // on for 4 units
-    0x04, // off for 4 units
-    0x13, // on for 3 units
-    0x03, // off for 3 units
-    0x12, // on for 2 units
-    0x02, // off for 2 units
-
-    0x11, // on for 1 units
-    0x01, // off for 1 units
-    0x11, // on for 1 units
-    0x01, // off for 1 units
-    0x11, // on for 1 units
-    0x01, // off for 1 units
-    0x11, // on for 1 units
-    0x01, // off for 1 units
-
-    0x12, // on for 2 units
-    0x02, // off for 2 units
-    0x13, // on for 3 units
-    0x03, // off for 3 units
-    0x14, // on for 4 units
-    0x04, // off for 4 units
-    0x15, // on for 5 units
-    0x05, // off for 5 units
-
-    (1<<7) | 1, //jump to address 1
-    0 //safety terminator
+// some fancy blinking sequence (bytecode version 2)
+static const uint8_t sequence[] = {
+    /*  0 */ BLINKY_SEQ_LED_OFF, BLINKY_SEQ_U16(256),   // off for 256 ms
+    /*  3 */ BLINKY_SEQ_LOOP, 0,                        // forever:
+    /*  5 */ BLINKY_SEQ_LOOP, 4,                        //   4 short flashes
+    /*  7 */ BLINKY_SEQ_LED_ON, BLINKY_SEQ_U16(40),
+    /* 10 */ BLINKY_SEQ_LED_OFF, BLINKY_SEQ_U16(60),
+    /* 13 */ BLINKY_SEQ_ENDLOOP,
+    /* 14 */ BLINKY_SEQ_CALL, BLINKY_SEQ_U16(19),       //   a heart beat
+    /* 17 */ BLINKY_SEQ_ENDLOOP,
+    /* 18 */ BLINKY_SEQ_END,
+
+    // heart beat
+    /* 19 */ BLINKY_SEQ_LED_ON, BLINKY_SEQ_U16(100),
+    /* 22 */ BLINKY_SEQ_LED_OFF, BLINKY_SEQ_U16(150),
+    /* 25 */ BLINKY_SEQ_LED_ON, BLINKY_SEQ_U16(100),
+    /* 28 */ BLINKY_SEQ_LED_OFF, BLINKY_SEQ_U16(650),
+    /* 31 */ BLINKY_SEQ_RET
 };
 
 char debug = 0;
 char verbose = 0;
 int action = 0;
 int blinkTime = 0;
+int streamFrames = 0;
+int eventSeconds = 0;
+int statsSeconds = 0;
+int traceSeconds = 0;
+const char* traceFile = NULL;
+const char* sockPath = BLINKY_DAEMON_SOCKET;
+const char* selector = NULL;
+const char* fakeSpec = NULL;
+const char* seqFile = NULL;
+unsigned int seqTolerance = 0;
+const uint8_t* seqCode = sequence;
+int seqLen = sizeof(sequence);
+char saveSeq = 0;
+
+// per device state of a fan-out command
+typedef struct FanOutResult {
+    BlinkyDevice* dev;
+    int done;
+    int result;
+    uint16_t blinkTime;
+    struct timespec start;
+    struct timespec end;
+} FanOutResult;
 
 
 static void infoAndFatal(const int s, char *f, ...) {
@@ -133,118 +130,40 @@ static void usage(void) {
     "usage: [sudo] usb-blink command [parameter]\n"
     "commands:\n"
     "  -h     : prints this help \n"
-    "  -v     : set verbose mode \n"
+    "  -v     : set verbose mode, prints the startup timing \n"
     "  -debug : print USB library debugging info \n"
     "  -boot  : reset the CH55x into bootloader mode \n"
     "  -w ms  : send the blink time in milliseconds to the device\n"
     "  -r     : read the current blink time from the device\n"
     "  -t     : toggle between 100 / 250 ms blink time\n"
-    "  -seq   : send a blink sequnce to the device\n"
+    "  -seq [file] : send a blink sequnce to the device, the built-in one or\n"
+    "           the timeline in file compiled (see usb_blink_seq.h)\n"
+    "  -q ms  : timing error a timeline step may get for a shorter encoding\n"
+    "  -compile file : print the bytecode of a timeline, no device needed\n"
+    "  -save  : with -seq, also save the sequence in the device, it plays from\n"
+    "           the next power on\n"
+    "  -saved : print the sequence saved in the device\n"
+    "  -erase : erase the saved sequence, the device blinks at power on\n"
+    "  -stream n : stream n generated LED frames to the device (not through\n"
+    "           the daemon, the first device of -d / -all)\n"
+    "  -events s : print the device events for s seconds (not through the\n"
+    "           daemon, the first device of -d / -all)\n"
+    "  -stats [s] : print the USB statistics of the device, or with s the\n"
+    "           change over s seconds\n"
+    "  -trace s file : record the device trace for s seconds into file, in\n"
+    "           the Chrome trace event format (chrome://tracing, Perfetto)\n"
+    "  -daemon: keep the device open and serve commands from the socket\n"
+    "  -sock path : daemon socket path (default " BLINKY_DAEMON_SOCKET ")\n"
+    "  -d list: send the command to the listed devices concurrently, the list\n"
+    "           is comma separated bus-port paths (1-2.3) or serial numbers\n"
+    "  -all   : send the command to all connected devices concurrently\n"
+    "  -fake spec : use the in-process fake device instead of USB, spec is\n"
+    "           latency=us,jitter=us,fail=n,error=pipe|timeout|io|nodev or \"\"\n"
+    "commands are sent through the daemon when it is running\n"
     );
     exit(1);
 }
 
-static int dumpBuffer(uint8_t* buf, int size) {
-    int i;
-    for (i = 0; i < size; i++) {
-        printf("%02X ", buf[i]);
-        if (i % 16 == 15) {
-            printf("\n");
-        }
-    }
-    printf("\n");
-    return 0;
-} 
-
-static int sendControlTransfer(libusb_device_handle *h, uint8_t command, uint16_t param1, uint16_t param2, uint8_t len) {
-    int ret;
-
-    ret = libusb_control_transfer(h, TYPE_OUT_ITF, command, param1, param2, outBuf, len, 50);
-    if (verbose) {
-        info("control transfer out:  result=%i \n", ret);
-    }
-    return ret;
-}
-
-static int recvControlTransfer(libusb_device_handle *h, uint8_t command) {
-    int ret;
-    memset(resBuf, 0, sizeof(resBuf));
-
-    ret = libusb_control_transfer(h, TYPE_IN_ITF, command, 0, 0, resBuf, sizeof(resBuf), 50);
-    if (verbose) {
-        info("control transfer (0x%02x) incoming:  result=%i\n", command, ret);
-        dumpBuffer(resBuf, sizeof(resBuf));
-    }
-    return ret;
-}
-
-//try to find the blinky usb device
-static libusb_device_handle* getDeviceHandle(libusb_context* c) {
-    int max;
-    int ret;
-    int device_index = -1;
-    int i;
-    libusb_device** dev_list = NULL;
-    struct libusb_device_descriptor des;
-    struct libusb_device_handle* handle;
-
-    ret = libusb_get_device_list(c, &dev_list);
-    if (verbose) {
-        info("total USB devices found: %i \n", ret);
-    }
-    max = ret;
-    //print all devices
-    for (i = 0; i < max; i++) {
-        ret = libusb_get_device_descriptor(dev_list[i],  & des);
-        if (des.idVendor == VENDOR_ID && des.idProduct == PRODUCT_ID) {
-            if (verbose) {
-                info("device %i  vendor=%04x, product=%04x bus:device=%i:%i\n",
-                        i, des.idVendor, des.idProduct,
-                        libusb_get_bus_number(dev_list[i]),
-                        libusb_get_device_address(dev_list[i])
-                );
-            }
-            if (device_index == -1) {
-                device_index = i;
-            }
-        }
-    }
-
-    if (device_index < 0) {
-        libusb_free_device_list(dev_list, 1);
-        fatal("no device found\n");
-    }
-
-    if (verbose) {
-        info("using device: %i \n", device_index);
-    }
-
-    ret = libusb_open(dev_list[device_index], &handle);
-    if (verbose) {
-        info("open device result=%i\n", ret);
-    }
-    if (ret) {
-        libusb_free_device_list(dev_list, 1);
-        fatal("device open failed\n");
-    }
-
-    libusb_free_device_list(dev_list, 1);
-
-    //get config
-    ret = libusb_get_descriptor(handle, LIBUSB_DT_DEVICE, 0, descriptor, 18);
-    if (verbose) {
-        info("get device descriptor 0 result=%i\n", ret);
-    }
-    ret = libusb_get_descriptor(handle, LIBUSB_DT_CONFIG, 0, descriptor, 255);
-    if (verbose) {
-        info("get device configuration 0 result=%i\n", ret);
-    }
-    usleep(20*1000);
-
-    return handle;
-}
-
-
 static void checkArgumentValue(int i, int argc, char** argv, char* fatalText) {
     if (i >= argc || argv[i][0] == '-') {
         fatal(fatalText);
@@ -288,9 +207,73 @@ static void checkArguments(int argc, char** argv) {
             } else
             if (strcmp("-seq", arg) == 0) {
                 action = COMMAND_SET_BLINK_SEQUENCE;
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    seqFile = argv[++i];
+                }
+            } else
+            if (strcmp("-q", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-q: missing tolerance in milli secs\n");
+                seqTolerance = (unsigned int) strtoul(argv[++i], NULL, 0);
+            } else
+            if (strcmp("-save", arg) == 0) {
+                saveSeq = 1;
+            } else
+            if (strcmp("-saved", arg) == 0) {
+                action = COMMAND_READ_SAVED;
+            } else
+            if (strcmp("-erase", arg) == 0) {
+                action = COMMAND_SAVE_SEQUENCE;
+            } else
+            if (strcmp("-compile", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-compile: missing timeline file\n");
+                action = ACTION_COMPILE;
+                seqFile = argv[++i];
+            } else
+            if (strcmp("-stream", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-stream: missing frame count\n");
+                action = ACTION_STREAM;
+                streamFrames = (int) strtol(argv[++i], NULL, 0);
+            } else
+            if (strcmp("-events", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-events: missing seconds\n");
+                action = ACTION_EVENTS;
+                eventSeconds = (int) strtol(argv[++i], NULL, 0);
+            } else
+            if (strcmp("-stats", arg) == 0) {
+                action = COMMAND_READ_STATS;
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    statsSeconds = (int) strtol(argv[++i], NULL, 0);
+                }
+            } else
+            if (strcmp("-trace", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-trace: missing seconds\n");
+                checkArgumentValue(i + 2, argc, argv, "-trace: missing file name\n");
+                action = COMMAND_READ_TRACE;
+                traceSeconds = (int) strtol(argv[++i], NULL, 0);
+                traceFile = argv[++i];
             } else
             if (strcmp("-boot", arg) == 0) {
                 action = COMMAND_JUMP_TO_BOOTLOADER;
+            } else
+            if (strcmp("-daemon", arg) == 0) {
+                action = ACTION_DAEMON;
+            } else
+            if (strcmp("-d", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-d: missing device list\n");
+                selector = argv[++i];
+            } else
+            if (strcmp("-all", arg) == 0) {
+                selector = "all";
+            } else
+            if (strcmp("-fake", arg) == 0) {
+                if (i + 1 >= argc) {
+                    fatal("-fake: missing device spec\n");
+                }
+                fakeSpec = argv[++i];
+            } else
+            if (strcmp("-sock", arg) == 0) {
+                checkArgumentValue(i + 1, argc, argv, "-sock: missing socket path\n");
+                sockPath = argv[++i];
             }
 
             else {
@@ -302,111 +285,553 @@ static void checkArguments(int argc, char** argv) {
     }
 }
 
-int main(int argc, char** argv) {
-    libusb_context* c = NULL;
-    libusb_device_handle *h;
-    int offset = 0, size = 0;
-    int ret;
+// compiles the timeline of -seq / -compile into seqCode
+static void compileTimeline(void) {
+    static uint8_t code[BLINKY_SEQ_PROGRAM_SIZE];
+    BlinkySeqReport rep;
+    char error[128];
+    char* text;
+    FILE* f;
+    size_t n;
     int i;
 
-    checkArguments(argc, argv);
-    if (action == 0 || action == ACTION_PRINT_HELP) {
-        usage();
+    f = fopen(seqFile, "r");
+    if (f == NULL) {
+        fatal("cannot open %s\n", seqFile);
     }
-
-    //initialize libusb 
-    if (libusb_init(&c)) {
-        fatal("can not initialise libusb\n");
+    text = malloc(MAX_TIMELINE + 1);
+    if (text == NULL) {
+        fatal("out of memory\n");
+    }
+    n = fread(text, 1, MAX_TIMELINE + 1, f);
+    fclose(f);
+    if (n > MAX_TIMELINE) {
+        fatal("%s: longer than %i bytes\n", seqFile, MAX_TIMELINE);
+    }
+    text[n] = 0;
+    seqLen = blinkyCompileSequence(text, code, sizeof(code), seqTolerance, &rep, error, sizeof(error));
+    free(text);
+    if (seqLen < 0) {
+        fatal("%s: %s\n", seqFile, error);
     }
+    seqCode = code;
 
-    //set debugging state
-    if (debug) {
-        libusb_set_debug(c, 4);
+    if (verbose || action == ACTION_COMPILE) {
+        info("%s: %i bytes, %i loop levels, %llu ms per pass, timing error %llu ms (max %u ms per step)\n",
+                seqFile, rep.size, rep.loopDepth, (unsigned long long) rep.durationMs,
+                (unsigned long long) rep.errorMs, rep.maxErrorMs);
+    }
+    if (action == ACTION_COMPILE) {
+        for (i = 0; i < seqLen; i++) {
+            printf("%02X%c", seqCode[i], (i % 16 == 15 || i == seqLen - 1) ? '\n' : ' ');
+        }
     }
+}
 
-    //get the handle of the connected Glo USB device
-    h = getDeviceHandle(c);
+// a generated pattern: on / off pulses getting longer and shorter again
+static int runStream(BlinkyDevice* h) {
+    BlinkyStreamStatus st;
+    uint8_t* frames;
+    uint16_t ms;
+    int ret;
+    int i;
 
-    //try to detach existing kernel driver if kernel is already handling 
-    //the device
-    if (libusb_kernel_driver_active(h, 0) == 1) {
-        if (verbose) {
-            info("kernel driver active\n");
-        }
-        if (!libusb_detach_kernel_driver(h, 0)) {
-            if (verbose) {
-                info("driver detached\n");
-            }
-        }
+    if (streamFrames <= 0) {
+        fatal("-stream: invalid frame count\n");
+    }
+    frames = malloc(streamFrames * BLINKY_STREAM_FRAME_SIZE);
+    if (frames == NULL) {
+        fatal("out of memory\n");
+    }
+    for (i = 0; i < streamFrames; i++) {
+        ms = 10 + 5 * (i % 64 < 32 ? i % 32 : 31 - i % 32);
+        frames[i * 4] = ms & 0xFF;
+        frames[i * 4 + 1] = ms >> 8;
+        frames[i * 4 + 2] = !(i & 1);
+        frames[i * 4 + 3] = 0;
+    }
+    ret = blinkyStartStream(h);
+    if (ret == 0) {
+        ret = blinkyStream(h, frames, streamFrames, &st);
+    }
+    free(frames);
+    if (ret) {
+        info("Stream failed: %s\n", blinkyErrorName(ret));
+        return 1;
     }
+    info("Streamed %i frames: played %i, underruns %i, overruns %i\n", streamFrames,
+            st.played, st.underruns, st.overruns);
+    return 0;
+}
+
+static void printEvent(BlinkyDevice* dev, const BlinkyEvent* e, void* userData) {
+    static const char* const names[] = { "?", "sequence done", "stream low", "bus reset", "error" };
+    static const char* const errors[] = { "?", "sequence opcode", "sequence stack",
+            "stream underrun", "stream overrun", "short sequence upload" };
+
+    (void) dev;
+    (void) userData;
+    if (e->type == BLINKY_EVENT_ERROR) {
+        info("event: error: %s, %u\n", errors[e->arg <= BLINKY_ERROR_SEQ_SHORT ? e->arg : 0],
+                e->value);
+    } else {
+        info("event: %s, %u\n", names[e->type <= BLINKY_EVENT_ERROR ? e->type : 0], e->value);
+    }
+}
 
+static int runEvents(BlinkyContext* c, BlinkyDevice* h) {
+    time_t end;
+    int ret;
 
-    //set the first configuration -> initialize USB device
-    if (libusb_set_configuration (h, 1) != 0) {
-        fatal("cannot set device configuration\n");
+    ret = blinkySetEventCallback(h, printEvent, NULL);
+    if (ret) {
+        info("Events failed: %s\n", blinkyErrorName(ret));
+        return 1;
+    }
+    end = time(NULL) + eventSeconds;
+    while (time(NULL) < end) {
+        blinkyHandleEvents(c, 100);
     }
+    blinkySetEventCallback(h, NULL, NULL);
+    return 0;
+}
+
+// the counters wrap around, so the u16 difference is right also then
+static int runStats(BlinkyDevice* h) {
+    BlinkyStats a, b;
+    BlinkyLoad load;
+    int ret;
+    int i;
 
-    if (verbose) {
-        info("device configuration set\n");
+    memset(&a, 0, sizeof(a));
+    if (statsSeconds > 0) {
+        ret = blinkyReadStats(h, &a);
+        if (ret == 0) {
+            sleep(statsSeconds);
+        }
+    }
+    ret = blinkyReadStats(h, &b);
+    if (ret) {
+        info("Stats failed: %s\n", blinkyErrorName(ret));
+        return 1;
+    }
+    if (statsSeconds > 0) {
+        info("USB statistics, change over %i s:\n", statsSeconds);
+    } else {
+        info("USB statistics:\n");
+    }
+    info("  SETUP  %u\n", (uint16_t)(b.setup - a.setup));
+    for (i = 0; i < 5; i++) {
+        info("  EP%i    IN %u  OUT %u\n", i, (uint16_t)(b.in[i] - a.in[i]),
+                (uint16_t)(b.out[i] - a.out[i]));
     }
-    usleep(20*1000);
+    info("  STALLs %u, unsupported vendor requests %u\n", (uint16_t)(b.stalls - a.stalls),
+            (uint16_t)(b.vendorUnsupported - a.vendorUnsupported));
+    info("  bus resets %u, suspends %u\n", (uint16_t)(b.busResets - a.busResets),
+            (uint16_t)(b.suspends - a.suspends));
+    info("  longest interrupt %.1f us (since power on)\n", b.isrMaxTicks * BLINKY_STATS_TICK_US);
+
+    // older firmware has no load window, its STALL is not an error
+    if (blinkyReadLoad(h, &load) == 0 && load.windowMs) {
+        info("  CPU idle %.2f %%, %u interrupts (last %u ms)\n",
+                100.0 - load.busyTicks * BLINKY_STATS_TICK_US / (load.windowMs * 10.0),
+                load.wakeups, load.windowMs);
+    }
+    return 0;
+}
 
-    //get the first interface of the USB configuration
-    if (libusb_claim_interface(h, 0) < 0) {
-         fatal("cannot claim interface\n");
+static void writeTraceRecord(FILE* f, int* first, uint64_t ticks, const BlinkyTraceRecord* r) {
+    static const char* const events[] = { "?", "sequence done", "stream low", "bus reset", "error" };
+    char name[32];
+    int tid = 1;    // USB interrupt, 2: LED timer
+
+    switch (r->type) {
+    case BLINKY_TRACE_SETUP:
+        snprintf(name, sizeof(name), "SETUP 0x%02X", r->arg);
+        break;
+    case BLINKY_TRACE_BUS_RESET:
+        snprintf(name, sizeof(name), "bus reset");
+        break;
+    case BLINKY_TRACE_SUSPEND:
+        snprintf(name, sizeof(name), r->arg ? "sleep" : "suspend");
+        break;
+    case BLINKY_TRACE_SEQ_STEP:
+        snprintf(name, sizeof(name), "step pc %u", r->arg);
+        tid = 2;
+        break;
+    case BLINKY_TRACE_EVENT:
+        snprintf(name, sizeof(name), "event %s", events[r->arg <= BLINKY_EVENT_ERROR ? r->arg : 0]);
+        tid = 2;
+        break;
+    default:
+        snprintf(name, sizeof(name), "type 0x%02X arg %u", r->type, r->arg);
+        break;
     }
+    fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%i}",
+            *first ? "" : ",", name, (unsigned long long)(ticks * BLINKY_TRACE_TICK_US), tid);
+    *first = 0;
+}
 
-    if (verbose) {
-        info("interface claimed\n");
+// drains the device trace every TRACE_POLL_MS. The 16 bit record times are
+// unwrapped against the time of the read, which is always later.
+static int runTrace(BlinkyDevice* h) {
+    BlinkyTraceRecord r[BLINKY_TRACE_PER_READ];
+    uint64_t now = 0;
+    uint16_t lastNow = 0;
+    uint16_t devNow;
+    uint8_t lost;
+    time_t end;
+    FILE* f;
+    int first = 1;
+    int reads = 0;
+    int count = 0;
+    int lostCount = 0;
+    int ret = 0;
+    int n;
+    int i;
+
+    f = fopen(traceFile, "w");
+    if (f == NULL) {
+        info("cannot create %s\n", traceFile);
+        return 1;
+    }
+    fprintf(f, "{\"traceEvents\":[");
+    end = time(NULL) + traceSeconds;
+    while (time(NULL) < end) {
+        do {
+            n = blinkyReadTrace(h, r, BLINKY_TRACE_PER_READ, &devNow, &lost);
+            if (n < 0) {
+                ret = n;
+                break;
+            }
+            now = reads++ ? now + (uint16_t)(devNow - lastNow) : devNow;
+            lastNow = devNow;
+            if (lost) {
+                fprintf(f, "%s\n{\"name\":\"%u records lost\",\"ph\":\"i\",\"s\":\"g\","
+                        "\"ts\":%llu,\"pid\":1,\"tid\":1}", first ? "" : ",", lost,
+                        (unsigned long long)(now * BLINKY_TRACE_TICK_US));
+                first = 0;
+                lostCount += lost;
+            }
+            for (i = 0; i < n; i++) {
+                writeTraceRecord(f, &first, now - (uint16_t)(devNow - r[i].time), &r[i]);
+            }
+            count += n;
+        } while (n == BLINKY_TRACE_PER_READ);
+        if (ret) {
+            break;
+        }
+        usleep(TRACE_POLL_MS * 1000);
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    if (ret) {
+        info("Trace failed: %s\n", blinkyErrorName(ret));
+        return 1;
     }
+    info("Wrote %i trace records to %s, %i lost\n", count, traceFile, lostCount);
+    return 0;
+}
+
+// saves the first len bytes of the sequence just sent, 0 erases
+static int runSave(BlinkyDevice* h, int len) {
+    BlinkySaved saved;
+    int ret;
 
-    if (libusb_set_interface_alt_setting(h, 0, 0) < 0) {
-        fatal("alt setting failed\n");
+    ret = blinkySaveSequence(h, len, &saved);
+    if (ret) {
+        info("Save sequence failed: %s\n", blinkyErrorName(ret));
+        return ret;
+    }
+    if (len == 0) {
+        info("Erased the saved sequence\n");
+    } else if (saved.length != len || saved.crc != blinkyCrc16(seqCode, len)) {
+        info("Saved sequence differs: %i bytes, CRC %04X\n", saved.length, saved.crc);
+        return LIBUSB_ERROR_IO;
+    } else {
+        info("Saved %i bytes (CRC %04X), played from the next power on\n", len, saved.crc);
     }
+    return 0;
+}
+
+static int runAction(BlinkyDevice* h) {
+    int ret = 0;
 
     switch(action) {
+    case ACTION_STREAM : {
+        return runStream(h);
+    } break;
+
+    case COMMAND_READ_STATS : {
+        return runStats(h);
+    } break;
+
+    case COMMAND_READ_TRACE : {
+        return runTrace(h);
+    } break;
+
     case COMMAND_SET_BLINK_SEQUENCE : {
-        int ret;
-        int len = sizeof(sequence);
-        if (len > 32) {
-            fatal("The sequence is longer than 32 bytes - this would fail to play!");
+        if (seqLen > BLINKY_SEQ_PROGRAM_SIZE) {
+            fatal("The sequence is longer than %i bytes - this would fail to play!", BLINKY_SEQ_PROGRAM_SIZE);
+        }
+        ret = blinkySetSequence(h, seqCode, seqLen);
+        info("Set blink sequence result=%i (%s) \n", ret, ret == 0 ? "OK" : "Failed");
+        if (ret == 0 && saveSeq) {
+            ret = runSave(h, seqLen);
+        }
+    } break;
+
+    case COMMAND_SAVE_SEQUENCE : {
+        ret = runSave(h, 0);
+    } break;
+
+    case COMMAND_READ_SAVED : {
+        static const char* const states[] = { "none", "saved", "writing", "write failed" };
+        BlinkySaved saved;
+        ret = blinkyReadSaved(h, &saved);
+        if (ret) {
+            info("Read saved sequence failed: %s\n", blinkyErrorName(ret));
+        } else {
+            info("Saved sequence: %s, %i bytes, CRC %04X\n", saved.state < 4 ? states[saved.state] : "?",
+                    saved.length, saved.crc);
         }
-        memcpy(outBuf, sequence, len);
-        ret = sendControlTransfer(h, COMMAND_SET_BLINK_SEQUENCE, 0, 0 , len);
-        info("Set blink sequence result=%i (%s) \n", ret, ret == len ? "OK" : "Failed");
     } break;
 
     case COMMAND_READ_BLINK_TIME : {
-        int ret = recvControlTransfer(h, COMMAND_READ_BLINK_TIME);
-        if (ret != 2) {
+        uint16_t v;
+        ret = blinkyReadBlinkTime(h, &v);
+        if (ret) {
             info("Blink time failed. result=%i\n", ret); 
         } else {
-            int v = resBuf[1];
-            v <<= 8;
-            v |= resBuf[0];
             info("Blink time: %i\n", v); 
         }
     } break;
 
     case COMMAND_SET_BLINK_TIME : {
-        int ret;
-        ret = sendControlTransfer(h, COMMAND_SET_BLINK_TIME, blinkTime, 0 , 0);
+        ret = blinkySetBlinkTime(h, blinkTime);
         info("Set blink time (%i) result=%i\n", blinkTime, ret);
     } break;
 
     case COMMAND_TOGGLE_BLINK : {
-        sendControlTransfer(h, COMMAND_TOGGLE_BLINK, 0, 0, 0);
+        blinkyToggleBlink(h);
     } break;
 
     case COMMAND_JUMP_TO_BOOTLOADER : {
-        sendControlTransfer(h, COMMAND_JUMP_TO_BOOTLOADER, 0, 0, 0);
+        blinkyJumpToBootloader(h);
     } break;
 
 
     } //end of switch
+    return ret ? 1 : 0;
+}
 
-    libusb_release_interface(h, 0);
-    libusb_close(h);
-    libusb_exit(c);
-    return 0;
+static void fanOutDone(BlinkyRequest* r, void* userData) {
+    FanOutResult* res = (FanOutResult*) userData;
+
+    clock_gettime(CLOCK_MONOTONIC, &res->end);
+    res->result = r->result;
+    if (r->command == COMMAND_READ_BLINK_TIME && r->result == 2) {
+        res->blinkTime = r->data[0] | (r->data[1] << 8);
+    }
+    res->done = 1;
+}
+
+// send the command to all devices at once and report per device result
+static int runFanOut(BlinkyContext* c, BlinkyDevice** devs, int count) {
+    static FanOutResult res[MAX_DEVICES];
+    uint8_t type = BLINKY_TYPE_OUT_ITF;
+    const uint8_t* data = NULL;
+    uint16_t value = 0;
+    uint16_t len = 0;
+    int pending = 0;
+    int failed = 0;
+    double ms, maxMs = 0;
+    int i;
+
+    switch (action) {
+    case COMMAND_SET_BLINK_SEQUENCE :
+        // one transfer, the sequence fits into BLINKY_MAX_DATA
+        data = seqCode;
+        len = seqLen;
+        value = BLINKY_SEQ_VERSION;
+        break;
+    case COMMAND_READ_BLINK_TIME :
+        type = BLINKY_TYPE_IN_ITF;
+        len = BLINKY_MAX_DATA;
+        break;
+    case COMMAND_SET_BLINK_TIME :
+        value = blinkTime;
+        break;
+    }
+
+    for (i = 0; i < count; i++) {
+        memset(&res[i], 0, sizeof(FanOutResult));
+        res[i].dev = devs[i];
+        clock_gettime(CLOCK_MONOTONIC, &res[i].start);
+        res[i].result = blinkySubmit(devs[i], type, action, value, 0, data, len, fanOutDone, &res[i]);
+        if (res[i].result) {
+            res[i].end = res[i].start;
+            res[i].done = 1;
+        } else {
+            pending++;
+        }
+    }
+    // single event loop for all devices
+    while (pending) {
+        blinkyHandleEvents(c, 100);
+        pending = 0;
+        for (i = 0; i < count; i++) {
+            pending += !res[i].done;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        const BlinkyDeviceInfo* inf = blinkyGetDeviceInfo(res[i].dev);
+        ms = (res[i].end.tv_sec - res[i].start.tv_sec) * 1000.0 +
+             (res[i].end.tv_nsec - res[i].start.tv_nsec) / 1000000.0;
+        if (ms > maxMs) {
+            maxMs = ms;
+        }
+        if (res[i].result < 0) {
+            failed++;
+            info("%-12s %-16s failed: %s (%.3f ms)\n", inf->path, inf->serial,
+                    blinkyErrorName(res[i].result), ms);
+        } else if (action == COMMAND_READ_BLINK_TIME) {
+            info("%-12s %-16s blink time: %i (%.3f ms)\n", inf->path, inf->serial,
+                    res[i].blinkTime, ms);
+        } else {
+            info("%-12s %-16s result=%i (%.3f ms)\n", inf->path, inf->serial,
+                    res[i].result, ms);
+        }
+    }
+    info("%i devices, %i failed, slowest %.3f ms\n", count, failed, maxMs);
+    return failed ? 1 : 0;
+}
+
+static double elapsedMs(struct timespec* since) {
+    struct timespec now;
+    double ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+    *since = now;
+    return ms;
+}
+
+int main(int argc, char** argv) {
+    BlinkyContext* c = NULL;
+    BlinkyDevice* h;
+    struct timespec t;
+    double initMs, cmdMs;
+    int ret;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    checkArguments(argc, argv);
+    if (action == 0 || action == ACTION_PRINT_HELP) {
+        usage();
+    }
+    if (saveSeq && (action != COMMAND_SET_BLINK_SEQUENCE || selector)) {
+        fatal("-save: needs -seq and a single device\n");
+    }
+    if (seqFile) {
+        compileTimeline();
+        if (action == ACTION_COMPILE) {
+            return 0;
+        }
+    }
+    if (saveSeq && seqLen > BLINKY_SAVE_PROGRAM_MAX) {
+        fatal("-save: the sequence has %i bytes, the device saves up to %i\n", seqLen, BLINKY_SAVE_PROGRAM_MAX);
+    }
+
+    //a running daemon already holds the device open - skip the USB setup
+    if (action != ACTION_DAEMON && action != ACTION_STREAM && action != ACTION_EVENTS && selector == NULL &&
+            fakeSpec == NULL && blinkyOpenDaemon(sockPath, &h) == 0) {
+        initMs = elapsedMs(&t);
+        if (verbose) {
+            info("using daemon %s\n", sockPath);
+        }
+        ret = runAction(h);
+        cmdMs = elapsedMs(&t);
+        if (verbose) {
+            info("timing: connect %.3f ms, command %.3f ms, total %.3f ms\n",
+                    initMs, cmdMs, initMs + cmdMs);
+        }
+        blinkyClose(h);
+        return ret;
+    }
+
+    //initialize libusb 
+    if (blinkyInit(&c, verbose ? BLINKY_VERBOSE : 0)) {
+        fatal("can not initialise libusb\n");
+    }
+
+    //set debugging state
+    if (debug) {
+        blinkySetDebug(c, 4);
+    }
+    initMs = elapsedMs(&t);
+
+    //open all selected devices and dispatch the command concurrently
+    if (selector && fakeSpec == NULL && action != ACTION_DAEMON && action != ACTION_STREAM && action != ACTION_EVENTS &&
+            action != COMMAND_READ_STATS && action != COMMAND_READ_TRACE &&
+            action != COMMAND_SAVE_SEQUENCE && action != COMMAND_READ_SAVED) {
+        BlinkyDevice* devs[MAX_DEVICES];
+        int count = blinkyOpenSelected(c, selector, devs, MAX_DEVICES);
+        if (count <= 0) {
+            fatal("no device found\n");
+        }
+        ret = runFanOut(c, devs, count);
+        for (i = 0; i < count; i++) {
+            blinkyClose(devs[i]);
+        }
+        blinkyExit(c);
+        return ret;
+    }
+
+    //open the connected blinky USB device (the first selected for the daemon
+    //the stream, the events, the statistics, the trace and the saved sequence)
+    if (fakeSpec) {
+        BlinkyFakeConfig config;
+        if (blinkyParseFakeConfig(fakeSpec, &config)) {
+            fatal("-fake: invalid device spec: %s\n", fakeSpec);
+        }
+        ret = blinkyOpenFake(&config, &h);
+    } else if (selector) {
+        ret = blinkyOpenSelected(c, selector, &h, 1);
+        ret = (ret == 1) ? 0 : (ret == 0 ? LIBUSB_ERROR_NOT_FOUND : ret);
+    } else {
+        ret = blinkyOpen(c, &h);
+    }
+    if (ret == LIBUSB_ERROR_NOT_FOUND) {
+        fatal("no device found\n");
+    } else if (ret) {
+        fatal("cannot open device: %s\n", blinkyErrorName(ret));
+    }
+
+    if (action == ACTION_DAEMON) {
+        info("serving commands on %s\n", sockPath);
+        ret = runDaemon(c, h, sockPath, verbose);
+        if (ret) {
+            info("cannot open socket %s\n", sockPath);
+        }
+    } else if (action == ACTION_EVENTS) {
+        ret = runEvents(c, h);
+    } else {
+        elapsedMs(&t);
+        ret = runAction(h);
+        cmdMs = elapsedMs(&t);
+        if (verbose) {
+            const BlinkyOpenTiming* tm = blinkyGetOpenTiming(h);
+            info("timing: init %.3f ms, enumerate %.3f ms, open %.3f ms, driver %.3f ms, "
+                    "config %.3f ms, claim %.3f ms, command %.3f ms, total %.3f ms\n",
+                    initMs, tm->enumerateMs, tm->openMs, tm->driverMs, tm->configMs,
+                    tm->claimMs, cmdMs, initMs + tm->enumerateMs + tm->openMs +
+                    tm->driverMs + tm->configMs + tm->claimMs + cmdMs);
+        }
+    }
+
+    blinkyClose(h);
+    blinkyExit(c);
+    return ret ? 1 : 0;
 }
@@ -0,0 +1,184 @@
+/* usb_blink_proto.c - typed calls of the vendor requests
+ *
+ * Generated by protogen.sh from blinky_protocol.def, do not edit.
+ */
+
+#include <stdlib.h>
+
+#include "usb_blink_lib.h"
+
+int blinkyCmdReadBlinkTime(BlinkyDevice* dev, uint16_t* blinkTime) {
+    uint8_t buf[COMMAND_READ_BLINK_TIME_SIZE];
+    const uint8_t* p = buf;
+    int ret;
+
+    ret = blinkyControlIn(dev, COMMAND_READ_BLINK_TIME, 0, 0, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    *blinkTime = p[0] | (p[1] << 8);
+    return 0;
+}
+
+int blinkyCmdToggleBlink(BlinkyDevice* dev) {
+    int ret = blinkyControlOut(dev, COMMAND_TOGGLE_BLINK, 0, 0, NULL, 0);
+    return ret < 0 ? ret : 0;
+}
+
+int blinkyCmdSetBlinkTime(BlinkyDevice* dev, uint16_t blinkTime) {
+    int ret = blinkyControlOut(dev, COMMAND_SET_BLINK_TIME, blinkTime, 0, NULL, 0);
+    return ret < 0 ? ret : 0;
+}
+
+int blinkyCmdSetBlinkSequence(BlinkyDevice* dev, uint16_t version, uint16_t address, const uint8_t* data, uint16_t len) {
+    int ret;
+
+    if (len > COMMAND_SET_BLINK_SEQUENCE_MAX) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    ret = blinkyControlOut(dev, COMMAND_SET_BLINK_SEQUENCE, version, address, data, len);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == len ? 0 : LIBUSB_ERROR_IO;
+}
+
+int blinkyCmdStartStream(BlinkyDevice* dev) {
+    int ret = blinkyControlOut(dev, COMMAND_START_STREAM, 0, 0, NULL, 0);
+    return ret < 0 ? ret : 0;
+}
+
+int blinkyCmdReadStreamStatus(BlinkyDevice* dev, BlinkyStreamStatus* reply) {
+    uint8_t buf[COMMAND_READ_STREAM_STATUS_SIZE];
+    const uint8_t* p = buf;
+    int ret;
+
+    ret = blinkyControlIn(dev, COMMAND_READ_STREAM_STATUS, 0, 0, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    reply->credits = p[0] | (p[1] << 8);
+    p += 2;
+    reply->played = p[0] | (p[1] << 8);
+    p += 2;
+    reply->underruns = p[0] | (p[1] << 8);
+    p += 2;
+    reply->overruns = p[0] | (p[1] << 8);
+    return 0;
+}
+
+int blinkyCmdReadStats(BlinkyDevice* dev, BlinkyStats* reply) {
+    uint8_t buf[COMMAND_READ_STATS_SIZE];
+    const uint8_t* p = buf;
+    int ret;
+    int i;
+
+    ret = blinkyControlIn(dev, COMMAND_READ_STATS, 0, 0, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    reply->setup = p[0] | (p[1] << 8);
+    p += 2;
+    for (i = 0; i < 5; i++, p += 2) {
+        reply->in[i] = p[0] | (p[1] << 8);
+    }
+    for (i = 0; i < 5; i++, p += 2) {
+        reply->out[i] = p[0] | (p[1] << 8);
+    }
+    reply->stalls = p[0] | (p[1] << 8);
+    p += 2;
+    reply->busResets = p[0] | (p[1] << 8);
+    p += 2;
+    reply->suspends = p[0] | (p[1] << 8);
+    p += 2;
+    reply->vendorUnsupported = p[0] | (p[1] << 8);
+    p += 2;
+    reply->isrMaxTicks = p[0] | (p[1] << 8);
+    return 0;
+}
+
+int blinkyCmdReadTrace(BlinkyDevice* dev, uint8_t* data, uint16_t len) {
+    if (len > COMMAND_READ_TRACE_MAX) {
+        len = COMMAND_READ_TRACE_MAX;
+    }
+    return blinkyControlIn(dev, COMMAND_READ_TRACE, 0, 0, data, len);
+}
+
+int blinkyCmdBatch(BlinkyDevice* dev, uint16_t version, const uint8_t* data, uint16_t len) {
+    int ret;
+
+    if (len > COMMAND_BATCH_MAX) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    ret = blinkyControlOut(dev, COMMAND_BATCH, version, 0, data, len);
+    if (ret < 0) {
+        return ret;
+    }
+    return ret == len ? 0 : LIBUSB_ERROR_IO;
+}
+
+int blinkyCmdReadBatch(BlinkyDevice* dev, uint8_t* data, uint16_t len) {
+    if (len > COMMAND_READ_BATCH_MAX) {
+        len = COMMAND_READ_BATCH_MAX;
+    }
+    return blinkyControlIn(dev, COMMAND_READ_BATCH, 0, 0, data, len);
+}
+
+int blinkyCmdReadLoad(BlinkyDevice* dev, BlinkyLoad* reply) {
+    uint8_t buf[COMMAND_READ_LOAD_SIZE];
+    const uint8_t* p = buf;
+    int ret;
+
+    ret = blinkyControlIn(dev, COMMAND_READ_LOAD, 0, 0, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    reply->busyTicks = p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    p += 4;
+    reply->wakeups = p[0] | (p[1] << 8);
+    p += 2;
+    reply->windowMs = p[0] | (p[1] << 8);
+    return 0;
+}
+
+int blinkyCmdSaveSequence(BlinkyDevice* dev, uint16_t length) {
+    int ret = blinkyControlOut(dev, COMMAND_SAVE_SEQUENCE, length, 0, NULL, 0);
+    return ret < 0 ? ret : 0;
+}
+
+int blinkyCmdReadSaved(BlinkyDevice* dev, BlinkySaved* reply) {
+    uint8_t buf[COMMAND_READ_SAVED_SIZE];
+    const uint8_t* p = buf;
+    int ret;
+
+    ret = blinkyControlIn(dev, COMMAND_READ_SAVED, 0, 0, buf, sizeof(buf));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != sizeof(buf)) {
+        return LIBUSB_ERROR_IO;
+    }
+    reply->state = p[0];
+    p += 1;
+    reply->length = p[0];
+    p += 1;
+    reply->crc = p[0] | (p[1] << 8);
+    return 0;
+}
+
+int blinkyCmdJumpToBootloader(BlinkyDevice* dev) {
+    int ret = blinkyControlOut(dev, COMMAND_JUMP_TO_BOOTLOADER, 0, 0, NULL, 0);
+    return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,102 @@
+/* usb_blink_proto.h - typed calls of the vendor requests
+ *
+ * Generated by protogen.sh from blinky_protocol.def, do not edit.
+ *
+ * Included by usb_blink_lib.h. The calls return 0 on success or negative
+ * libusb error, in requests with data return the received length.
+ */
+
+#ifndef USB_BLINK_PROTO_H
+#define USB_BLINK_PROTO_H
+
+#define COMMAND_READ_BLINK_TIME          0xD0
+#define COMMAND_TOGGLE_BLINK             0xD1
+#define COMMAND_SET_BLINK_TIME           0xD3
+#define COMMAND_SET_BLINK_SEQUENCE       0xD4
+#define COMMAND_START_STREAM             0xD5
+#define COMMAND_READ_STREAM_STATUS       0xD6
+#define COMMAND_READ_STATS               0xD7
+#define COMMAND_READ_TRACE               0xD8
+#define COMMAND_BATCH                    0xD9
+#define COMMAND_READ_BATCH               0xDA
+#define COMMAND_READ_LOAD                0xDB
+#define COMMAND_SAVE_SEQUENCE            0xDC
+#define COMMAND_READ_SAVED               0xDD
+#define COMMAND_JUMP_TO_BOOTLOADER       0xB0
+
+// fixed reply sizes and data stage limits in bytes
+#define COMMAND_READ_BLINK_TIME_SIZE     2
+#define COMMAND_SET_BLINK_SEQUENCE_MAX   256
+#define COMMAND_READ_STREAM_STATUS_SIZE  8
+#define COMMAND_READ_STATS_SIZE          32
+#define COMMAND_READ_TRACE_MAX           32
+#define COMMAND_BATCH_MAX                512
+#define COMMAND_READ_BATCH_MAX           16
+#define COMMAND_READ_LOAD_SIZE           8
+#define COMMAND_READ_SAVED_SIZE          4
+
+typedef struct BlinkyStreamStatus {
+    uint16_t credits;           // free frame entries on the device
+    uint16_t played;            // frames played since the stream start
+    uint16_t underruns;         // times the device ran out of frames
+    uint16_t overruns;          // frames dropped, sent without a credit
+} BlinkyStreamStatus;
+
+typedef struct BlinkyStats {
+    uint16_t setup;             // SETUP tokens
+    uint16_t in[5];             // IN tokens per endpoint
+    uint16_t out[5];            // OUT tokens per endpoint
+    uint16_t stalls;            // control requests STALLed at the SETUP stage
+    uint16_t busResets;
+    uint16_t suspends;
+    uint16_t vendorUnsupported; // unknown vendor requests
+    uint16_t isrMaxTicks;       // longest USB interrupt, BLINKY_STATS_TICK_US units
+} BlinkyStats;
+
+typedef struct BlinkyLoad {
+    uint32_t busyTicks;         // time in the interrupts, BLINKY_STATS_TICK_US units
+    uint16_t wakeups;           // interrupts in the window
+    uint16_t windowMs;          // length of the window
+} BlinkyLoad;
+
+typedef struct BlinkySaved {
+    uint8_t state;              // BLINKY_SAVED_*
+    uint8_t length;             // program bytes
+    uint16_t crc;               // CRC-16/CCITT of the program
+} BlinkySaved;
+
+// blinkTime: ms
+int blinkyCmdReadBlinkTime(BlinkyDevice* dev, uint16_t* blinkTime);
+// between 100 and 250 ms
+int blinkyCmdToggleBlink(BlinkyDevice* dev);
+// blinkTime: ms, applied on the next tick
+int blinkyCmdSetBlinkTime(BlinkyDevice* dev, uint16_t blinkTime);
+// version: bytecode version
+// address: load address, the chunk at 0 starts the program
+// data: up to COMMAND_SET_BLINK_SEQUENCE_MAX bytes
+int blinkyCmdSetBlinkSequence(BlinkyDevice* dev, uint16_t version, uint16_t address, const uint8_t* data, uint16_t len);
+// drops the frames and the counters
+int blinkyCmdStartStream(BlinkyDevice* dev);
+int blinkyCmdReadStreamStatus(BlinkyDevice* dev, BlinkyStreamStatus* reply);
+// USB_INTR_STATS, counting since the power on
+int blinkyCmdReadStats(BlinkyDevice* dev, BlinkyStats* reply);
+// removes the records it returns
+// data: up to COMMAND_READ_TRACE_MAX bytes
+int blinkyCmdReadTrace(BlinkyDevice* dev, uint8_t* data, uint16_t len);
+// runs sub-commands in order, see usb_blink_lib.h
+// version: bytecode version of the sequence fragments
+// data: up to COMMAND_BATCH_MAX bytes
+int blinkyCmdBatch(BlinkyDevice* dev, uint16_t version, const uint8_t* data, uint16_t len);
+// result block of the last batch
+// data: up to COMMAND_READ_BATCH_MAX bytes
+int blinkyCmdReadBatch(BlinkyDevice* dev, uint8_t* data, uint16_t len);
+// CPU load of the last complete window
+int blinkyCmdReadLoad(BlinkyDevice* dev, BlinkyLoad* reply);
+// into the DataFlash, played at the boot
+// length: bytes of the latest program, 0 erases the saved one
+int blinkyCmdSaveSequence(BlinkyDevice* dev, uint16_t length);
+// the program in the DataFlash
+int blinkyCmdReadSaved(BlinkyDevice* dev, BlinkySaved* reply);
+int blinkyCmdJumpToBootloader(BlinkyDevice* dev);
+
+#endif /* USB_BLINK_PROTO_H */
@@ -0,0 +1,540 @@
+/* usb_blink_seq - compiler of LED timelines into sequence bytecode
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The timeline is parsed into blocks of steps. Steps that keep the outputs
+ * are merged while they are appended, so the emitter only picks encodings:
+ * the one byte 64 ms opcodes, loop or unrolled repeats and the final jump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "usb_blink_seq.h"
+
+#define SEQ_MAX_MS          0xFFFF  // u16 operand
+#define SEQ_SHORT_MS        64      // unit of the one byte opcodes
+#define SEQ_SHORT_MAX       15
+#define SEQ_SHORT_JUMP_MAX  31
+#define SEQ_LIMIT_MS        1000000000000ULL    // 1e9 s, a longer step fits no program
+
+enum { STEP_LEVEL, STEP_FADE, STEP_CHANNELS, STEP_WAIT, STEP_REPEAT };
+
+struct SeqStep;
+
+typedef struct SeqBlock {
+    struct SeqStep* steps;
+    int count;
+    int cap;
+} SeqBlock;
+
+typedef struct SeqStep {
+    int type;
+    int line;
+    uint8_t level;              // STEP_LEVEL, STEP_FADE: brightness, 0 off, 255 on
+    uint8_t mask;               // STEP_CHANNELS
+    uint8_t value;
+    uint64_t ms;
+    int repeat;                 // STEP_REPEAT: count, 0 forever
+    SeqBlock body;
+} SeqStep;
+
+typedef struct SeqCompiler {
+    const char* p;
+    int line;
+    char* error;
+    int errorLen;
+    unsigned int toleranceMs;
+
+    uint8_t* code;              // NULL: only count the size
+    int len;
+    int max;
+    BlinkySeqReport report;
+} SeqCompiler;
+
+static int seqFail(SeqCompiler* c, int line, const char* msg) {
+    if (c->error && c->errorLen > 0 && line > 0) {
+        snprintf(c->error, c->errorLen, "line %i: %s", line, msg);
+    } else if (c->error && c->errorLen > 0) {
+        snprintf(c->error, c->errorLen, "%s", msg);
+    }
+    return -1;
+}
+
+static void freeBlock(SeqBlock* b) {
+    int i;
+
+    for (i = 0; i < b->count; i++) {
+        freeBlock(&b->steps[i].body);
+    }
+    free(b->steps);
+    memset(b, 0, sizeof(*b));
+}
+
+/* parser */
+
+// the next word, NULL at the end of the text
+static const char* nextWord(SeqCompiler* c, char* word, int len) {
+    int n = 0;
+
+    for (;;) {
+        while (isspace((unsigned char) *c->p)) {
+            if (*c->p++ == '\n') {
+                c->line++;
+            }
+        }
+        if (*c->p != '#') {
+            break;
+        }
+        while (*c->p && *c->p != '\n') {
+            c->p++;
+        }
+    }
+    if (!*c->p) {
+        return NULL;
+    }
+    if (*c->p == '{' || *c->p == '}') {
+        word[n++] = *c->p++;
+    } else {
+        while (*c->p && !isspace((unsigned char) *c->p) && *c->p != '{' && *c->p != '}'
+                && *c->p != '#') {
+            if (n < len - 1) {
+                word[n++] = *c->p;
+            }
+            c->p++;
+        }
+    }
+    word[n] = 0;
+    return word;
+}
+
+static int parseNumber(SeqCompiler* c, unsigned long max, unsigned long* v) {
+    char word[32];
+    char* end;
+
+    if (!nextWord(c, word, sizeof(word))) {
+        return seqFail(c, c->line, "missing number");
+    }
+    *v = strtoul(word, &end, 0);
+    if (*end || end == word || *v > max) {
+        return seqFail(c, c->line, "invalid number");
+    }
+    return 0;
+}
+
+// milli seconds, or seconds with an 's' suffix
+static int parseMs(SeqCompiler* c, uint64_t* ms) {
+    char word[32];
+    char* end;
+    double s;
+
+    if (!nextWord(c, word, sizeof(word))) {
+        return seqFail(c, c->line, "missing duration");
+    }
+    // strtoull() and strtod() would take a sign, "inf" and "nan"
+    if (!isdigit((unsigned char) word[0]) && word[0] != '.') {
+        return seqFail(c, c->line, "invalid duration");
+    }
+    *ms = strtoull(word, &end, 10);
+    if (end != word && !*end) {
+        return *ms > SEQ_LIMIT_MS ? seqFail(c, c->line, "duration too long") : 0;
+    }
+    s = strtod(word, &end);
+    if (end == word || strcmp(end, "s")) {
+        return seqFail(c, c->line, "invalid duration");
+    }
+    if (s > SEQ_LIMIT_MS / 1000) {
+        return seqFail(c, c->line, "duration too long");
+    }
+    *ms = (uint64_t) (s * 1000 + 0.5);
+    return 0;
+}
+
+// a step with a duration keeps the outputs it set, a following wait or the
+// same outputs only make it longer
+static int keepsOutputs(const SeqStep* s) {
+    return s->type == STEP_LEVEL || s->type == STEP_CHANNELS || s->type == STEP_WAIT;
+}
+
+static int sameOutputs(const SeqStep* a, const SeqStep* b) {
+    if (a->type != b->type) {
+        return 0;
+    }
+    if (a->type == STEP_LEVEL) {
+        return a->level == b->level;
+    }
+    return a->type == STEP_CHANNELS && a->mask == b->mask && a->value == b->value;
+}
+
+// appends a step, merged into the previous one when the outputs stay
+static int appendStep(SeqCompiler* c, SeqBlock* b, const SeqStep* s) {
+    SeqStep* last = b->count ? &b->steps[b->count - 1] : NULL;
+    SeqStep* grown;
+
+    if (last && keepsOutputs(last) && (s->type == STEP_WAIT || sameOutputs(last, s))) {
+        if (s->ms > SEQ_LIMIT_MS - last->ms) {
+            return seqFail(c, s->line, "duration too long");
+        }
+        last->ms += s->ms;
+        return 0;
+    }
+    // a step without a duration is overwritten by the next level
+    if (last && last->type == STEP_LEVEL && last->ms == 0 && s->type == STEP_LEVEL) {
+        *last = *s;
+        return 0;
+    }
+    if (b->count == b->cap) {
+        grown = realloc(b->steps, (b->cap ? b->cap * 2 : 16) * sizeof(SeqStep));
+        if (!grown) {
+            return seqFail(c, s->line, "out of memory");
+        }
+        b->steps = grown;
+        b->cap = b->cap ? b->cap * 2 : 16;
+    }
+    b->steps[b->count++] = *s;
+    return 0;
+}
+
+// saturates instead of wrapping around with deeply nested repeats
+static uint64_t blockDuration(const SeqBlock* b) {
+    uint64_t ms = 0;
+    uint64_t d;
+    int i;
+
+    for (i = 0; i < b->count; i++) {
+        if (b->steps[i].type == STEP_REPEAT) {
+            d = blockDuration(&b->steps[i].body);
+            if (b->steps[i].repeat > 1) {
+                d = d > UINT64_MAX / b->steps[i].repeat ? UINT64_MAX : d * b->steps[i].repeat;
+            }
+        } else {
+            d = b->steps[i].ms;
+        }
+        ms = d > UINT64_MAX - ms ? UINT64_MAX : ms + d;
+    }
+    return ms;
+}
+
+static int parseBlock(SeqCompiler* c, SeqBlock* b, int nested);
+
+// repeat n { ... }: once is inlined, a repeated single step that keeps its
+// outputs becomes one longer step
+static int parseRepeat(SeqCompiler* c, SeqBlock* b, int line, int nested) {
+    SeqStep s;
+    unsigned long n;
+    char word[8];
+    int ret = 0;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    if (parseNumber(c, 255, &n)) {
+        return -1;
+    }
+    if (n == 0 && nested) {
+        return seqFail(c, line, "a forever repeat must be the last step of the timeline");
+    }
+    if (!nextWord(c, word, sizeof(word)) || strcmp(word, "{")) {
+        return seqFail(c, c->line, "missing { after repeat");
+    }
+    if (parseBlock(c, &s.body, 1)) {
+        freeBlock(&s.body);
+        return -1;
+    }
+    s.type = STEP_REPEAT;
+    s.line = line;
+    s.repeat = n;
+    if (n == 0 && blockDuration(&s.body) == 0) {
+        ret = seqFail(c, line, "a forever repeat needs a duration");
+    } else if (s.body.count == 0 || (n && blockDuration(&s.body) == 0)) {
+        ;   // nothing to repeat
+    } else if (n == 1) {
+        for (i = 0; i < s.body.count && !ret; i++) {
+            ret = appendStep(c, b, &s.body.steps[i]);
+            memset(&s.body.steps[i].body, 0, sizeof(SeqBlock)); // moved
+        }
+    } else if (n && s.body.count == 1 && keepsOutputs(&s.body.steps[0])) {
+        if (s.body.steps[0].ms > SEQ_LIMIT_MS / n) {
+            ret = seqFail(c, line, "duration too long");
+        } else {
+            s.body.steps[0].ms *= n;
+            ret = appendStep(c, b, &s.body.steps[0]);
+        }
+    } else {
+        ret = appendStep(c, b, &s);
+        if (!ret) {
+            return 0;   // the block owns the body now
+        }
+    }
+    freeBlock(&s.body);
+    return ret;
+}
+
+static int parseBlock(SeqCompiler* c, SeqBlock* b, int nested) {
+    char word[16];
+    unsigned long v;
+    SeqStep s;
+    int line;
+
+    while (nextWord(c, word, sizeof(word))) {
+        line = c->line;
+        if (b->count && b->steps[b->count - 1].type == STEP_REPEAT
+                && b->steps[b->count - 1].repeat == 0) {
+            return seqFail(c, line, "a forever repeat must be the last step of the timeline");
+        }
+        memset(&s, 0, sizeof(s));
+        s.line = line;
+        if (!strcmp(word, "}")) {
+            return nested ? 0 : seqFail(c, line, "} without repeat");
+        } else if (!strcmp(word, "repeat")) {
+            if (parseRepeat(c, b, line, nested)) {
+                return -1;
+            }
+            continue;
+        } else if (!strcmp(word, "on") || !strcmp(word, "off")) {
+            s.type = STEP_LEVEL;
+            s.level = word[1] == 'n' ? 255 : 0;
+        } else if (!strcmp(word, "level") || !strcmp(word, "fade")) {
+            s.type = word[0] == 'l' ? STEP_LEVEL : STEP_FADE;
+            if (parseNumber(c, 255, &v)) {
+                return -1;
+            }
+            s.level = v;
+        } else if (!strcmp(word, "channels")) {
+            s.type = STEP_CHANNELS;
+            if (parseNumber(c, 255, &v)) {
+                return -1;
+            }
+            s.mask = v;
+            if (parseNumber(c, 255, &v)) {
+                return -1;
+            }
+            s.value = v & s.mask;
+        } else if (!strcmp(word, "wait")) {
+            s.type = STEP_WAIT;
+        } else {
+            return seqFail(c, line, "unknown step");
+        }
+        if (parseMs(c, &s.ms)) {
+            return -1;
+        }
+        if (s.type == STEP_FADE && s.ms > SEQ_MAX_MS) {
+            return seqFail(c, line, "a fade takes at most 65535 ms");
+        }
+        if (appendStep(c, b, &s)) {
+            return -1;
+        }
+    }
+    return nested ? seqFail(c, c->line, "missing }") : 0;
+}
+
+/* emitter */
+
+// counts up to max + 1, a program that does not fit is not sized further
+static void emit(SeqCompiler* c, uint8_t byte) {
+    if (c->len > c->max) {
+        return;
+    }
+    if (c->code && c->len < c->max) {
+        c->code[c->len] = byte;
+    }
+    c->len++;
+}
+
+static void emit16(SeqCompiler* c, uint8_t opcode, uint16_t v) {
+    emit(c, opcode);
+    emit(c, v & 0xFF);
+    emit(c, v >> 8);
+}
+
+static void addError(SeqCompiler* c, uint64_t requested, uint64_t encoded, uint64_t* error) {
+    uint64_t e = encoded > requested ? encoded - requested : requested - encoded;
+
+    *error += e;
+    if (e > c->report.maxErrorMs) {
+        c->report.maxErrorMs = e;
+    }
+}
+
+// the rest of a step longer than the u16 operand
+static void emitWait(SeqCompiler* c, uint64_t ms) {
+    uint16_t chunk;
+
+    while (ms && c->len <= c->max) {
+        chunk = ms > SEQ_MAX_MS ? SEQ_MAX_MS : ms;
+        emit16(c, BLINKY_SEQ_WAIT, chunk);
+        ms -= chunk;
+    }
+}
+
+// one step, returns its timing error
+static uint64_t emitStep(SeqCompiler* c, const SeqStep* s) {
+    uint64_t error = 0;
+    uint64_t units;
+    uint16_t first = s->ms > SEQ_MAX_MS ? SEQ_MAX_MS : s->ms;
+
+    switch (s->type) {
+    case STEP_LEVEL:
+        // LED on / off in 64 ms units, 0x00 would be the end
+        units = (s->ms + SEQ_SHORT_MS / 2) / SEQ_SHORT_MS;
+        if ((s->level == 0 || s->level == 255) && units >= 1 && units <= SEQ_SHORT_MAX
+                && (units * SEQ_SHORT_MS > s->ms ? units * SEQ_SHORT_MS - s->ms
+                        : s->ms - units * SEQ_SHORT_MS) <= c->toleranceMs) {
+            emit(c, (s->level ? 0x10 : 0x00) | units);
+            addError(c, s->ms, units * SEQ_SHORT_MS, &error);
+            return error;
+        }
+        if (s->level == 0 || s->level == 255) {
+            emit16(c, s->level ? BLINKY_SEQ_LED_ON : BLINKY_SEQ_LED_OFF, first);
+        } else {
+            emit(c, BLINKY_SEQ_LED_LEVEL);
+            emit(c, s->level);
+            emit(c, first & 0xFF);
+            emit(c, first >> 8);
+        }
+        break;
+    case STEP_FADE:
+        emit(c, BLINKY_SEQ_FADE);
+        emit(c, s->level);
+        emit(c, first & 0xFF);
+        emit(c, first >> 8);
+        break;
+    case STEP_CHANNELS:
+        emit(c, BLINKY_SEQ_CHANNELS);
+        emit(c, s->mask);
+        emit(c, s->value);
+        emit(c, first & 0xFF);
+        emit(c, first >> 8);
+        break;
+    case STEP_WAIT:
+        emitWait(c, s->ms);
+        return 0;
+    }
+    emitWait(c, s->ms - first);
+    return 0;
+}
+
+static uint64_t emitBlock(SeqCompiler* c, const SeqBlock* b, int depth, int* failed);
+
+// a counted repeat as a device loop or unrolled, whichever is shorter
+static uint64_t emitRepeat(SeqCompiler* c, const SeqStep* s, int depth, int* failed) {
+    SeqCompiler probe = *c;
+    uint64_t error = 0;
+    int body;
+    int i;
+
+    probe.code = NULL;
+    probe.len = 0;
+    emitBlock(&probe, &s->body, 0, failed);
+    body = probe.len;
+    if (body * s->repeat <= body + 3) {
+        for (i = 0; i < s->repeat; i++) {
+            error += emitBlock(c, &s->body, depth, failed);
+        }
+        return error;
+    }
+    if (depth + 1 > c->report.loopDepth) {
+        c->report.loopDepth = depth + 1;
+    }
+    if (depth + 1 > BLINKY_SEQ_STACK_DEPTH) {
+        *failed = seqFail(c, s->line, "loops nested deeper than the device stack");
+    }
+    emit(c, BLINKY_SEQ_LOOP);
+    emit(c, s->repeat);
+    error = emitBlock(c, &s->body, depth + 1, failed) * s->repeat;
+    emit(c, BLINKY_SEQ_ENDLOOP);
+    return error;
+}
+
+static uint64_t emitBlock(SeqCompiler* c, const SeqBlock* b, int depth, int* failed) {
+    uint64_t error = 0;
+    int start;
+    int i;
+
+    for (i = 0; i < b->count; i++) {
+        const SeqStep* s = &b->steps[i];
+
+        if (s->type != STEP_REPEAT) {
+            error += emitStep(c, s);
+        } else if (s->repeat) {
+            error += emitRepeat(c, s, depth, failed);
+        } else {
+            // forever, the last step: the body and a jump back
+            start = c->len;
+            error += emitBlock(c, &s->body, depth, failed);
+            if (start <= SEQ_SHORT_JUMP_MAX) {
+                emit(c, BLINKY_SEQ_JUMP_SHORT | start);
+            } else {
+                emit16(c, BLINKY_SEQ_JUMP, start);
+            }
+            return error;
+        }
+    }
+    return error;
+}
+
+int blinkyCompileSequence(const char* text, uint8_t* code, int max, unsigned int toleranceMs,
+        BlinkySeqReport* report, char* error, int errorLen) {
+    SeqCompiler c;
+    SeqBlock program;
+    char msg[96];
+    int failed = 0;
+
+    memset(&c, 0, sizeof(c));
+    memset(&program, 0, sizeof(program));
+    c.p = text;
+    c.line = 1;
+    c.error = error;
+    c.errorLen = errorLen;
+    c.toleranceMs = toleranceMs;
+    c.code = code;
+    c.max = max;
+    if (parseBlock(&c, &program, 0)) {
+        freeBlock(&program);
+        return -1;
+    }
+    if (program.count == 0) {
+        freeBlock(&program);
+        return seqFail(&c, c.line, "empty timeline");
+    }
+    c.report.errorMs = emitBlock(&c, &program, 0, &failed);
+    if (program.steps[program.count - 1].type != STEP_REPEAT
+            || program.steps[program.count - 1].repeat != 0) {
+        emit(&c, BLINKY_SEQ_END);
+    }
+    c.report.size = c.len;
+    c.report.durationMs = blockDuration(&program);
+    freeBlock(&program);
+    if (report) {
+        *report = c.report;
+    }
+    if (failed) {
+        return -1;
+    }
+    if (c.len > max) {
+        snprintf(msg, sizeof(msg), "the program needs more than the %i bytes of the device", max);
+        return seqFail(&c, 0, msg);
+    }
+    return c.len;
+}
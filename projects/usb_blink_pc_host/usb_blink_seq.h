@@ -0,0 +1,97 @@
+/* usb_blink_seq - sequence bytecode and a compiler of LED timelines into it
+ *
+ * Copyright (C) 2019 Ole
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * A timeline is text, one step per line or several separated by blanks;
+ * '#' starts a comment. Durations are milli seconds, or seconds with an 's'
+ * suffix (1s, 0.5s), at most 1e9 s; numbers may be hex (0x0F).
+ *
+ *     on <ms>                      LED on
+ *     off <ms>                     LED off
+ *     level <0-255> <ms>           LED brightness
+ *     fade <0-255> <ms>            fade to the brightness in ms (up to 65535)
+ *     channels <mask> <value> <ms> set the output channels in mask
+ *     wait <ms>                    keep the outputs
+ *     repeat <n> { ... }           n = 1 - 255 times, 0: forever (last step)
+ *
+ * The compiler merges steps that keep the same outputs, folds a repeat of
+ * one such step into it, unrolls repeats where that is shorter than a loop
+ * and closes a forever repeat with a (short) jump. A step may be moved to
+ * the one byte 64 ms opcodes when that changes it by no more than the
+ * tolerance; the report has the encoded size and the timing error.
+ */
+
+#ifndef USB_BLINK_SEQ_H
+#define USB_BLINK_SEQ_H
+
+#include <stdint.h>
+
+/* sequence bytecode, version 3 - a superset of the one byte version 1 ops,
+ * version 2 added the u16 operands, version 3 the brightness levels, fades and
+ * output channels. A version 0 / 1 program plays 0x20 - 0x7F as one byte
+ * ops too (LED = bit 4, wait bits 0-3 x 64 ms).
+ * COMMAND_SET_BLINK_SEQUENCE: wValue = version, wIndex = load address. The
+ * whole program fits one transfer; when it is loaded in chunks, the program
+ * starts when the chunk at address 0 arrives. u16 operands are little
+ * endian, addresses are absolute.
+ */
+#define BLINKY_SEQ_VERSION      3
+#define BLINKY_SEQ_PROGRAM_SIZE 256     // device program slot
+#define BLINKY_SEQ_STACK_DEPTH  8       // nested calls and loops
+
+#define BLINKY_SEQ_END          0x00    // 0x01 - 0x1F: LED = bit 4, wait bits 0-3 x 64 ms
+#define BLINKY_SEQ_LED_OFF      0x20    // u16 ms: LED off, then wait
+#define BLINKY_SEQ_LED_ON       0x21    // u16 ms: LED on, then wait
+#define BLINKY_SEQ_LED_TOGGLE   0x22    // u16 ms: toggle the LED, then wait
+#define BLINKY_SEQ_WAIT         0x23    // u16 ms: wait, the LED is not changed
+#define BLINKY_SEQ_LED_LEVEL    0x24    // u8 level, u16 ms: set the brightness, then wait
+#define BLINKY_SEQ_FADE         0x25    // u8 level, u16 ms: fade to the level in ms
+#define BLINKY_SEQ_CHANNELS     0x26    // u8 mask, u8 value, u16 ms: set the channels, then wait
+#define BLINKY_SEQ_JUMP         0x30    // u16 address
+#define BLINKY_SEQ_CALL         0x31    // u16 address
+#define BLINKY_SEQ_RET          0x32
+#define BLINKY_SEQ_LOOP         0x33    // u8 count: repeat up to ENDLOOP, 0 = forever
+#define BLINKY_SEQ_ENDLOOP      0x34
+#define BLINKY_SEQ_JUMP_SHORT   0x80    // | address 0 - 31
+
+// u16 operand bytes
+#define BLINKY_SEQ_U16(v)       ((v) & 0xFF), (((v) >> 8) & 0xFF)
+
+typedef struct BlinkySeqReport {
+    int size;                   // bytecode bytes, max + 1 when they do not fit
+    int loopDepth;              // deepest nesting of the device loops
+    uint64_t durationMs;        // one pass, a forever repeat counted once
+    uint64_t errorMs;           // sum of the quantisation errors of one pass
+    uint32_t maxErrorMs;        // largest error of a single step
+} BlinkySeqReport;
+
+// compiles a timeline into at most max bytes of bytecode (version
+// BLINKY_SEQ_VERSION). toleranceMs: the timing error a step may get for a
+// shorter encoding, 0 keeps the times exact. Returns the size, or -1 with a
+// message in error on a syntax error (line number first), a program that
+// does not fit max or nests loops deeper than the device stack. report may
+// be NULL.
+int blinkyCompileSequence(const char* text, uint8_t* code, int max, unsigned int toleranceMs,
+        BlinkySeqReport* report, char* error, int errorLen);
+
+#endif /* USB_BLINK_SEQ_H */
@@ -0,0 +1,12 @@
+/******************************************************************************
+ * bootloader.h - host native stand-in, the simulator stops when the firmware
+ * jumps to the bootloader
+ *****************************************************************************/
+#ifndef BOOTLOADER_SIM_H
+#define BOOTLOADER_SIM_H
+
+#define BOOT_ADDR   0x3800
+
+void bootloader(void);
+
+#endif /* BOOTLOADER_SIM_H */
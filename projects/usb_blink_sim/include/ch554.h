@@ -0,0 +1,252 @@
+/******************************************************************************
+ * ch554.h - host native stand-in for the CH554 SFR header
+ *
+ * The SFRs and bit SFRs are plain variables (see ch554_sim.c) so the firmware
+ * sources can be compiled with gcc and driven by the simulator. The SDCC
+ * storage classes and intrinsics are mapped away. Only the registers used by
+ * the projects are defined.
+ *****************************************************************************/
+#ifndef CH554_SIM_H
+#define CH554_SIM_H
+
+#include <stdint.h>
+
+/* SDCC keywords */
+#define __data
+#define __idata
+#define __pdata
+#define __xdata
+#define __code              const
+#define __at(a)
+#define __interrupt(n)
+#define __using(n)
+#define __critical
+#define __naked
+#define __reentrant
+#define __bit               uint8_t
+
+#define SFR(name, addr)         extern volatile uint8_t name
+#define SFR16(name, addr)       extern volatile uint16_t name
+#define SBIT(name, addr, bit)   volatile uint8_t name
+
+/* register file, defined in ch554_sim.c */
+#define CH554_SIM_SFRS(X)                                                       \
+    X(PCON) X(SAFE_MOD) X(GLOBAL_CFG) X(WAKE_CTRL) X(XBUS_AUX) X(CLOCK_CFG)     \
+    X(IE) X(IP) X(IE_EX) X(IP_EX)                                               \
+    X(P1) X(P1_MOD_OC) X(P1_DIR_PU) X(P3) X(P3_MOD_OC) X(P3_DIR_PU) X(PIN_FUNC) \
+    X(TCON) X(TMOD) X(TH0) X(TL0) X(TH1) X(TL1)                                 \
+    X(T2CON) X(T2MOD) X(TH2) X(TL2) X(RCAP2H) X(RCAP2L)                         \
+    X(PWM_DATA1) X(PWM_DATA2) X(PWM_CTRL) X(PWM_CK_SE)                          \
+    X(ROM_ADDR_L) X(ROM_ADDR_H) X(ROM_DATA_H) X(ROM_CTRL)                       \
+    X(USB_CTRL) X(USB_DEV_AD) X(UDEV_CTRL) X(USB_INT_EN) X(USB_INT_FG)          \
+    X(USB_INT_ST) X(USB_MIS_ST) X(USB_RX_LEN) X(UEP4_1_MOD) X(UEP2_3_MOD)       \
+    X(UEP0_CTRL) X(UEP0_T_LEN) X(UEP1_CTRL) X(UEP1_T_LEN)                       \
+    X(UEP2_CTRL) X(UEP2_T_LEN) X(UEP3_CTRL) X(UEP3_T_LEN)                       \
+    X(UEP4_CTRL) X(UEP4_T_LEN)
+
+#define CH554_SIM_SFR16S(X)                                                     \
+    X(UEP0_DMA) X(UEP1_DMA) X(UEP2_DMA) X(UEP3_DMA) X(ROM_ADDR)
+
+#define CH554_SIM_SBITS(X)                                                      \
+    X(EA) X(E_DIS) X(ET2) X(ES) X(ET1) X(EX1) X(ET0) X(EX0)                     \
+    X(IE_USB) X(IE_PWMX) X(IE_UART1)                                            \
+    X(TF1) X(TR1) X(TF0) X(TR0) X(TF2) X(TR2) X(C_T2) X(CP_RL2)                 \
+    X(U_IS_NAK) X(U_TOG_OK) X(U_SIE_FREE) X(UIF_FIFO_OV) X(UIF_HST_SOF)         \
+    X(UIF_SUSPEND) X(UIF_TRANSFER) X(UIF_DETECT)
+
+#define CH554_SIM_DECLARE(name)     extern volatile uint8_t name;
+#define CH554_SIM_DECLARE16(name)   extern volatile uint16_t name;
+CH554_SIM_SFRS(CH554_SIM_DECLARE)
+CH554_SIM_SFR16S(CH554_SIM_DECLARE16)
+CH554_SIM_SBITS(CH554_SIM_DECLARE)
+
+#define UIF_BUS_RST         UIF_DETECT
+
+/* XRAM - absolute addresses used as pointers are mapped into this array */
+#define XRAM_SIZE_SIM       0x0400
+extern uint8_t ch554SimXram[XRAM_SIZE_SIM];
+#define XRAM_PTR(addr)      (ch554SimXram + (addr))
+
+/* PCON */
+#define SMOD                0x80
+#define bRST_FLAG1          0x20
+#define bRST_FLAG0          0x10
+#define GF1                 0x08
+#define GF0                 0x04
+#define PD                  0x02
+#define IDL                 0x01
+
+/* IP_EX */
+#define bIP_LEVEL           0x80
+#define bIP_GPIO            0x40
+#define bIP_PWMX            0x20
+#define bIP_UART1           0x10
+#define bIP_ADC             0x08
+#define bIP_USB             0x04
+#define bIP_TKEY            0x02
+#define bIP_SPI0            0x01
+
+/* GLOBAL_CFG */
+#define bBOOT_LOAD          0x20
+#define bSW_RESET           0x10
+#define bCODE_WE            0x08
+#define bDATA_WE            0x04
+#define bLDO3V3_OFF         0x02
+#define bWDOG_EN            0x01
+
+/* WAKE_CTRL */
+#define bWAK_BY_USB         0x80
+#define bWAK_RXD1_LO        0x40
+#define bWAK_P1_5_LO        0x20
+#define bWAK_P1_4_LO        0x10
+#define bWAK_P1_3_LO        0x08
+#define bWAK_RST_HI         0x04
+#define bWAK_P3_2E_3L       0x02
+#define bWAK_RXD0_LO        0x01
+
+/* XBUS_AUX */
+#define bUART0_TX           0x80
+#define bUART0_RX           0x40
+#define bSAFE_MOD_ACT       0x20
+
+/* TMOD / T2MOD */
+#define bT1_GATE            0x80
+#define bT1_CT              0x40
+#define bT1_M1              0x20
+#define bT1_M0              0x10
+#define bT0_GATE            0x08
+#define bT0_CT              0x04
+#define bT0_M1              0x02
+#define bT0_M0              0x01
+#define bTMR_CLK            0x80
+#define bT2_CLK             0x40
+#define bT1_CLK             0x20
+#define bT0_CLK             0x10
+
+/* PWM_CTRL */
+#define bPWM_IE_END         0x80
+#define bPWM2_POLAR         0x40
+#define bPWM1_POLAR         0x20
+#define bPWM_IF_END         0x10
+#define bPWM2_OUT_EN        0x08
+#define bPWM1_OUT_EN        0x04
+#define bPWM_CLR_ALL        0x02
+
+/* PIN_FUNC */
+#define bPWM1_PIN_X         0x10
+#define bPWM2_PIN_X         0x20
+
+/* DataFlash - 128 bytes at the even addresses from DATA_FLASH_ADDR. A command
+ * written to ROM_CTRL runs when the firmware next reads ROM_STATUS or
+ * ROM_DATA_L, the CPU waits for it there. Writes need bDATA_WE. */
+#define DATA_FLASH_SIZE_SIM 128
+extern uint8_t ch554SimDataFlash[DATA_FLASH_SIZE_SIM];
+volatile uint8_t* ch554SimRomData(void);
+uint8_t ch554SimRomStatus(void);
+#define ROM_DATA_L          (*ch554SimRomData())
+#define ROM_STATUS          (ch554SimRomStatus())
+
+#define DATA_FLASH_ADDR     0xC000
+#define ROM_CMD_WRITE       0x9A
+#define ROM_CMD_READ        0x8E
+#define bROM_ADDR_OK        0x40
+#define bROM_CMD_ERR        0x02
+
+/* USB_CTRL */
+#define bUC_HOST_MODE       0x80
+#define bUC_LOW_SPEED       0x40
+#define bUC_DEV_PU_EN       0x20
+#define bUC_SYS_CTRL1       0x20
+#define bUC_SYS_CTRL0       0x10
+#define bUC_INT_BUSY        0x08
+#define bUC_RESET_SIE       0x04
+#define bUC_CLR_ALL         0x02
+#define bUC_DMA_EN          0x01
+
+/* UDEV_CTRL */
+#define bUD_PD_DIS          0x80
+#define bUD_DP_PIN          0x20
+#define bUD_DM_PIN          0x10
+#define bUD_LOW_SPEED       0x04
+#define bUD_GP_BIT          0x02
+#define bUD_PORT_EN         0x01
+
+/* USB_DEV_AD */
+#define bUDA_GP_BIT         0x80
+#define MASK_USB_ADDR       0x7F
+
+/* USB_INT_EN */
+#define bUIE_DEV_SOF        0x80
+#define bUIE_DEV_NAK        0x40
+#define bUIE_FIFO_OV        0x10
+#define bUIE_HST_SOF        0x08
+#define bUIE_SUSPEND        0x04
+#define bUIE_TRANSFER       0x02
+#define bUIE_DETECT         0x01
+#define bUIE_BUS_RST        0x01
+
+/* USB_INT_ST */
+#define bUIS_IS_NAK         0x80
+#define bUIS_TOG_OK         0x40
+#define MASK_UIS_TOKEN      0x30
+#define MASK_UIS_ENDP       0x0F
+#define UIS_TOKEN_OUT       0x00
+#define UIS_TOKEN_SOF       0x10
+#define UIS_TOKEN_IN        0x20
+#define UIS_TOKEN_SETUP     0x30
+
+/* USB_MIS_ST */
+#define bUMS_SOF_PRES       0x80
+#define bUMS_SOF_ACT        0x40
+#define bUMS_SIE_FREE       0x20
+#define bUMS_R_FIFO_RDY     0x10
+#define bUMS_BUS_RESET      0x08
+#define bUMS_SUSPEND        0x04
+#define bUMS_DM_LEVEL       0x02
+#define bUMS_DEV_ATTACH     0x01
+
+/* UEP4_1_MOD / UEP2_3_MOD */
+#define bUEP1_RX_EN         0x80
+#define bUEP1_TX_EN         0x40
+#define bUEP1_BUF_MOD       0x10
+#define bUEP4_RX_EN         0x08
+#define bUEP4_TX_EN         0x04
+#define bUEP3_RX_EN         0x80
+#define bUEP3_TX_EN         0x40
+#define bUEP3_BUF_MOD       0x10
+#define bUEP2_RX_EN         0x08
+#define bUEP2_TX_EN         0x04
+#define bUEP2_BUF_MOD       0x01
+
+/* UEPn_CTRL */
+#define bUEP_R_TOG          0x80
+#define bUEP_T_TOG          0x40
+#define bUEP_AUTO_TOG       0x10
+#define MASK_UEP_R_RES      0x0C
+#define UEP_R_RES_ACK       0x00
+#define UEP_R_RES_TOUT      0x04
+#define UEP_R_RES_NAK       0x08
+#define UEP_R_RES_STALL     0x0C
+#define MASK_UEP_T_RES      0x03
+#define UEP_T_RES_ACK       0x00
+#define UEP_T_RES_TOUT      0x01
+#define UEP_T_RES_NAK       0x02
+#define UEP_T_RES_STALL     0x03
+
+/* interrupt numbers */
+#define INT_NO_INT0         0
+#define INT_NO_TMR0         1
+#define INT_NO_INT1         2
+#define INT_NO_TMR1         3
+#define INT_NO_UART0        4
+#define INT_NO_TMR2         5
+#define INT_NO_SPI0         6
+#define INT_NO_TKEY         7
+#define INT_NO_USB          8
+#define INT_NO_ADC          9
+#define INT_NO_UART1        10
+#define INT_NO_PWMX         11
+#define INT_NO_GPIO         12
+#define INT_NO_WDOG         13
+
+#endif /* CH554_SIM_H */
@@ -0,0 +1,54 @@
+/******************************************************************************
+ * ch554_usb.h - host native stand-in for the CH554 USB definitions
+ *****************************************************************************/
+#ifndef CH554_USB_SIM_H
+#define CH554_USB_SIM_H
+
+#include <stdint.h>
+
+/* USB standard device request codes */
+#define USB_GET_STATUS          0x00
+#define USB_CLEAR_FEATURE       0x01
+#define USB_SET_FEATURE         0x03
+#define USB_SET_ADDRESS         0x05
+#define USB_GET_DESCRIPTOR      0x06
+#define USB_SET_DESCRIPTOR      0x07
+#define USB_GET_CONFIGURATION   0x08
+#define USB_SET_CONFIGURATION   0x09
+#define USB_GET_INTERFACE       0x0A
+#define USB_SET_INTERFACE       0x0B
+#define USB_SYNCH_FRAME         0x0C
+
+/* USB request type */
+#define USB_REQ_TYP_IN          0x80
+#define USB_REQ_TYP_OUT         0x00
+#define USB_REQ_TYP_MASK        0x60
+#define USB_REQ_TYP_STANDARD    0x00
+#define USB_REQ_TYP_CLASS       0x20
+#define USB_REQ_TYP_VENDOR      0x40
+#define USB_REQ_RECIP_MASK      0x1F
+#define USB_REQ_RECIP_DEVICE    0x00
+#define USB_REQ_RECIP_INTERF    0x01
+#define USB_REQ_RECIP_ENDP      0x02
+
+#ifndef DEFAULT_ENDP0_SIZE
+#define DEFAULT_ENDP0_SIZE      8
+#endif
+#ifndef MAX_PACKET_SIZE
+#define MAX_PACKET_SIZE         64
+#endif
+
+typedef struct _USB_SETUP_REQ {
+    uint8_t bRequestType;
+    uint8_t bRequest;
+    uint8_t wValueL;
+    uint8_t wValueH;
+    uint8_t wIndexL;
+    uint8_t wIndexH;
+    uint8_t wLengthL;
+    uint8_t wLengthH;
+} USB_SETUP_REQ, *PUSB_SETUP_REQ;
+
+typedef USB_SETUP_REQ *PXUSB_SETUP_REQ;
+
+#endif /* CH554_USB_SIM_H */
@@ -0,0 +1,19 @@
+/******************************************************************************
+ * debug.h - host native stand-in for the ch554_sdcc debug helpers. The delays
+ * advance the simulated clock (see ch554_sim.c).
+ *****************************************************************************/
+#ifndef DEBUG_SIM_H
+#define DEBUG_SIM_H
+
+#include <stdint.h>
+
+#ifndef FREQ_SYS
+#define FREQ_SYS    24000000
+#endif
+
+void CfgFsys(void);
+void mDelayuS(uint16_t n);
+void mDelaymS(uint16_t n);
+void mInitSTDIO(void);
+
+#endif /* DEBUG_SIM_H */
@@ -0,0 +1,225 @@
+/******************************************************************************
+ * ch554_sim.c - register file, clock and the firmware coroutine
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/time.h>
+
+#include <ch554.h>
+#include <debug.h>
+#include <bootloader.h>
+
+#include "sim.h"
+
+/* register file */
+#define CH554_SIM_DEFINE(name)      volatile uint8_t name;
+#define CH554_SIM_DEFINE16(name)    volatile uint16_t name;
+CH554_SIM_SFRS(CH554_SIM_DEFINE)
+CH554_SIM_SFR16S(CH554_SIM_DEFINE16)
+CH554_SIM_SBITS(CH554_SIM_DEFINE)
+
+uint8_t ch554SimXram[XRAM_SIZE_SIM];
+uint8_t ch554SimDataFlash[DATA_FLASH_SIZE_SIM] = { [0 ... DATA_FLASH_SIZE_SIM - 1] = 0xFF };
+
+uint32_t simTimeMs;
+uint32_t simEdgeTime[SIM_MAX_EDGES];
+uint8_t simEdgeLevel[SIM_MAX_EDGES];
+int simEdges;
+uint32_t simPortTime[SIM_MAX_EDGES];
+uint8_t simPortValue[SIM_MAX_EDGES];
+int simPortEdges;
+uint32_t simDataFlashWrites;
+
+#define FIRMWARE_STACK  (256 * 1024)
+#define PREEMPT_US      20      // run time of a busy main loop per milli second
+
+static ucontext_t scenarioCtx;
+static ucontext_t firmwareCtx;
+static void (*firmwareEntry)(void);
+static uint32_t wakeTimeMs;
+static uint32_t usAccu;
+static uint8_t lastLed;
+static uint8_t lastP1;
+static volatile uint8_t inFirmware;
+static volatile uint8_t inTick;
+static uint32_t t2Counts;
+static volatile uint8_t romData;
+static uint8_t romStatus;
+
+
+void simClearEdges(void) {
+    simEdges = 0;
+    simPortEdges = 0;
+    lastLed = LED;
+    lastP1 = P1;
+}
+
+static void firmwareThread(void) {
+    firmwareEntry();
+    fprintf(stderr, "sim: firmware main returned\n");
+    exit(2);
+}
+
+static void tick(void);
+
+// a main loop without delays is preempted by an interval timer, like by the
+// hardware timer interrupt
+static void onPreempt(int sig) {
+    if (inFirmware && !inTick) {
+        tick();
+    }
+}
+
+void simStart(void (*firmwareMain)(void)) {
+    struct itimerval it;
+    sigset_t set;
+
+    firmwareEntry = firmwareMain;
+    getcontext(&firmwareCtx);
+    firmwareCtx.uc_stack.ss_sp = malloc(FIRMWARE_STACK);
+    firmwareCtx.uc_stack.ss_size = FIRMWARE_STACK;
+    firmwareCtx.uc_link = NULL;
+    makecontext(&firmwareCtx, firmwareThread, 0);
+    wakeTimeMs = 0;
+
+    // the firmware context keeps the signal unblocked, the scenario blocks it
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    signal(SIGALRM, onPreempt);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = PREEMPT_US;
+    it.it_value = it.it_interval;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+void simWait(uint32_t ms) {
+    sigset_t set;
+    int sig;
+
+    // the timer expired while the scenario ran: drop it, or the firmware
+    // would go straight into the next tick and its main loop never ran
+    sigpending(&set);
+    if (sigismember(&set, SIGALRM)) {
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        sigwait(&set, &sig);
+    }
+    wakeTimeMs = simTimeMs + ms;
+    inFirmware = 1;
+    swapcontext(&scenarioCtx, &firmwareCtx);
+}
+
+// Timer2 in the auto reload mode
+static void runTimer2(void) {
+    uint32_t period = 0x10000 - ((RCAP2H << 8) | RCAP2L);
+    uint32_t div = 12;
+
+    if (!TR2 || C_T2 || CP_RL2) {
+        return;
+    }
+    if (T2MOD & bT2_CLK) {
+        div = (T2MOD & bTMR_CLK) ? 1 : 4;
+    }
+    t2Counts += FREQ_SYS / div / 1000;
+    while (t2Counts >= period) {
+        t2Counts -= period;
+        TF2 = 1;
+        if (EA && ET2) {
+            Timer2Interrupt();
+        }
+    }
+}
+
+// one milli second of simulated time has passed in the firmware
+static void tick(void) {
+    inTick = 1;
+    if ((P1 ^ lastP1) & (1 << SIM_LED_PIN)) {
+        LED = (P1 >> SIM_LED_PIN) & 1;
+    }
+    P1 = (P1 & ~(1 << SIM_LED_PIN)) | (LED << SIM_LED_PIN);
+    if (P1 != lastP1) {
+        lastP1 = P1;
+        if (simPortEdges < SIM_MAX_EDGES) {
+            simPortTime[simPortEdges] = simTimeMs;
+            simPortValue[simPortEdges++] = P1;
+        }
+    }
+    if (LED != lastLed) {
+        lastLed = LED;
+        if (simEdges < SIM_MAX_EDGES) {
+            simEdgeTime[simEdges] = simTimeMs;
+            simEdgeLevel[simEdges++] = LED;
+        }
+    }
+    simTimeMs++;
+    runTimer2();
+    inTick = 0;
+    // delays called from the interrupt handler only advance the time
+    if (inFirmware && simTimeMs >= wakeTimeMs) {
+        // the scenario runs "inside" the firmware, like an interrupt
+        inFirmware = 0;
+        swapcontext(&firmwareCtx, &scenarioCtx);
+    }
+}
+
+/* DataFlash: runs the command in ROM_CTRL on the address in ROM_ADDR_H / L */
+static void runRomCommand(void) {
+    uint16_t addr = (ROM_ADDR_H << 8) | ROM_ADDR_L;
+    uint16_t i = (uint16_t) (addr - DATA_FLASH_ADDR) >> 1;
+
+    romStatus = (addr >= DATA_FLASH_ADDR && !(addr & 1) && i < DATA_FLASH_SIZE_SIM) ? bROM_ADDR_OK : 0;
+    if (ROM_CTRL == 0) {
+        return;
+    }
+    if (romStatus && ROM_CTRL == ROM_CMD_READ) {
+        romData = ch554SimDataFlash[i];
+    } else if (romStatus && ROM_CTRL == ROM_CMD_WRITE && (GLOBAL_CFG & bDATA_WE)) {
+        ch554SimDataFlash[i] = romData;
+        simDataFlashWrites++;
+    } else {
+        romStatus |= bROM_CMD_ERR;
+    }
+    ROM_CTRL = 0;
+}
+
+volatile uint8_t* ch554SimRomData(void) {
+    runRomCommand();
+    return &romData;
+}
+
+uint8_t ch554SimRomStatus(void) {
+    runRomCommand();
+    return romStatus;
+}
+
+/* debug.h */
+void CfgFsys(void) {
+}
+
+void mInitSTDIO(void) {
+}
+
+void mDelaymS(uint16_t n) {
+    while (n--) {
+        tick();
+    }
+}
+
+void mDelayuS(uint16_t n) {
+    usAccu += n;
+    while (usAccu >= 1000) {
+        usAccu -= 1000;
+        tick();
+    }
+}
+
+/* bootloader.h */
+void bootloader(void) {
+    printf("sim: firmware jumped to the bootloader at %u ms\n", simTimeMs);
+    fflush(stdout);
+    exit(SIM_EXIT_BOOTLOADER);
+}
@@ -0,0 +1,82 @@
+/******************************************************************************
+ * sim.h - host native simulator of the CH55x blinky firmware
+ *
+ * The firmware (compiled from the unchanged sources against the stand-in
+ * ch554.h) runs as a coroutine. Its delays advance the simulated clock, and
+ * so does an interval timer that preempts a main loop without delays. Every
+ * simulated milli second runs Timer2. When the clock reaches the wake up
+ * time of the scenario, the scenario runs and plays the role of the USB host
+ * / SIE by calling the interrupt handlers.
+ *****************************************************************************/
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+/* clock and scheduling (ch554_sim.c) */
+extern uint32_t simTimeMs;                 // simulated time since the boot
+void simStart(void (*firmwareMain)(void));  // boot the firmware coroutine
+void simWait(uint32_t ms);                  // let the firmware run for ms
+
+// exit status of the simulation when the firmware calls bootloader()
+#define SIM_EXIT_BOOTLOADER 42
+
+/* LED trace, sampled every simulated milli second */
+#define SIM_MAX_EDGES   4096
+extern uint32_t simEdgeTime[SIM_MAX_EDGES];
+extern uint8_t simEdgeLevel[SIM_MAX_EDGES];
+extern int simEdges;
+void simClearEdges(void);
+
+/* P1 output trace, sampled like the LED. The LED bit and P1.4 are one pin:
+ * a port write moves the LED, an LED write shows in the port. */
+#define SIM_LED_PIN     4
+extern uint32_t simPortTime[SIM_MAX_EDGES];
+extern uint8_t simPortValue[SIM_MAX_EDGES];
+extern int simPortEdges;
+
+/* DataFlash bytes written by the firmware, the content is ch554SimDataFlash */
+extern uint32_t simDataFlashWrites;
+
+/* USB host model (usb_sim.c) - results are the data length or a SIM_ error */
+#define SIM_STALL       -1
+#define SIM_NAK         -2
+#define SIM_PROTOCOL    -3
+
+#define SIM_DEVICE_ADDRESS  5
+
+extern uint8_t simEp0Size;                  // from the device descriptor
+void simBusReset(void);
+int simEnumerate(void);                     // reset, address, configuration 1
+int simIn(uint8_t ep, uint8_t* data, uint16_t maxLen);
+int simOut(uint8_t ep, const uint8_t* data, uint16_t len);
+int simControlOut(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, const uint8_t* data, uint16_t len);
+// announces wLength, the data stage ends after len bytes (a short packet)
+int simControlOutShort(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, uint16_t wLength, const uint8_t* data, uint16_t len);
+int simControlIn(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, uint8_t* data, uint16_t len);
+
+/* serve the simulated device on a usb_blink_pc daemon socket (sim_serve.c) */
+#define SIM_SERVE_SOCKET    "/tmp/usb_blink_sim.sock"
+int simServe(const char* path);
+
+/* ISR cost per token type, measured in host nano seconds */
+enum { SIM_TOKEN_SETUP, SIM_TOKEN_IN, SIM_TOKEN_OUT, SIM_TOKEN_TYPES };
+typedef struct SimIsrStats {
+    uint32_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} SimIsrStats;
+extern SimIsrStats simIsrStats[SIM_TOKEN_TYPES];
+
+/* firmware symbols */
+extern uint8_t Ep0Buffer[];
+extern volatile uint8_t LED;
+extern uint8_t ledLevel;
+extern uint16_t fadeStep;
+void DeviceInterrupt(void);
+void Timer2Interrupt(void);
+
+#endif /* SIM_H */
@@ -0,0 +1,1416 @@
+/******************************************************************************
+ * sim_main.c - scenarios run against the simulated blinky firmware
+ *
+ * usage: usb_blink_sim [scenario ...]
+ *        usb_blink_sim -serve [socket path]
+ *
+ * Every scenario runs in its own process, so it starts with a freshly booted
+ * firmware. Without arguments all scenarios are run; the exit status is the
+ * number of failed scenarios. With -serve the simulated device is offered on
+ * a daemon socket until SIGINT / SIGTERM.
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <ch554.h>
+#include <ch554_usb.h>
+#include "usb_desc.h"
+
+#include "sim.h"
+
+// the timeline compiler of the host tools
+#include "usb_blink_seq.h"
+
+// vendor requests of the blinky firmware (see usb_blink/blinky_protocol.def)
+#include "blinky_commands.h"
+#define TYPE_OUT_ITF                0x41
+#define TYPE_IN_ITF                 0xC1
+
+// LED frame stream on the bulk endpoint 2
+#define STREAM_EP                   2
+#define STREAM_FRAMES               32
+#define STREAM_FRAMES_PER_PACKET    16
+
+// event records on the interrupt endpoint 1 IN
+#define EVENT_EP                    1
+#define EVENT_PACKET_SIZE           16
+#define EVENT_SEQUENCE_DONE         0x01
+#define EVENT_STREAM_LOW            0x02
+#define EVENT_BUS_RESET             0x03
+#define EVENT_ERROR                 0x04
+#define ERROR_SEQ_OPCODE            0x01
+#define ERROR_SEQ_STACK             0x02
+#define ERROR_STREAM_UNDERRUN       0x03
+#define ERROR_STREAM_OVERRUN        0x04
+#define ERROR_SEQ_SHORT             0x05
+
+// sequence bytecode version 3
+#define SEQ_VERSION                 3
+#define SEQ_PROGRAM_SIZE            256
+#define SEQ_LED_ON                  0x21
+#define SEQ_LED_OFF                 0x20
+#define SEQ_LED_TOGGLE              0x22
+#define SEQ_JUMP                    0x30
+#define SEQ_CALL                    0x31
+#define SEQ_RET                     0x32
+#define SEQ_LED_LEVEL               0x24
+#define SEQ_FADE                    0x25
+#define SEQ_CHANNELS                0x26
+#define SEQ_LOOP                    0x33
+#define SEQ_ENDLOOP                 0x34
+#define U16(v)                      ((v) & 0xFF), ((v) >> 8)
+
+// USB_INTR_STATS counters (u16) in COMMAND_READ_STATS
+#define STATS_SETUP                 0
+#define STATS_IN                    1   // + endpoint
+#define STATS_OUT                   6   // + endpoint
+#define STATS_STALLS                11
+#define STATS_BUS_RESETS            12
+#define STATS_SUSPENDS              13
+#define STATS_VENDOR_UNSUPPORTED    14
+#define STATS_ISR_MAX_TICKS         15
+#define STATS_COUNTERS              16
+
+// trace records in COMMAND_READ_TRACE, after a 4 byte header
+#define TRACE_RECORDS               32
+#define TRACE_PER_READ              7
+#define TRACE_TICKS_PER_MS          250
+#define TRACE_SETUP                 0x01
+#define TRACE_BUS_RESET             0x02
+#define TRACE_SEQ_STEP              0x10
+#define TRACE_EVENT                 0x11
+
+// COMMAND_BATCH sub-commands, the result block of COMMAND_READ_BATCH
+#define BATCH_RESULT_SIZE           16
+#define BATCH_ERROR_NONE            0x00
+#define BATCH_ERROR_CODE            0x01
+#define BATCH_ERROR_RANGE           0x02
+#define BATCH_ERROR_FULL            0x03
+#define BATCH_ERROR_SHORT           0x04
+
+// COMMAND_READ_LOAD: u32 busy Timer2 counts, u16 interrupts, u16 window ms
+#define LOAD_WINDOW_MS              1000
+
+// COMMAND_SAVE_SEQUENCE record in the DataFlash: u8 magic, u8 length, u16 CRC
+#define SAVE_MAGIC                  0xB3
+#define SAVE_MAGIC_V1               0xB1
+#define SAVE_HEADER_SIZE            4
+#define SAVE_PROGRAM_MAX            124
+#define SAVED_NONE                  0x00
+#define SAVED_VALID                 0x01
+#define SAVED_BUSY                  0x02
+
+#define BENCH_TRANSFERS             10000
+
+void blinkyMain(void);
+
+#define CHECK(cond) do {                                                    \
+    if (!(cond)) {                                                          \
+        printf("  %s:%i: check failed: %s\n", __FILE__, __LINE__, #cond);   \
+        return 1;                                                           \
+    }                                                                       \
+} while (0)
+
+
+// starts a test from a dark LED, the firmware toggles its level
+static void ledOff(void) {
+    LED = 0;
+    ledLevel = 0;
+}
+
+static int readBlinkTime(void) {
+    uint8_t buf[2];
+    int ret;
+
+    ret = simControlIn(TYPE_IN_ITF, COMMAND_READ_BLINK_TIME, 0, 0, buf, 2);
+    if (ret != 2) {
+        return -1;
+    }
+    return buf[0] | (buf[1] << 8);
+}
+
+// checks that the LED toggled with the given period since the edges were cleared
+static int checkPeriod(uint32_t period, int minEdges) {
+    int i;
+
+    CHECK(simEdges >= minEdges);
+    for (i = 1; i < simEdges; i++) {
+        if (simEdgeTime[i] - simEdgeTime[i - 1] != period) {
+            printf("  edge %i: period %u ms, expected %u ms\n", i,
+                    simEdgeTime[i] - simEdgeTime[i - 1], period);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// checks the LED edge intervals, starting at the edge from
+static int checkEdges(uint32_t from, const uint32_t* expected, int count) {
+    int i;
+
+    CHECK(simEdges >= from + count + 1);
+    for (i = 0; i < count; i++) {
+        uint32_t t = simEdgeTime[from + i + 1] - simEdgeTime[from + i];
+        if (t != expected[i]) {
+            printf("  edge %u: %u ms, expected %u ms\n", from + i + 1, t, expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int scenarioEnum(void) {
+    uint8_t buf[64];
+    int ret;
+
+    simBusReset();
+
+    // the host reads the first 8 bytes to learn the EP0 packet size
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, USB_DESC_DEV << 8, 0, buf, 8);
+    CHECK(ret == 8);
+    CHECK(buf[0] == sizeof(USB_DEV_DSC) && buf[1] == USB_DESC_DEV);
+    simEp0Size = buf[7];
+    CHECK(simEp0Size == 8 || simEp0Size == 16 || simEp0Size == 32 || simEp0Size == 64);
+
+    ret = simControlOut(USB_REQ_TYP_OUT, USB_SET_ADDRESS, SIM_DEVICE_ADDRESS, 0, NULL, 0);
+    CHECK(ret == 0);
+    CHECK((USB_DEV_AD & 0x7F) == SIM_DEVICE_ADDRESS);
+
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, USB_DESC_DEV << 8, 0, buf, sizeof(buf));
+    CHECK(ret == sizeof(USB_DEV_DSC));
+    CHECK(buf[8] == 0xFF && buf[9] == 0xFF);    // vendor id
+    CHECK(buf[10] == 0x1E && buf[11] == 0x00);  // product id
+
+    // configuration: header first, then the whole descriptor (multi packet)
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, USB_DESC_CFG << 8, 0, buf, 9);
+    CHECK(ret == 9);
+    CHECK(buf[1] == USB_DESC_CFG);
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, USB_DESC_CFG << 8, 0, buf, buf[2]);
+    CHECK(ret == buf[2] && buf[9] == 9 && buf[10] == USB_DESC_INTF);
+
+    // product name
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, (USB_DESC_STR << 8) | 2, 0, buf, sizeof(buf));
+    CHECK(ret > 2 && buf[1] == USB_DESC_STR && buf[2] == 'B' && buf[4] == 'l');
+
+    // unsupported requests stall, the next SETUP clears the stall
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, 6 << 8, 0, buf, 10);
+    CHECK(ret == SIM_STALL);
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, (USB_DESC_STR << 8) | 9, 0, buf, 10);
+    CHECK(ret == SIM_STALL);
+    ret = simControlIn(TYPE_IN_ITF, 0x42, 0, 0, buf, 2);
+    CHECK(ret == SIM_STALL);
+
+    ret = simControlOut(USB_REQ_TYP_OUT, USB_SET_CONFIGURATION, 1, 0, NULL, 0);
+    CHECK(ret == 0);
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_CONFIGURATION, 0, 0, buf, 1);
+    CHECK(ret == 1 && buf[0] == 1);
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_STATUS, 0, 0, buf, 2);
+    CHECK(ret == 2 && buf[0] == 0 && buf[1] == 0);
+
+    // no remote wakeup, but the endpoint halt can be cleared
+    ret = simControlOut(USB_REQ_TYP_OUT, USB_SET_FEATURE, 1, 0, NULL, 0);
+    CHECK(ret == SIM_STALL);
+    ret = simControlOut(USB_REQ_TYP_OUT | USB_REQ_RECIP_ENDP, USB_CLEAR_FEATURE, 0, 0x81, NULL, 0);
+    CHECK(ret == 0);
+
+    // bus reset drops the address and the configuration
+    simBusReset();
+    CHECK(USB_DEV_AD == 0);
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_CONFIGURATION, 0, 0, buf, 1);
+    CHECK(ret == 1 && buf[0] == 0);
+    return 0;
+}
+
+static int scenarioBlink(void) {
+    CHECK(simEnumerate() >= 0);
+    simClearEdges();
+    simWait(2600);
+    return checkPeriod(250, 10);
+}
+
+static int scenarioControl(void) {
+    uint8_t buf[2] = { 0, 0 };
+    uint32_t start;
+
+    CHECK(simEnumerate() >= 0);
+    CHECK(readBlinkTime() == 250);
+
+    // a new blink time restarts the period on the next 1 ms tick
+    simWait(37);
+    simClearEdges();
+    start = simTimeMs;
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_TIME, 400, 0, NULL, 0) == 0);
+    CHECK(readBlinkTime() == 400);
+    simWait(4100);
+    CHECK(simEdges > 0 && simEdgeTime[0] - start <= 1);
+    if (checkPeriod(400, 10)) {
+        return 1;
+    }
+
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_TOGGLE_BLINK, 0, 0, NULL, 0) == 0);
+    CHECK(readBlinkTime() == 250);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_TOGGLE_BLINK, 0, 0, NULL, 0) == 0);
+    CHECK(readBlinkTime() == 100);
+
+    // the dispatch table checks the direction and the data stage length
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_READ_BLINK_TIME, 0, 0, NULL, 0) == SIM_STALL);
+    CHECK(simControlIn(TYPE_IN_ITF, COMMAND_TOGGLE_BLINK, 0, 0, buf, sizeof(buf)) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_TIME, 50, 0, buf, sizeof(buf)) == SIM_STALL);
+    CHECK(readBlinkTime() == 100);
+
+    simClearEdges();
+    simWait(1050);
+    return checkPeriod(100, 10);
+}
+
+static int scenarioSequence(void) {
+    // on 3 x 64 ms, off 2 x 64 ms, on 1 x 64 ms, end
+    static const uint8_t seq[] = { 0x13, 0x02, 0x11, 0x00 };
+    static const uint8_t v1[] = { 0x33, 0x62, 0x71, 0x00 };
+    static const uint32_t expected[] = { 192, 128, 64 };
+    uint32_t start;
+
+    CHECK(simEnumerate() >= 0);
+    start = simTimeMs;
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, 0, 0, seq, sizeof(seq)) == sizeof(seq));
+    // force the pin low, so the first edge is the start of the sequence
+    ledOff();
+    simClearEdges();
+    simWait(1000);
+
+    CHECK(simEdges >= 4);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, 3)) {
+        return 1;
+    }
+    // the default blinking resumes with 100 ms
+    CHECK(simEdgeTime[4] - simEdgeTime[3] == 100);
+    printf("  sequence started %u ms after the transfer\n", simEdgeTime[0] - start);
+
+    // version 1 ignores bits 5 and 6, these are no version 3 opcodes (a loop
+    // and unknown ones) then
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, 1, 0, v1, sizeof(v1)) == sizeof(v1));
+    ledOff();
+    simClearEdges();
+    simWait(1000);
+    CHECK(simEdges >= 4 && simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, 3)) {
+        return 1;
+    }
+    CHECK(simEdgeTime[4] - simEdgeTime[3] == 100);
+
+    // saved, it keeps its version
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, sizeof(v1), 0, NULL, 0) == 0);
+    simWait(50);
+    CHECK(ch554SimDataFlash[0] == SAVE_MAGIC_V1);
+    return 0;
+}
+
+static int scenarioVm(void) {
+    // 52 bytes, loaded in two chunks: a call above address 32, a counted
+    // loop, 16 bit milli second delays and a long jump
+    static const uint8_t prog[] = {
+        /*  0 */ SEQ_CALL, U16(40),
+        /*  3 */ SEQ_LOOP, 3,
+        /*  5 */ SEQ_LED_ON, U16(7),
+        /*  8 */ SEQ_LED_OFF, U16(13),
+        /* 11 */ SEQ_ENDLOOP,
+        /* 12 */ SEQ_JUMP, U16(48),
+        /* 15 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        /* 40 */ SEQ_LED_ON, U16(1000),
+        /* 43 */ SEQ_LED_OFF, U16(300),
+        /* 46 */ SEQ_RET,
+        /* 47 */ 0,
+        /* 48 */ SEQ_LED_ON, U16(5),
+        /* 51 */ 0
+    };
+    static const uint32_t expected[] = { 1000, 300, 7, 13, 7, 13, 7, 13, 5, 100 };
+    static const uint8_t recurse[] = { SEQ_CALL, U16(0) };
+    uint8_t buf[32];
+
+    CHECK(simEnumerate() >= 0);
+
+    // newer bytecode versions and loads outside of the program memory stall
+    memset(buf, 0, sizeof(buf));
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION + 1, 0, buf, 4) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION,
+            SEQ_PROGRAM_SIZE - 16, buf, 32) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION,
+            SEQ_PROGRAM_SIZE - 32, buf, 32) == 32);
+
+    // the tail first, the chunk at address 0 starts the program
+    CHECK(sizeof(prog) == 52);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 32, prog + 32, 20) == 20);
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, prog, 32) == 32);
+    simWait(1600);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, sizeof(expected) / sizeof(expected[0]))) {
+        return 1;
+    }
+
+    // unbounded recursion ends the program, the blinking resumes
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, recurse, sizeof(recurse)) == sizeof(recurse));
+    simWait(350);
+    CHECK(simEdgeLevel[0] == 1);
+    return checkPeriod(100, 3);
+}
+
+static int scenarioUpload(void) {
+    // the whole program memory in one multi packet control transfer
+    static uint8_t prog[SEQ_PROGRAM_SIZE];
+    static uint32_t expected[SEQ_PROGRAM_SIZE / 3];
+    int ops = (SEQ_PROGRAM_SIZE - 1) / 3 & ~1; // even, the LED ends off
+    int i;
+
+    for (i = 0; i < ops; i++) {
+        expected[i] = 1 + i % 7;
+        prog[i * 3] = SEQ_LED_TOGGLE;
+        prog[i * 3 + 1] = expected[i];
+        prog[i * 3 + 2] = 0;
+    }
+    prog[ops * 3] = 0;
+
+    CHECK(simEnumerate() >= 0);
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, prog, sizeof(prog)) == sizeof(prog));
+    simWait(ops * 4 + 300);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, ops - 1)) {
+        return 1;
+    }
+    // the sequence ended with the last toggle, the blinking resumes
+    CHECK(simEdgeTime[ops] - simEdgeTime[ops - 1] == expected[ops - 1] + 100);
+
+    // a data stage ending with a short packet, the next request still works
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, prog, 40) == 40);
+    CHECK(readBlinkTime() == 100);
+    return 0;
+}
+
+// a 1 s fade in and out: the level follows a straight line, the LED pin
+// (no PWM on P1.4) switches at the middle level
+static int scenarioFade(void) {
+    static const uint8_t prog[] = {
+        SEQ_FADE, 255, U16(1000),
+        SEQ_FADE, 0, U16(1000),
+        SEQ_LED_LEVEL, 40, U16(200),
+        0
+    };
+    static const uint8_t step[] = { SEQ_FADE, 200, U16(0), SEQ_FADE, 200, U16(100), 0 };
+    static const uint8_t steps[] = {
+        SEQ_LED_LEVEL, 200, U16(1), SEQ_FADE, 0, U16(3),
+        SEQ_LED_LEVEL, 255, U16(1), SEQ_FADE, 0, U16(40000),
+        0
+    };
+    uint32_t start, t;
+    int expected;
+
+    CHECK(simEnumerate() >= 0);
+    // the VM runs below the USB interrupt, it holds it off only for a moment
+    CHECK((IP_EX & bIP_USB) && IE_USB);
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, prog, sizeof(prog)) == sizeof(prog));
+    // the first opcode runs on the next tick, the fade on the ticks after it
+    start = simTimeMs + 1;
+    for (t = 50; t < 2000; t += 50) {
+        simWait(start + t - simTimeMs);
+        expected = t <= 1000 ? t * 255 / 1000 : (2000 - t) * 255 / 1000;
+        if (ledLevel < expected - 2 || ledLevel > expected + 2) {
+            printf("  %u ms: level %u, expected %i\n", t, ledLevel, expected);
+            return 1;
+        }
+    }
+    simWait(100);
+    CHECK(ledLevel == 40 && LED == 0);
+    CHECK(simEdges == 2 && simEdgeLevel[0] == 1 && simEdgeLevel[1] == 0);
+    CHECK(simEdgeTime[0] - start > 495 && simEdgeTime[0] - start < 510);
+    CHECK(simEdgeTime[1] - start > 1495 && simEdgeTime[1] - start < 1510);
+
+    // a zero length fade sets the level at once, after the playing program
+    // (150 ms left)
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, step, sizeof(step)) == sizeof(step));
+    simWait(152);
+    CHECK(ledLevel == 200 && LED == 1);
+
+    // the interrupt divides by shifts, also a rest beyond 16 bits
+    simWait(100);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, steps, sizeof(steps)) == sizeof(steps));
+    simWait(3);
+    CHECK(fadeStep == (200 << 8) / 3);
+    simWait(4);
+    CHECK(fadeStep == (255 << 8) / 40000);
+    return 0;
+}
+
+// P1.0 - P1.4 are channels (see the Makefile), the rest of P1 is no output
+#define CHANNEL_PINS                0x1F
+
+// channel patterns switch all pins with one port write, from the sequence and
+// from the stream; the LED is channel 4
+static int scenarioChannels(void) {
+    static const uint8_t prog[] = {
+        SEQ_CHANNELS, 0x0F, 0x05, U16(100),
+        SEQ_CHANNELS, 0x0F, 0x0A, U16(100),
+        SEQ_CHANNELS, 0x03, 0x01, U16(100),  // P1.2, P1.3 keep their state
+        SEQ_CHANNELS, 0xFF, 0xFF, U16(100),  // only the channel pins
+        SEQ_CHANNELS, 0xFF, 0x00, U16(100),
+        0
+    };
+    static const uint8_t expected[] = { 0x05, 0x0A, 0x09, CHANNEL_PINS, 0x00 };
+    static const uint8_t frames[] = {
+        U16(20), 0x01, 0x00,    // the LED alone, mask 0
+        U16(30), 0x03, 0x0F,
+        U16(30), 0x0C, 0x0F,
+        U16(30), 0x00, 0x0F,
+    };
+    uint32_t start;
+    int i;
+
+    CHECK(simEnumerate() >= 0);
+    simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_TIME, 1000, 0, NULL, 0);
+    simWait(2);
+    ledOff();
+    P1 = 0;
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, prog, sizeof(prog)) == sizeof(prog));
+    start = simTimeMs;
+    simWait(450);
+
+    // one trace entry per pattern: the pins changed in the same tick
+    CHECK(simPortEdges == 5);
+    for (i = 0; i < 5; i++) {
+        if (simPortValue[i] != expected[i] || simPortTime[i] - start != 1 + i * 100) {
+            printf("  pattern %i: P1 0x%02X at %u ms, expected 0x%02X at %i ms\n", i,
+                    simPortValue[i], simPortTime[i] - start, expected[i], 1 + i * 100);
+            return 1;
+        }
+    }
+    CHECK(simEdges == 2 && simEdgeLevel[0] == 1 && simEdgeTime[0] - start == 301);
+
+    // stream frames with a mask set the channels, without one the LED
+    simWait(100);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_START_STREAM, 0, 0, NULL, 0) == 0);
+    simClearEdges();
+    CHECK(simOut(STREAM_EP, frames, sizeof(frames)) == sizeof(frames));
+    simWait(150);
+    CHECK(simPortEdges == 4);
+    CHECK(simPortValue[0] == 0x10 && simPortValue[1] == 0x13);
+    CHECK(simPortValue[2] == 0x1C && simPortValue[3] == 0x10);
+    CHECK(simPortTime[1] - simPortTime[0] == 20 && simPortTime[2] - simPortTime[1] == 30);
+    return 0;
+}
+
+static int scenarioSwap(void) {
+    static const uint8_t fast[] = {
+        SEQ_LOOP, 0,
+        SEQ_LED_ON, U16(10),
+        SEQ_LED_OFF, U16(10),
+        SEQ_ENDLOOP
+    };
+    static const uint8_t slow[] = {
+        SEQ_LED_ON, U16(30),
+        SEQ_LED_OFF, U16(30),
+        SEQ_JUMP, U16(0)
+    };
+    static const uint8_t once[] = {
+        SEQ_LED_ON, U16(50),
+        SEQ_LED_OFF, U16(50),
+        0
+    };
+    static const uint32_t fastSlow[] = { 10, 10, 10, 30, 30, 30 };
+    static const uint32_t onceFast[] = { 50, 50, 10, 10, 10 };
+    uint32_t edges;
+
+    CHECK(simEnumerate() >= 0);
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, fast, sizeof(fast)) == sizeof(fast));
+    simWait(105);
+
+    // a chunk at a higher address doesn't complete a program, the loop goes on
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 32, slow, sizeof(slow)) == sizeof(slow));
+    simWait(100);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkPeriod(10, 20)) {
+        return 1;
+    }
+
+    // in the middle of the 'on' phase: the loop round ends, then the new
+    // program starts without a gap
+    edges = simEdges;
+    CHECK(simEdgeLevel[edges - 1] == 1);
+    simWait(4);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, slow, sizeof(slow)) == sizeof(slow));
+    simWait(200);
+    if (checkEdges(edges - 2, fastSlow, 6)) {
+        return 1;
+    }
+
+    // a program without loops swaps at its end
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, once, sizeof(once)) == sizeof(once));
+    simWait(100); // the slow loop takes up to 60 ms to end
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, fast, sizeof(fast)) == sizeof(fast));
+    simWait(300);
+    for (edges = 1; edges < simEdges; edges++) {
+        if (simEdgeTime[edges] - simEdgeTime[edges - 1] == 50) {
+            break;
+        }
+    }
+    return checkEdges(edges - 1, onceFast, 5);
+}
+
+// credits, played frames, underruns, overruns
+static int readStreamStatus(uint16_t* status) {
+    uint8_t buf[8];
+    int i;
+
+    if (simControlIn(TYPE_IN_ITF, COMMAND_READ_STREAM_STATUS, 0, 0, buf, 8) != 8) {
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        status[i] = buf[i * 2] | (buf[i * 2 + 1] << 8);
+    }
+    return 0;
+}
+
+// a packet of frames, the LED toggles with the durations first + i * step
+static int sendFrames(uint8_t led, uint16_t first, uint16_t step) {
+    uint8_t buf[STREAM_FRAMES_PER_PACKET * 4];
+    int i;
+
+    for (i = 0; i < STREAM_FRAMES_PER_PACKET; i++) {
+        buf[i * 4] = (first + i * step) & 0xFF;
+        buf[i * 4 + 1] = (first + i * step) >> 8;
+        buf[i * 4 + 2] = led ^ (i & 1);
+        buf[i * 4 + 3] = 0;
+    }
+    return simOut(STREAM_EP, buf, sizeof(buf));
+}
+
+static int scenarioStream(void) {
+    uint32_t expected[2 * STREAM_FRAMES_PER_PACKET];
+    uint16_t st[4];
+    int i;
+
+    for (i = 0; i < 2 * STREAM_FRAMES_PER_PACKET; i++) {
+        expected[i] = 2 + i;
+    }
+
+    CHECK(simEnumerate() >= 0);
+    // no stream, the packets are dropped
+    CHECK(sendFrames(1, 10, 0) == STREAM_FRAMES_PER_PACKET * 4);
+
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_START_STREAM, 0, 0, NULL, 0) == 0);
+    CHECK(readStreamStatus(st) == 0);
+    CHECK(st[0] == STREAM_FRAMES && st[1] == 0 && st[2] == 0 && st[3] == 0);
+
+    // two packets, played back to back
+    ledOff();
+    simClearEdges();
+    CHECK(sendFrames(1, 2, 1) == STREAM_FRAMES_PER_PACKET * 4);
+    CHECK(sendFrames(1, 2 + STREAM_FRAMES_PER_PACKET, 1) == STREAM_FRAMES_PER_PACKET * 4);
+    CHECK(readStreamStatus(st) == 0);
+    CHECK(st[0] == STREAM_FRAMES - 2 * STREAM_FRAMES_PER_PACKET);
+    simWait(700);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, 2 * STREAM_FRAMES_PER_PACKET - 1)) {
+        return 1;
+    }
+    // the ring ran empty once, the LED keeps the last state
+    CHECK(simEdges == 2 * STREAM_FRAMES_PER_PACKET);
+    CHECK(readStreamStatus(st) == 0);
+    CHECK(st[0] == STREAM_FRAMES && st[1] == 2 * STREAM_FRAMES_PER_PACKET && st[2] == 1 && st[3] == 0);
+
+    // more frames than credits: the rest is dropped
+    for (i = 0; i < STREAM_FRAMES / STREAM_FRAMES_PER_PACKET + 1; i++) {
+        CHECK(sendFrames(1, 1000, 0) == STREAM_FRAMES_PER_PACKET * 4);
+    }
+    CHECK(readStreamStatus(st) == 0);
+    CHECK(st[0] == 0 && st[3] == STREAM_FRAMES_PER_PACKET);
+    simWait(2500);
+    CHECK(readStreamStatus(st) == 0);
+    CHECK(st[0] == 3 && st[1] == 2 * STREAM_FRAMES_PER_PACKET + 3);
+
+    // a new blink time ends the stream
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_TIME, 50, 0, NULL, 0) == 0);
+    simClearEdges();
+    simWait(520);
+    return checkPeriod(50, 10);
+}
+
+// reads the pending event records and compares them with expected, which
+// holds type, arg and value for each record. A record queued while the
+// endpoint was idle is sent on its own, the rest follows in the next packet.
+static int checkEvents(const uint16_t* expected, int count) {
+    uint8_t buf[EVENT_PACKET_SIZE];
+    uint8_t* r = buf;
+    int len = 0;
+    int i;
+
+    for (i = 0; i < count; i++, r += 4, len -= 4) {
+        const uint16_t* e = expected + i * 3;
+        if (!len) {
+            len = simIn(EVENT_EP, buf, sizeof(buf));
+            CHECK(len > 0 && len % 4 == 0);
+            r = buf;
+        }
+        if (r[0] != e[0] || r[1] != e[1] || (r[2] | (r[3] << 8)) != e[2]) {
+            printf("  event %i: %02x %02x %u, expected %02x %02x %u\n", i, r[0], r[1],
+                    r[2] | (r[3] << 8), e[0], e[1], e[2]);
+            return 1;
+        }
+    }
+    CHECK(len == 0);
+    CHECK(simIn(EVENT_EP, buf, sizeof(buf)) == SIM_NAK);
+    return 0;
+}
+
+static int scenarioEvents(void) {
+    static const uint8_t once[] = { SEQ_VERSION, SEQ_LED_ON, U16(20), SEQ_LED_OFF, U16(20), 0x00 };
+    static const uint8_t badOpcode[] = { SEQ_VERSION, SEQ_LED_ON, U16(20), 0x40 };
+    static const uint8_t badReturn[] = { SEQ_VERSION, SEQ_RET };
+    static const uint16_t reset[] = { EVENT_BUS_RESET, 0, 0 };
+    static const uint16_t done[] = { EVENT_SEQUENCE_DONE, 0, 0 };
+    static const uint16_t opcode[] = {
+        EVENT_ERROR, ERROR_SEQ_OPCODE, 4,
+        EVENT_SEQUENCE_DONE, 0, 0,
+    };
+    static const uint16_t stack[] = {
+        EVENT_ERROR, ERROR_SEQ_STACK, 1,
+        EVENT_SEQUENCE_DONE, 0, 0,
+    };
+    static const uint16_t shortUpload[] = { EVENT_ERROR, ERROR_SEQ_SHORT, sizeof(once) - 1 };
+    static const uint16_t shortChunk[] = { EVENT_ERROR, ERROR_SEQ_SHORT, 3 };
+    static const uint16_t stream[] = {
+        EVENT_ERROR, ERROR_STREAM_OVERRUN, STREAM_FRAMES_PER_PACKET,
+        EVENT_STREAM_LOW, 0, STREAM_FRAMES - 8,
+        EVENT_ERROR, ERROR_STREAM_UNDERRUN, 1,
+    };
+    int i;
+
+    // nothing before the bus reset
+    CHECK(simEnumerate() >= 0);
+    if (checkEvents(reset, 1)) {
+        return 1;
+    }
+
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, once + 1, sizeof(once) - 1) >= 0);
+    simWait(30);
+    if (checkEvents(NULL, 0)) {
+        return 1;
+    }
+    simWait(30);
+    if (checkEvents(done, 1)) {
+        return 1;
+    }
+
+    // errors end the sequence, the value is the program counter
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, badOpcode + 1, sizeof(badOpcode) - 1) >= 0);
+    simWait(40);
+    if (checkEvents(opcode, 2)) {
+        return 1;
+    }
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, badReturn + 1, sizeof(badReturn) - 1) >= 0);
+    simWait(10);
+    if (checkEvents(stack, 2)) {
+        return 1;
+    }
+
+    // a data stage that ends before wLength is dropped, nothing plays
+    CHECK(simControlOutShort(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, 40,
+            once + 1, sizeof(once) - 1) >= 0);
+    simWait(60);
+    if (checkEvents(shortUpload, 1)) {
+        return 1;
+    }
+    // so is a program whose first chunk was short, at its last chunk
+    CHECK(simControlOutShort(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 8, 40,
+            once + 1, 3) >= 0);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0,
+            once + 1, sizeof(once) - 1) >= 0);
+    simWait(60);
+    if (checkEvents(shortChunk, 1)) {
+        return 1;
+    }
+
+    // overrun on the third packet, then the ring drains past the watermark
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_START_STREAM, 0, 0, NULL, 0) == 0);
+    for (i = 0; i < STREAM_FRAMES / STREAM_FRAMES_PER_PACKET + 1; i++) {
+        CHECK(sendFrames(1, 1, 0) == STREAM_FRAMES_PER_PACKET * 4);
+    }
+    simWait(100);
+    if (checkEvents(stream, 3)) {
+        return 1;
+    }
+
+    // a bus reset drops the queue
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_START_STREAM, 0, 0, NULL, 0) == 0);
+    simWait(10);
+    CHECK(simEnumerate() >= 0);
+    return checkEvents(reset, 1);
+}
+
+static int readStats(uint16_t* stats) {
+    uint8_t buf[STATS_COUNTERS * 2];
+    int i;
+
+    if (simControlIn(TYPE_IN_ITF, COMMAND_READ_STATS, 0, 0, buf, sizeof(buf)) != sizeof(buf)) {
+        return -1;
+    }
+    for (i = 0; i < STATS_COUNTERS; i++) {
+        stats[i] = buf[i * 2] | (buf[i * 2 + 1] << 8);
+    }
+    return 0;
+}
+
+static int scenarioStats(void) {
+    uint16_t st[STATS_COUNTERS];
+    uint8_t buf[STATS_COUNTERS * 2];
+
+    // reset, GET_DESCRIPTOR, SET_ADDRESS, SET_CONFIGURATION; the answer is
+    // filled in the SETUP of the read
+    CHECK(simEnumerate() >= 0);
+    CHECK(readStats(st) == 0);
+    CHECK(st[STATS_SETUP] == 4 && st[STATS_IN + 0] == 3 && st[STATS_OUT + 0] == 1);
+    CHECK(st[STATS_BUS_RESETS] == 1 && st[STATS_STALLS] == 0 && st[STATS_VENDOR_UNSUPPORTED] == 0);
+    CHECK(st[STATS_SUSPENDS] == 0 && st[STATS_OUT + STREAM_EP] == 0);
+
+    // STALLs: an unknown vendor request, a known one in the wrong direction
+    // (not unsupported) and an unknown descriptor
+    CHECK(simControlOut(TYPE_OUT_ITF, 0xEE, 0, 0, NULL, 0) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_READ_STATS, 0, 0, NULL, 0) == SIM_STALL);
+    CHECK(simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, 0x0F00, 0, buf, 8) == SIM_STALL);
+    CHECK(sendFrames(1, 10, 0) > 0);
+    CHECK(readStats(st) == 0);
+    CHECK(st[STATS_SETUP] == 8 && st[STATS_IN + 0] == 4 && st[STATS_OUT + 0] == 2);
+    CHECK(st[STATS_STALLS] == 3 && st[STATS_VENDOR_UNSUPPORTED] == 1);
+    CHECK(st[STATS_OUT + STREAM_EP] == 1 && st[STATS_IN + STREAM_EP] == 0);
+
+    // a shorter wLength cuts the answer
+    CHECK(simControlIn(TYPE_IN_ITF, COMMAND_READ_STATS, 0, 0, buf, 10) == 10);
+    CHECK((buf[0] | (buf[1] << 8)) == 9);
+    return 0;
+}
+
+// reads the trace with wLength for max records into type / arg / time
+// triples, returns the record count or -1
+static int readTrace(uint16_t* records, int max, uint16_t* now, uint8_t* lost) {
+    uint8_t buf[4 + TRACE_PER_READ * 4];
+    int len;
+    int i;
+
+    len = simControlIn(TYPE_IN_ITF, COMMAND_READ_TRACE, 0, 0, buf, 4 + max * 4);
+    if (len < 4 || len % 4) {
+        return -1;
+    }
+    *now = buf[0] | (buf[1] << 8);
+    *lost = buf[2];
+    for (i = 0; i < len / 4 - 1; i++) {
+        const uint8_t* r = buf + 4 + i * 4;
+        records[i * 3] = r[0];
+        records[i * 3 + 1] = r[1];
+        records[i * 3 + 2] = r[2] | (r[3] << 8);
+    }
+    return len / 4 - 1;
+}
+
+// compares the types and args of records with expected type / arg pairs
+static int checkTrace(const uint16_t* records, const uint16_t* expected, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const uint16_t* r = records + i * 3;
+        if (r[0] != expected[i * 2] || r[1] != expected[i * 2 + 1]) {
+            printf("  record %i: %02x %02x, expected %02x %02x\n", i, r[0], r[1],
+                    expected[i * 2], expected[i * 2 + 1]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int scenarioTrace(void) {
+    static const uint8_t once[] = { SEQ_VERSION, SEQ_LED_ON, U16(20), SEQ_LED_OFF, U16(20), 0x00 };
+    static const uint16_t enumeration[] = {
+        TRACE_BUS_RESET, 0,
+        TRACE_EVENT, EVENT_BUS_RESET,
+        TRACE_SETUP, USB_GET_DESCRIPTOR,
+        TRACE_SETUP, USB_SET_ADDRESS,
+        TRACE_SETUP, USB_SET_CONFIGURATION,
+        TRACE_SETUP, COMMAND_READ_TRACE,
+    };
+    static const uint16_t sequence[] = {
+        TRACE_SETUP, COMMAND_SET_BLINK_SEQUENCE,
+        TRACE_SEQ_STEP, 3,
+        TRACE_SEQ_STEP, 6,
+        TRACE_EVENT, EVENT_SEQUENCE_DONE,
+        TRACE_SETUP, COMMAND_READ_TRACE,
+    };
+    uint16_t r[TRACE_PER_READ * 3];
+    uint16_t now;
+    uint8_t lost;
+    int count;
+    int n;
+    int i;
+
+    CHECK(simEnumerate() >= 0);
+    CHECK(readTrace(r, TRACE_PER_READ, &now, &lost) == 6 && lost == 0);
+    if (checkTrace(r, enumeration, 6)) {
+        return 1;
+    }
+    for (i = 1; i < 6; i++) {
+        CHECK((uint16_t)(r[i * 3 + 2] - r[(i - 1) * 3 + 2]) < TRACE_TICKS_PER_MS);
+    }
+    CHECK((uint16_t)(now - r[5 * 3 + 2]) < TRACE_TICKS_PER_MS);
+
+    // the steps are 20 ms apart, the event follows the last one
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, once + 1, sizeof(once) - 1) >= 0);
+    simWait(60);
+    CHECK(readTrace(r, TRACE_PER_READ, &now, &lost) == 5 && lost == 0);
+    if (checkTrace(r, sequence, 5)) {
+        return 1;
+    }
+    CHECK(r[2 * 3 + 2] - r[1 * 3 + 2] == 20 * TRACE_TICKS_PER_MS);
+    CHECK(r[3 * 3 + 2] - r[2 * 3 + 2] == 20 * TRACE_TICKS_PER_MS);
+    CHECK(now - r[4 * 3 + 2] < TRACE_TICKS_PER_MS);
+
+    // a full ring drops the new records, the next read reports them
+    for (i = 0; i < TRACE_RECORDS + 8; i++) {
+        CHECK(readBlinkTime() >= 0);
+    }
+    CHECK(readTrace(r, 1, &now, &lost) == 1 && lost == 8 + 1);
+    CHECK(r[0] == TRACE_SETUP && r[1] == COMMAND_READ_BLINK_TIME);
+    // the rest, each read adds its own SETUP
+    count = 0;
+    do {
+        n = readTrace(r, TRACE_PER_READ, &now, &lost);
+        CHECK(n > 0 && lost == 0);
+        for (i = 0; i < n; i++) {
+            count += r[i * 3 + 1] == COMMAND_READ_BLINK_TIME;
+        }
+    } while (n == TRACE_PER_READ);
+    CHECK(count == TRACE_RECORDS - 1);
+    CHECK(r[(n - 1) * 3] == TRACE_SETUP && r[(n - 1) * 3 + 1] == COMMAND_READ_TRACE);
+    return 0;
+}
+
+// sends a batch and reads its result block, returns the block length or -1
+static int runBatch(const uint8_t* batch, int len, uint8_t* result) {
+    if (simControlOut(TYPE_OUT_ITF, COMMAND_BATCH, SEQ_VERSION, 0, batch, len) != len) {
+        return -1;
+    }
+    return simControlIn(TYPE_IN_ITF, COMMAND_READ_BATCH, 0, 0, result, BATCH_RESULT_SIZE);
+}
+
+static int scenarioBatch(void) {
+    // 52 bytes, two packets: the second fragment straddles the packet border
+    static const uint8_t batch[] = {
+        COMMAND_SET_BLINK_TIME, U16(300),
+        COMMAND_READ_BLINK_TIME,
+        COMMAND_TOGGLE_BLINK,
+        COMMAND_READ_BLINK_TIME,
+        COMMAND_SET_BLINK_SEQUENCE, U16(32), 7,
+            SEQ_LED_ON, U16(50), SEQ_LED_OFF, U16(70), SEQ_RET,
+        COMMAND_SET_BLINK_SEQUENCE, U16(0), 30,
+            SEQ_CALL, U16(32), SEQ_LED_ON, U16(20), 0x00,
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        COMMAND_READ_STREAM_STATUS
+    };
+    static const uint32_t expected[] = { 50, 70, 20, 100 };
+    static const uint8_t badCode[] = { COMMAND_TOGGLE_BLINK, COMMAND_JUMP_TO_BOOTLOADER, COMMAND_TOGGLE_BLINK };
+    static const uint8_t badRange[] = { COMMAND_SET_BLINK_SEQUENCE, U16(250), 10 };
+    static const uint8_t shortArg[] = { COMMAND_READ_BLINK_TIME, COMMAND_SET_BLINK_TIME, 0x10 };
+    uint8_t reads[9];
+    uint8_t result[BATCH_RESULT_SIZE];
+    uint8_t big[600];
+
+    CHECK(simEnumerate() >= 0);
+
+    CHECK(sizeof(batch) == 52);
+    ledOff();
+    simClearEdges();
+    CHECK(runBatch(batch, sizeof(batch), result) == 14);
+    CHECK(result[0] == 7 && result[1] == BATCH_ERROR_NONE);
+    CHECK((result[2] | (result[3] << 8)) == 300);
+    CHECK((result[4] | (result[5] << 8)) == 250);
+    CHECK((result[6] | (result[7] << 8)) == STREAM_FRAMES);
+    simWait(400);
+    CHECK(simEdgeLevel[0] == 1);
+    if (checkEdges(0, expected, sizeof(expected) / sizeof(expected[0]))) {
+        return 1;
+    }
+
+    // the first error skips the rest, the executed ones stay done
+    CHECK(runBatch(badCode, sizeof(badCode), result) == 2);
+    CHECK(result[0] == 1 && result[1] == BATCH_ERROR_CODE);
+    CHECK(readBlinkTime() == 250);
+    CHECK(runBatch(badRange, sizeof(badRange), result) == 2);
+    CHECK(result[0] == 0 && result[1] == BATCH_ERROR_RANGE);
+    CHECK(runBatch(shortArg, sizeof(shortArg), result) == 4);
+    CHECK(result[0] == 1 && result[1] == BATCH_ERROR_SHORT);
+    memset(reads, COMMAND_READ_BLINK_TIME, sizeof(reads));
+    CHECK(runBatch(reads, sizeof(reads), result) == BATCH_RESULT_SIZE);
+    CHECK(result[0] == 7 && result[1] == BATCH_ERROR_FULL);
+    CHECK(readBlinkTime() == 250);
+
+    // newer bytecode versions and data stages above 512 bytes stall
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_BATCH, SEQ_VERSION + 1, 0, reads, 1) == SIM_STALL);
+    memset(big, COMMAND_TOGGLE_BLINK, sizeof(big));
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_BATCH, SEQ_VERSION, 0, big, sizeof(big)) == SIM_STALL);
+    CHECK(runBatch(big, 254, result) == 2);
+    CHECK(result[0] == 254 && result[1] == BATCH_ERROR_NONE);
+    return readBlinkTime() == 250 ? 0 : 1;
+}
+
+// the interrupts add up their time and count over the load window
+static int scenarioLoad(void) {
+    uint8_t buf[COMMAND_READ_LOAD_SIZE];
+    uint32_t busy;
+    uint16_t wakeups;
+    int i;
+
+    CHECK(simEnumerate() >= 0);
+    simClearEdges();
+    for (i = 0; i < 250; i++) {
+        CHECK(readBlinkTime() == 250);
+        simWait(10);
+    }
+    CHECK(checkPeriod(250, 9) == 0);
+
+    // the last window saw every milli second and 100 reads of SETUP, IN and
+    // the status OUT; the simulated Timer2 count only moves between the
+    // ticks, so the interrupts take no time here
+    CHECK(simControlIn(TYPE_IN_ITF, COMMAND_READ_LOAD, 0, 0, buf, sizeof(buf)) == sizeof(buf));
+    busy = buf[0] | (buf[1] << 8) | ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+    wakeups = buf[4] | (buf[5] << 8);
+    printf("  device: %u interrupts, %u busy Timer2 counts in %u ms\n", wakeups, busy,
+            buf[6] | (buf[7] << 8));
+    CHECK((buf[6] | (buf[7] << 8)) == LOAD_WINDOW_MS);
+    CHECK(wakeups == LOAD_WINDOW_MS + 100 * 3);
+    return 0;
+}
+
+// compiles a timeline (usb_blink_seq.c) and compares the bytecode
+static int checkCompile(const char* text, unsigned int toleranceMs, const uint8_t* expected,
+        int len, BlinkySeqReport* report) {
+    uint8_t code[SEQ_PROGRAM_SIZE];
+    char error[128] = "";
+    int ret;
+    int i;
+
+    ret = blinkyCompileSequence(text, code, sizeof(code), toleranceMs, report, error, sizeof(error));
+    if (ret != len || memcmp(code, expected, len)) {
+        printf("  '%s': %i bytes, expected %i %s\n   ", text, ret, len, error);
+        for (i = 0; i < ret; i++) {
+            printf(" %02X", code[i]);
+        }
+        printf("\n");
+        return 1;
+    }
+    return 0;
+}
+
+// a timeline that does not compile, the message contains error
+static int checkCompileError(const char* text, const char* error) {
+    uint8_t code[SEQ_PROGRAM_SIZE];
+    char msg[128] = "";
+
+    if (blinkyCompileSequence(text, code, sizeof(code), 0, NULL, msg, sizeof(msg)) != -1
+            || !strstr(msg, error)) {
+        printf("  '%s': '%s', expected '%s'\n", text, msg, error);
+        return 1;
+    }
+    return 0;
+}
+
+// the timeline compiler picks the encodings, the device plays the result
+static int scenarioCompile(void) {
+    static const uint8_t merged[] = { SEQ_LED_ON, U16(200), SEQ_LED_OFF, U16(200), 0 };
+    static const uint8_t folded[] = { SEQ_LED_ON, U16(300), 0 };
+    static const uint8_t unrolled[] = { 0x11, 0x01, 0x11, 0x01, 0 };
+    static const uint8_t loop[] = {
+        SEQ_LOOP, 3, SEQ_LED_ON, U16(30), SEQ_LED_OFF, U16(70), SEQ_ENDLOOP,
+        SEQ_LED_ON, U16(250), SEQ_LED_OFF, U16(10), 0
+    };
+    static const uint8_t shortJump[] = { 0x11, 0x01, 0x80 };
+    static const uint8_t exact[] = { SEQ_LED_ON, U16(100), SEQ_LED_OFF, U16(50), 0 };
+    static const uint8_t partly[] = { SEQ_LED_ON, U16(100), 0x01, 0 };
+    static const uint8_t quantised[] = { 0x12, 0x01, 0 };
+    static const uint32_t expected[] = { 30, 70, 30, 70, 30, 70, 250 };
+    uint8_t longJump[SEQ_PROGRAM_SIZE];
+    char text[1024];
+    BlinkySeqReport rep;
+    int n = 0;
+    int i;
+
+    CHECK(checkCompile("on 100 wait 50 on 50 # merged\noff 0.2s", 0, merged, sizeof(merged), NULL) == 0);
+    CHECK(checkCompile("repeat 3 { on 100 }", 0, folded, sizeof(folded), NULL) == 0);
+    CHECK(checkCompile("repeat 2 { on 64 off 64 }", 0, unrolled, sizeof(unrolled), NULL) == 0);
+    CHECK(checkCompile("repeat 3 { on 30 off 70 } on 250 off 10", 0, loop, sizeof(loop), &rep) == 0);
+    CHECK(rep.loopDepth == 1 && rep.durationMs == 560 && rep.errorMs == 0);
+
+    // a forever repeat jumps back, with the one byte jump up to address 31
+    CHECK(checkCompile("repeat 0 { on 64 off 64 }", 0, shortJump, sizeof(shortJump), NULL) == 0);
+    for (i = 0; i < 6; i++) {
+        longJump[n++] = SEQ_LED_ON;
+        longJump[n++] = 10;
+        longJump[n++] = 0;
+        longJump[n++] = SEQ_LED_OFF;
+        longJump[n++] = 10;
+        longJump[n++] = 0;
+    }
+    longJump[n++] = 0x11;
+    longJump[n++] = 0x01;
+    longJump[n++] = SEQ_JUMP;
+    longJump[n++] = 36;
+    longJump[n++] = 0;
+    CHECK(checkCompile("on 10 off 10 on 10 off 10 on 10 off 10 on 10 off 10 on 10 off 10 "
+            "on 10 off 10 repeat 0 { on 64 off 64 }", 0, longJump, n, NULL) == 0);
+
+    // the one byte 64 ms opcodes only within the tolerance
+    CHECK(checkCompile("on 100 off 50", 0, exact, sizeof(exact), &rep) == 0);
+    CHECK(rep.errorMs == 0 && rep.maxErrorMs == 0);
+    CHECK(checkCompile("on 100 off 50", 20, partly, sizeof(partly), &rep) == 0);
+    CHECK(rep.errorMs == 14 && rep.maxErrorMs == 14);
+    CHECK(checkCompile("on 100 off 50", 40, quantised, sizeof(quantised), &rep) == 0);
+    CHECK(rep.errorMs == 28 + 14 && rep.maxErrorMs == 28);
+
+    // too large, nested too deep, syntax errors
+    n = 0;
+    for (i = 1; i <= 70; i++) {
+        n += sprintf(text + n, "level %i 10\n", i);
+    }
+    CHECK(checkCompileError(text, "more than the 256 bytes") == 0);
+    CHECK(blinkyCompileSequence(text, longJump, sizeof(longJump), 0, &rep, NULL, 0) == -1);
+    CHECK(rep.size == SEQ_PROGRAM_SIZE + 1);
+    CHECK(checkCompileError("on 1000000000000", "more than the 256 bytes") == 0);
+    strcpy(text, "on 10 off 10");
+    for (i = 0; i < 9; i++) {
+        memmove(text + 11, text, strlen(text) + 1);
+        memcpy(text, "repeat 2 { ", 11);
+        strcat(text, " }");
+        if (i == 7) {
+            CHECK(blinkyCompileSequence(text, longJump, sizeof(longJump), 0, &rep, NULL, 0) > 0);
+            CHECK(rep.loopDepth == 8);
+        }
+    }
+    CHECK(checkCompileError(text, "deeper than the device stack") == 0);
+    CHECK(checkCompileError("on 5\nblink 5", "line 2: unknown step") == 0);
+    CHECK(checkCompileError("on 5 }", "} without repeat") == 0);
+    CHECK(checkCompileError("repeat 2 { on 5", "missing }") == 0);
+    CHECK(checkCompileError("repeat 0 { on 5 } off 5", "forever repeat must be the last") == 0);
+    CHECK(checkCompileError("repeat 0 { fade 0 0 }", "forever repeat needs a duration") == 0);
+    CHECK(checkCompileError("fade 10 70000", "at most 65535 ms") == 0);
+    CHECK(checkCompileError("level 256 10", "invalid number") == 0);
+    CHECK(checkCompileError("on -5", "invalid duration") == 0);
+    CHECK(checkCompileError("on nans", "invalid duration") == 0);
+    CHECK(checkCompileError("on 1000000000000000", "duration too long") == 0);
+    CHECK(checkCompileError("on 2e9s", "duration too long") == 0);
+    CHECK(checkCompileError("repeat 255 { on 999999999999 }", "duration too long") == 0);
+    CHECK(checkCompileError("# only a comment", "empty timeline") == 0);
+
+    // the compiled loop plays with the times of the timeline
+    CHECK(simEnumerate() >= 0);
+    ledOff();
+    simClearEdges();
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0, loop, sizeof(loop)) == sizeof(loop));
+    simWait(700);
+    CHECK(simEdgeLevel[0] == 1);
+    return checkEdges(0, expected, sizeof(expected) / sizeof(expected[0]));
+}
+
+// CRC-16/CCITT of the saved program
+static uint16_t crc16(const uint8_t* data, int len) {
+    uint16_t crc = 0xFFFF;
+    int i;
+
+    while (len--) {
+        crc ^= *data++ << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static int readSaved(uint8_t* saved) {
+    return simControlIn(TYPE_IN_ITF, COMMAND_READ_SAVED, 0, 0, saved, COMMAND_READ_SAVED_SIZE)
+            == COMMAND_READ_SAVED_SIZE ? 0 : -1;
+}
+
+// polls until the main loop wrote the record, like the host does
+static int waitSaved(uint8_t* saved) {
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        simWait(1);
+        if (readSaved(saved) || saved[0] != SAVED_BUSY) {
+            break;
+        }
+    }
+    return saved[0] == SAVED_BUSY ? -1 : 0;
+}
+
+// on 30 ms, off 70 ms, forever
+static const uint8_t savedProgram[] = {
+    SEQ_LED_ON, U16(30),
+    SEQ_LED_OFF, U16(70),
+    0x80
+};
+
+static int scenarioSave(void) {
+    uint16_t crc = crc16(savedProgram, sizeof(savedProgram));
+    uint8_t saved[COMMAND_READ_SAVED_SIZE];
+    int i;
+
+    CHECK(simEnumerate() >= 0);
+    CHECK(readSaved(saved) == 0 && saved[0] == SAVED_NONE);
+    // nothing to save before a program arrived
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, sizeof(savedProgram), 0, NULL, 0) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SET_BLINK_SEQUENCE, SEQ_VERSION, 0,
+            savedProgram, sizeof(savedProgram)) == sizeof(savedProgram));
+
+    // the main loop writes the record after the request, a second request
+    // meanwhile stalls, so does a program larger than the DataFlash
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, SAVE_PROGRAM_MAX + 1, 0, NULL, 0) == SIM_STALL);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, sizeof(savedProgram), 0, NULL, 0) == 0);
+    CHECK(readSaved(saved) == 0 && saved[0] == SAVED_BUSY);
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, sizeof(savedProgram), 0, NULL, 0) == SIM_STALL);
+    CHECK(waitSaved(saved) == 0);
+    CHECK(saved[0] == SAVED_VALID && saved[1] == sizeof(savedProgram));
+    CHECK((saved[2] | (saved[3] << 8)) == crc);
+
+    CHECK(ch554SimDataFlash[0] == SAVE_MAGIC);
+    CHECK(ch554SimDataFlash[1] == sizeof(savedProgram));
+    CHECK((ch554SimDataFlash[2] | (ch554SimDataFlash[3] << 8)) == crc);
+    for (i = 0; i < sizeof(savedProgram); i++) {
+        CHECK(ch554SimDataFlash[SAVE_HEADER_SIZE + i] == savedProgram[i]);
+    }
+    printf("  %u DataFlash bytes written for a %i byte program\n", simDataFlashWrites,
+            (int) sizeof(savedProgram));
+
+    // length 0 erases the record
+    CHECK(simControlOut(TYPE_OUT_ITF, COMMAND_SAVE_SEQUENCE, 0, 0, NULL, 0) == 0);
+    CHECK(waitSaved(saved) == 0 && saved[0] == SAVED_NONE);
+    CHECK(ch554SimDataFlash[0] != SAVE_MAGIC);
+    return 0;
+}
+
+// the DataFlash of a device that saved savedProgram
+static void bootSaved(void) {
+    uint16_t crc = crc16(savedProgram, sizeof(savedProgram));
+
+    ch554SimDataFlash[0] = SAVE_MAGIC;
+    ch554SimDataFlash[1] = sizeof(savedProgram);
+    ch554SimDataFlash[2] = crc & 0xFF;
+    ch554SimDataFlash[3] = crc >> 8;
+    memcpy(ch554SimDataFlash + SAVE_HEADER_SIZE, savedProgram, sizeof(savedProgram));
+}
+
+// a version 1 program, saved with its own magic
+static const uint8_t savedV1[] = { 0x33, 0x62, 0x71, 0x00 };
+
+static void bootSavedV1(void) {
+    uint16_t crc = crc16(savedV1, sizeof(savedV1));
+
+    ch554SimDataFlash[0] = SAVE_MAGIC_V1;
+    ch554SimDataFlash[1] = sizeof(savedV1);
+    ch554SimDataFlash[2] = crc & 0xFF;
+    ch554SimDataFlash[3] = crc >> 8;
+    memcpy(ch554SimDataFlash + SAVE_HEADER_SIZE, savedV1, sizeof(savedV1));
+}
+
+// a program byte changed after the save
+static void bootCorrupt(void) {
+    bootSaved();
+    ch554SimDataFlash[SAVE_HEADER_SIZE + 1] ^= 0x01;
+}
+
+// the saved program plays from the boot on, before the enumeration
+static int scenarioAutoplay(void) {
+    static const uint32_t expected[] = { 30, 70, 30, 70, 30, 70, 30, 70 };
+    uint8_t saved[COMMAND_READ_SAVED_SIZE];
+
+    simWait(500);
+    CHECK(simEdgeLevel[0] == 1);
+    printf("  saved program started %u ms after the power on\n", simEdgeTime[0]);
+    CHECK(simEdgeTime[0] < 10);
+    if (checkEdges(0, expected, sizeof(expected) / sizeof(expected[0]))) {
+        return 1;
+    }
+    CHECK(simEnumerate() >= 0);
+    CHECK(readSaved(saved) == 0);
+    CHECK(saved[0] == SAVED_VALID && saved[1] == sizeof(savedProgram));
+    CHECK((saved[2] | (saved[3] << 8)) == crc16(savedProgram, sizeof(savedProgram)));
+    return 0;
+}
+
+// the saved version 1 program plays with the version 1 opcodes
+static int scenarioAutoV1(void) {
+    static const uint32_t expected[] = { 192, 128, 64 };
+
+    simWait(500);
+    CHECK(simEdges >= 3 && simEdgeLevel[0] == 1 && simEdgeTime[0] < 10);
+    return checkEdges(0, expected, 3);
+}
+
+// a record with a wrong CRC is ignored, the default blinking starts
+static int scenarioCorrupt(void) {
+    uint8_t saved[COMMAND_READ_SAVED_SIZE];
+
+    simClearEdges();
+    simWait(1000);
+    if (checkPeriod(250, 3)) {
+        return 1;
+    }
+    CHECK(simEnumerate() >= 0);
+    CHECK(readSaved(saved) == 0 && saved[0] == SAVED_NONE);
+    return 0;
+}
+
+static int scenarioBoot(void) {
+    CHECK(simEnumerate() >= 0);
+    simControlOut(TYPE_OUT_ITF, COMMAND_JUMP_TO_BOOTLOADER, 0, 0, NULL, 0);
+    // bootloader() ends the process
+    printf("  firmware did not jump to the bootloader\n");
+    return 1;
+}
+
+static void printIsrStats(const char* title) {
+    static const char* names[SIM_TOKEN_TYPES] = { "SETUP", "IN", "OUT" };
+    int i;
+
+    printf("  %i x %s, interrupt handler cost on the host:\n", BENCH_TRANSFERS, title);
+    for (i = 0; i < SIM_TOKEN_TYPES; i++) {
+        SimIsrStats* s = &simIsrStats[i];
+        printf("  %-6s %8u tokens  avg %6.1f ns  max %8llu ns\n", names[i], s->count,
+                s->count ? (double) s->totalNs / s->count : 0.0, (unsigned long long) s->maxNs);
+    }
+}
+
+static int scenarioBench(void) {
+    uint8_t buf[64];
+    int i;
+
+    CHECK(simEnumerate() >= 0);
+    memset(simIsrStats, 0, sizeof(simIsrStats));
+    for (i = 0; i < BENCH_TRANSFERS; i++) {
+        CHECK(readBlinkTime() == 250);
+    }
+    printIsrStats("READ_BLINK_TIME");
+
+    // the standard request path: product string, 2 IN packets
+    memset(simIsrStats, 0, sizeof(simIsrStats));
+    for (i = 0; i < BENCH_TRANSFERS; i++) {
+        CHECK(simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, (USB_DESC_STR << 8) | 2, 0x0409,
+                buf, sizeof(buf)) == buf[0]);
+    }
+    printIsrStats("GET_DESCRIPTOR string 2");
+    return 0;
+}
+
+typedef struct Scenario {
+    const char* name;
+    int (*run)(void);
+    int exitStatus;     // expected exit status of the process
+    void (*boot)(void); // prepares the device before the power on, may be NULL
+} Scenario;
+
+static const Scenario scenarios[] = {
+    { "enum",     scenarioEnum,     0 },
+    { "blink",    scenarioBlink,    0 },
+    { "control",  scenarioControl,  0 },
+    { "sequence", scenarioSequence, 0 },
+    { "vm",       scenarioVm,       0 },
+    { "upload",   scenarioUpload,   0 },
+    { "fade",     scenarioFade,     0 },
+    { "channels", scenarioChannels, 0 },
+    { "swap",     scenarioSwap,     0 },
+    { "stream",   scenarioStream,   0 },
+    { "events",   scenarioEvents,   0 },
+    { "stats",    scenarioStats,    0 },
+    { "trace",    scenarioTrace,    0 },
+    { "batch",    scenarioBatch,    0 },
+    { "load",     scenarioLoad,     0 },
+    { "compile",  scenarioCompile,  0 },
+    { "save",     scenarioSave,     0 },
+    { "autoplay", scenarioAutoplay, 0, bootSaved },
+    { "autov1",   scenarioAutoV1,   0, bootSavedV1 },
+    { "corrupt",  scenarioCorrupt,  0, bootCorrupt },
+    { "boot",     scenarioBoot,     SIM_EXIT_BOOTLOADER },
+    { "bench",    scenarioBench,    0 },
+};
+
+#define SCENARIO_COUNT  (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static int runScenario(const Scenario* s) {
+    pid_t pid;
+    int status;
+
+    printf("%s:\n", s->name);
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        if (s->boot) {
+            s->boot();
+        }
+        simStart(blinkyMain);
+        // boot and USB setup
+        simWait(10);
+        status = s->run();
+        fflush(stdout);
+        _exit(status);
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != s->exitStatus) {
+        printf("%s: FAIL\n", s->name);
+        return 1;
+    }
+    printf("%s: ok\n", s->name);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned int i;
+    int failed = 0;
+    int found;
+    int a;
+
+    if (argc >= 2 && strcmp(argv[1], "-serve") == 0) {
+        simStart(blinkyMain);
+        simWait(10);
+        return simServe(argc > 2 ? argv[2] : SIM_SERVE_SOCKET) ? 1 : 0;
+    }
+    if (argc < 2) {
+        for (i = 0; i < SCENARIO_COUNT; i++) {
+            failed += runScenario(&scenarios[i]);
+        }
+        return failed;
+    }
+    for (a = 1; a < argc; a++) {
+        found = 0;
+        for (i = 0; i < SCENARIO_COUNT; i++) {
+            if (strcmp(argv[a], scenarios[i].name) == 0) {
+                failed += runScenario(&scenarios[i]);
+                found = 1;
+            }
+        }
+        if (!found) {
+            printf("unknown scenario: %s\n", argv[a]);
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,209 @@
+/******************************************************************************
+ * sim_serve.c - the simulated device behind a daemon socket
+ *
+ * Speaks the request / response protocol of 'usb_blink_pc -daemon' (see
+ * usb_blink_pc_host/usb_blink_lib.h), so the host tools and the benchmark
+ * can talk to the simulated firmware with blinkyOpenDaemon(). The simulated
+ * clock runs one milli second per poll loop pass.
+ *****************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sim.h"
+
+#define MAX_CLIENTS     16
+#define REQ_SIZE        8
+#define RES_SIZE        4
+#define MAX_DATA        512
+
+// libusb error codes expected by the clients
+#define LIBUSB_ERROR_IO             -1
+#define LIBUSB_ERROR_INVALID_PARAM  -2
+#define LIBUSB_ERROR_TIMEOUT        -7
+#define LIBUSB_ERROR_PIPE           -9
+
+typedef struct SimClient {
+    int fd;
+    int rxLen;
+    uint8_t rx[REQ_SIZE + MAX_DATA];
+} SimClient;
+
+static SimClient clients[MAX_CLIENTS];
+static volatile sig_atomic_t stopServe;
+
+
+static void onSignal(int sig) {
+    stopServe = 1;
+}
+
+static int toLibusbError(int ret) {
+    switch (ret) {
+    case SIM_STALL: return LIBUSB_ERROR_PIPE;
+    case SIM_NAK:   return LIBUSB_ERROR_TIMEOUT;
+    default:        return LIBUSB_ERROR_IO;
+    }
+}
+
+static int sendResponse(SimClient* c, int result, const uint8_t* data, uint16_t len) {
+    uint8_t buf[RES_SIZE + MAX_DATA];
+
+    buf[0] = result & 0xFF;
+    buf[1] = (result >> 8) & 0xFF;
+    buf[2] = len & 0xFF;
+    buf[3] = len >> 8;
+    if (len) {
+        memcpy(buf + RES_SIZE, data, len);
+    }
+    return send(c->fd, buf, RES_SIZE + len, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// run all complete requests of the client on the simulated device
+static int processClient(SimClient* c) {
+    uint8_t* hdr = c->rx;
+    uint8_t data[MAX_DATA];
+    uint16_t value, index, length;
+    int size;
+    int ret;
+
+    while (c->rxLen >= REQ_SIZE) {
+        value = hdr[2] | (hdr[3] << 8);
+        index = hdr[4] | (hdr[5] << 8);
+        length = hdr[6] | (hdr[7] << 8);
+        if (length > MAX_DATA) {
+            sendResponse(c, LIBUSB_ERROR_INVALID_PARAM, NULL, 0);
+            return -1;
+        }
+        size = REQ_SIZE + ((hdr[0] & 0x80) ? 0 : length);
+        if (c->rxLen < size) {
+            break;
+        }
+        if (hdr[0] & 0x80) {
+            ret = simControlIn(hdr[0], hdr[1], value, index, data, length);
+        } else {
+            ret = simControlOut(hdr[0], hdr[1], value, index, hdr + REQ_SIZE, length);
+        }
+        if (ret < 0) {
+            ret = sendResponse(c, toLibusbError(ret), NULL, 0);
+        } else {
+            ret = sendResponse(c, ret, data, (hdr[0] & 0x80) ? ret : 0);
+        }
+        if (ret) {
+            return -1;
+        }
+        c->rxLen -= size;
+        memmove(c->rx, c->rx + size, c->rxLen);
+    }
+    return 0;
+}
+
+static int openSocket(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 16)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int simServe(const char* path) {
+    struct pollfd fds[1 + MAX_CLIENTS];
+    int slot[1 + MAX_CLIENTS];
+    int listenFd;
+    int nfds;
+    int i, ret;
+
+    if (simEnumerate() < 0) {
+        fprintf(stderr, "sim: enumeration failed\n");
+        return -1;
+    }
+    listenFd = openSocket(path);
+    if (listenFd < 0) {
+        fprintf(stderr, "sim: can't listen on %s\n", path);
+        return -1;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+    }
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    printf("sim: serving the simulated device on %s\n", path);
+    fflush(stdout);
+
+    while (!stopServe) {
+        nfds = 0;
+        fds[nfds].fd = listenFd;
+        fds[nfds++].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0) {
+                slot[nfds] = i;
+                fds[nfds].fd = clients[i].fd;
+                fds[nfds++].events = POLLIN;
+            }
+        }
+        ret = poll(fds, nfds, 1);
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+        if (ret > 0 && (fds[0].revents & POLLIN)) {
+            int fd = accept(listenFd, NULL, NULL);
+            for (i = 0; i < MAX_CLIENTS && clients[i].fd >= 0; i++) {
+            }
+            if (fd >= 0 && i < MAX_CLIENTS) {
+                clients[i].fd = fd;
+                clients[i].rxLen = 0;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        for (i = 1; ret > 0 && i < nfds; i++) {
+            SimClient* c = &clients[slot[i]];
+            int n;
+
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            n = recv(c->fd, c->rx + c->rxLen, sizeof(c->rx) - c->rxLen, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n > 0) {
+                c->rxLen += n;
+                n = processClient(c) ? -1 : n;
+            }
+            if (n <= 0) {
+                close(c->fd);
+                c->fd = -1;
+            }
+        }
+        // let the firmware main loop run
+        simWait(1);
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            close(clients[i].fd);
+        }
+    }
+    close(listenFd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,270 @@
+/******************************************************************************
+ * usb_sim.c - USB host and SIE model
+ *
+ * Each token does what the CH55x SIE would do: it checks the address and the
+ * endpoint response bits, moves the data between the host and the endpoint
+ * buffer, checks / flips the data toggles and then runs the USB interrupt
+ * handler of the firmware with USB_INT_ST and UIF_TRANSFER set.
+ *****************************************************************************/
+#include <string.h>
+#include <time.h>
+
+#include <ch554.h>
+#include <ch554_usb.h>
+#include "usb_desc.h"
+
+#include "sim.h"
+
+SimIsrStats simIsrStats[SIM_TOKEN_TYPES];
+uint8_t simEp0Size = 8;
+
+static uint8_t hostAddress;
+static uint8_t hostTog[5][2];   // next DATA PID per endpoint, [OUT, IN]
+
+
+static volatile uint8_t* epCtrl(uint8_t ep) {
+    switch (ep) {
+    case 0: return &UEP0_CTRL;
+    case 1: return &UEP1_CTRL;
+    case 2: return &UEP2_CTRL;
+    case 3: return &UEP3_CTRL;
+    default: return &UEP4_CTRL;
+    }
+}
+
+static uint8_t epTxLen(uint8_t ep) {
+    switch (ep) {
+    case 0: return UEP0_T_LEN;
+    case 1: return UEP1_T_LEN;
+    case 2: return UEP2_T_LEN;
+    case 3: return UEP3_T_LEN;
+    default: return UEP4_T_LEN;
+    }
+}
+
+// endpoint buffer as selected by the DMA address, the mode and the toggle
+static uint8_t* epBuffer(uint8_t ep, uint8_t in) {
+    uint8_t ctrl = *epCtrl(ep);
+    uint8_t mod;
+    uint16_t offs = 0;
+
+    if (ep == 0) {
+        return Ep0Buffer;
+    }
+    if (ep == 4) {
+        // follows the EP0 buffer, which is a plain array in the simulation
+        return NULL;
+    }
+    mod = (ep == 1) ? UEP4_1_MOD >> 4 : (ep == 2) ? UEP2_3_MOD : UEP2_3_MOD >> 4;
+    if (in && (mod & bUEP2_RX_EN)) {
+        offs += (mod & bUEP2_BUF_MOD) ? 128 : 64;
+    }
+    if (mod & bUEP2_BUF_MOD) {
+        if (in ? (ctrl & bUEP_T_TOG) : (ctrl & bUEP_R_TOG)) {
+            offs += 64;
+        }
+    }
+    return ch554SimXram + ((ep == 1) ? UEP1_DMA : (ep == 2) ? UEP2_DMA : UEP3_DMA) + offs;
+}
+
+static int elapsedNs(struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000 + (now.tv_nsec - start->tv_nsec);
+}
+
+static int runIsr(uint8_t token, uint8_t ep, uint8_t type) {
+    SimIsrStats* s = &simIsrStats[type];
+    struct timespec start;
+    int ns;
+
+    // with bUC_INT_BUSY the SIE NAKs while the interrupt is pending
+    if (!EA || !IE_USB) {
+        return SIM_NAK;
+    }
+    USB_INT_ST = token | ep;
+    UIF_TRANSFER = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DeviceInterrupt();
+    ns = elapsedNs(&start);
+    s->count++;
+    s->totalNs += ns;
+    if (ns > s->maxNs) {
+        s->maxNs = ns;
+    }
+    return 0;
+}
+
+static int addressed(void) {
+    return (USB_DEV_AD & 0x7F) == hostAddress;
+}
+
+static int simSetup(const uint8_t* setup) {
+    if (!addressed()) {
+        return SIM_PROTOCOL;
+    }
+    // SETUP is always accepted, it clears a STALL
+    memcpy(Ep0Buffer, setup, sizeof(USB_SETUP_REQ));
+    USB_RX_LEN = sizeof(USB_SETUP_REQ);
+    U_TOG_OK = 1;
+    hostTog[0][0] = 1;
+    hostTog[0][1] = 1;
+    return runIsr(UIS_TOKEN_SETUP, 0, SIM_TOKEN_SETUP);
+}
+
+int simIn(uint8_t ep, uint8_t* data, uint16_t maxLen) {
+    volatile uint8_t* ctrl = epCtrl(ep);
+    uint8_t* buf = epBuffer(ep, 1);
+    uint8_t len;
+    int ret;
+
+    if (!addressed() || buf == NULL) {
+        return SIM_PROTOCOL;
+    }
+    switch (*ctrl & MASK_UEP_T_RES) {
+    case UEP_T_RES_STALL:
+        return SIM_STALL;
+    case UEP_T_RES_ACK:
+        break;
+    default:
+        return SIM_NAK;
+    }
+    if (((*ctrl & bUEP_T_TOG) ? 1 : 0) != hostTog[ep][1]) {
+        return SIM_PROTOCOL;
+    }
+    len = epTxLen(ep);
+    if (len > maxLen) {
+        // babble
+        return SIM_PROTOCOL;
+    }
+    memcpy(data, buf, len);
+    hostTog[ep][1] ^= 1;
+    if (*ctrl & bUEP_AUTO_TOG) {
+        *ctrl ^= bUEP_T_TOG;
+    }
+    ret = runIsr(UIS_TOKEN_IN, ep, SIM_TOKEN_IN);
+    return ret ? ret : len;
+}
+
+int simOut(uint8_t ep, const uint8_t* data, uint16_t len) {
+    volatile uint8_t* ctrl = epCtrl(ep);
+    uint8_t* buf = epBuffer(ep, 0);
+
+    if (!addressed() || buf == NULL) {
+        return SIM_PROTOCOL;
+    }
+    switch (*ctrl & MASK_UEP_R_RES) {
+    case UEP_R_RES_STALL:
+        return SIM_STALL;
+    case UEP_R_RES_ACK:
+        break;
+    default:
+        return SIM_NAK;
+    }
+    if (!EA || !IE_USB) {
+        return SIM_NAK;
+    }
+    if (len) {
+        memcpy(buf, data, len);
+    }
+    USB_RX_LEN = len;
+    U_TOG_OK = ((*ctrl & bUEP_R_TOG) ? 1 : 0) == hostTog[ep][0];
+    if (U_TOG_OK && (*ctrl & bUEP_AUTO_TOG)) {
+        *ctrl ^= bUEP_R_TOG;
+    }
+    hostTog[ep][0] ^= 1;
+    runIsr(UIS_TOKEN_OUT, ep, SIM_TOKEN_OUT);
+    return len;
+}
+
+void simBusReset(void) {
+    hostAddress = 0;
+    simEp0Size = 8;
+    memset(hostTog, 0, sizeof(hostTog));
+    if (EA && IE_USB) {
+        UIF_BUS_RST = 1;
+        DeviceInterrupt();
+    }
+}
+
+static void makeSetup(uint8_t* setup, uint8_t requestType, uint8_t request,
+        uint16_t value, uint16_t index, uint16_t len) {
+    setup[0] = requestType;
+    setup[1] = request;
+    setup[2] = value & 0xFF;
+    setup[3] = value >> 8;
+    setup[4] = index & 0xFF;
+    setup[5] = index >> 8;
+    setup[6] = len & 0xFF;
+    setup[7] = len >> 8;
+}
+
+int simControlOut(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, const uint8_t* data, uint16_t len) {
+    return simControlOutShort(requestType, request, value, index, len, data, len);
+}
+
+int simControlOutShort(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, uint16_t wLength, const uint8_t* data, uint16_t len) {
+    uint8_t setup[8];
+    uint8_t status[1];
+    uint16_t pos = 0;
+    int ret;
+
+    makeSetup(setup, requestType, request, value, index, wLength);
+    ret = simSetup(setup);
+    while (ret >= 0 && pos < len) {
+        uint16_t n = (len - pos > simEp0Size) ? simEp0Size : len - pos;
+        ret = simOut(0, data + pos, n);
+        pos += n;
+    }
+    if (ret >= 0) {
+        ret = simIn(0, status, 0);
+    }
+    if (ret >= 0 && request == USB_SET_ADDRESS && !(requestType & USB_REQ_TYP_MASK)) {
+        hostAddress = value & 0x7F;
+    }
+    return (ret < 0) ? ret : len;
+}
+
+int simControlIn(uint8_t requestType, uint8_t request, uint16_t value,
+        uint16_t index, uint8_t* data, uint16_t len) {
+    uint8_t setup[8];
+    uint16_t pos = 0;
+    int ret;
+
+    makeSetup(setup, requestType, request, value, index, len);
+    ret = simSetup(setup);
+    while (ret >= 0 && pos < len) {
+        ret = simIn(0, data + pos, simEp0Size);
+        if (ret < 0) {
+            break;
+        }
+        pos += ret;
+        if (ret < simEp0Size) {
+            break;
+        }
+    }
+    if (ret >= 0) {
+        ret = simOut(0, NULL, 0);
+    }
+    return (ret < 0) ? ret : pos;
+}
+
+int simEnumerate(void) {
+    uint8_t desc[18];
+    int ret;
+
+    simBusReset();
+    ret = simControlIn(USB_REQ_TYP_IN, USB_GET_DESCRIPTOR, USB_DESC_DEV << 8, 0, desc, 8);
+    if (ret != 8) {
+        return (ret < 0) ? ret : SIM_PROTOCOL;
+    }
+    simEp0Size = desc[7];
+    ret = simControlOut(USB_REQ_TYP_OUT, USB_SET_ADDRESS, SIM_DEVICE_ADDRESS, 0, NULL, 0);
+    if (ret >= 0) {
+        ret = simControlOut(USB_REQ_TYP_OUT, USB_SET_CONFIGURATION, 1, 0, NULL, 0);
+    }
+    return ret;
+}